@@ -0,0 +1,159 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_FUTURE_H_
+#define PS_FUTURE_H_
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "ps/base.h"
+namespace ps {
+template<typename Val> class KVWorker;
+
+/**
+ * \brief a handle to the completion of an asynchronous operation, such as the
+ * push or pull returned by \ref KVWorker::PushAsync and \ref
+ * KVWorker::PullAsync
+ *
+ * it is cheap to copy, and all copies refer to the same completion. besides
+ * waiting, continuations can be chained by \ref Then and many futures can be
+ * combined by \ref WhenAll.
+ *
+ * Sample usage:
+ * \code
+ *   std::vector<Future> fs;
+ *   for (auto& layer : layers) {
+ *     fs.push_back(w.PushAsync(layer.keys, layer.grads).Then([&w, &layer] {
+ *           return w.PullAsync(layer.keys, &layer.weights);
+ *         }));
+ *   }
+ *   Future::WhenAll(fs).Wait();
+ * \endcode
+ */
+class Future {
+ public:
+  /** \brief a task to run */
+  using Task = std::function<void()>;
+  /**
+   * \brief runs a task somewhere, such as a thread pool. an empty executor
+   * runs it on the thread finishing the future
+   */
+  using Executor = std::function<void(Task)>;
+
+  /** \brief a finished future */
+  Future() : state_(std::make_shared<State>()) { state_->done = true; }
+
+  /** \brief an unfinished future, finished by \ref Finish */
+  static Future Pending() { return Future(std::make_shared<State>()); }
+
+  /**
+   * \brief the timestamp of the request, -1 if this future is not a single
+   * request
+   */
+  int timestamp() const { return state_->timestamp; }
+
+  /** \brief whether it is finished. threadsafe */
+  bool Ready() const {
+    std::lock_guard<std::mutex> lk(state_->mu);
+    return state_->done;
+  }
+
+  /** \brief wait until it is finished. threadsafe */
+  void Wait() const {
+    std::unique_lock<std::mutex> lk(state_->mu);
+    state_->cond.wait(lk, [this] { return state_->done; });
+  }
+
+  /**
+   * \brief finish it, and then run the continuations. called only once
+   */
+  void Finish() const {
+    std::vector<Task> next;
+    {
+      std::lock_guard<std::mutex> lk(state_->mu);
+      CHECK(!state_->done) << "finished twice";
+      state_->done = true;
+      next.swap(state_->next);
+    }
+    state_->cond.notify_all();
+    for (auto& task : next) task();
+  }
+
+  /**
+   * \brief run fn once this is finished
+   * \param fn the continuation, returning either void or a \ref Future, such
+   * as the one of another request
+   * \param executor where fn runs, see \ref Executor
+   * \return a future finished after fn returns, or after the future returned
+   * by fn is finished
+   */
+  template <typename F>
+  Future Then(const F& fn, const Executor& executor = nullptr) const {
+    return Then_(fn, executor,
+                 typename std::is_same<decltype(fn()), Future>::type());
+  }
+
+  /**
+   * \brief combine futures
+   * \return a future finished after all of futures
+   */
+  static Future WhenAll(const std::vector<Future>& futures) {
+    if (futures.empty()) return Future();
+    Future f = Pending();
+    auto left = std::make_shared<std::atomic<size_t>>(futures.size());
+    for (const auto& g : futures) {
+      g.OnFinish([f, left]() { if (--*left == 0) f.Finish(); });
+    }
+    return f;
+  }
+
+ private:
+  /** \brief the completion shared by all copies */
+  struct State {
+    std::mutex mu;
+    std::condition_variable cond;
+    bool done = false;
+    int timestamp = -1;
+    /** \brief continuations run after done */
+    std::vector<Task> next;
+  };
+
+  explicit Future(const std::shared_ptr<State>& state) : state_(state) { }
+
+  template <typename F>
+  Future Then_(const F& fn, const Executor& executor, std::false_type) const {
+    Future f = Pending();
+    OnFinish([fn, f]() { fn(); f.Finish(); }, executor);
+    return f;
+  }
+
+  template <typename F>
+  Future Then_(const F& fn, const Executor& executor, std::true_type) const {
+    Future f = Pending();
+    OnFinish([fn, f]() { fn().OnFinish([f]() { f.Finish(); }); }, executor);
+    return f;
+  }
+
+  /** \brief run task by executor once finished */
+  void OnFinish(const Task& task, const Executor& executor = nullptr) const {
+    Task run = executor ? Task([task, executor]() { executor(task); }) : task;
+    {
+      std::lock_guard<std::mutex> lk(state_->mu);
+      if (!state_->done) {
+        state_->next.push_back(std::move(run));
+        return;
+      }
+    }
+    run();
+  }
+
+  std::shared_ptr<State> state_;
+  template<typename Val> friend class KVWorker;
+};
+
+}  // namespace ps
+#endif  // PS_FUTURE_H_
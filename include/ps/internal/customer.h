@@ -12,7 +12,8 @@
 #include <thread>
 #include <memory>
 #include "ps/internal/message.h"
-#include "ps/internal/threadsafe_queue.h"
+#include "ps/internal/mpsc_queue.h"
+#include "ps/internal/thread_pool.h"
 namespace ps {
 
 /**
@@ -63,8 +64,24 @@ class Customer {
    */
   void WaitRequest(int timestamp);
 
+  /**
+   * \brief wait until any of the requests is finished. threadsafe
+   * \param timestamps the timestamps of the requests, not empty
+   * \return the timestamp of a finished request
+   */
+  int WaitAny(const std::vector<int>& timestamps);
+
+  /**
+   * \brief wait until all of the requests are finished. threadsafe
+   * \param timestamps the timestamps of the requests
+   */
+  void WaitAll(const std::vector<int>& timestamps);
+
   /**
    * \brief return the number of responses received for the request. threadsafe
+   *
+   * it is 0 once the slot of the request is reused by a later request, which
+   * only happens after the request is finished
    * \param timestamp the timestamp of the request
    */
   int NumResponse(int timestamp);
@@ -80,6 +97,25 @@ class Customer {
    */
   void AddResponse(int timestamp, int num = 1);
 
+  /**
+   * \brief run the callback threads, which run the tasks given to \ref Defer.
+   * called before any request is sent
+   * \param num_threads the number of threads, 0 means no thread
+   */
+  void StartCallbackThreads(int num_threads);
+
+  /**
+   * \brief run a task of a request on a callback thread if there are any,
+   * otherwise right now. threadsafe
+   *
+   * if the request is not finished yet, it is not finished before the task
+   * returns either, so \ref WaitRequest still waits for the task. the tasks of
+   * the same request run in order.
+   * \param timestamp the timestamp of the request
+   * \param task the task
+   */
+  void Defer(int timestamp, const std::function<void()>& task);
+
   /**
    * \brief accept a received message from \ref Van. threadsafe
    * \param recved the received the message
@@ -101,12 +137,65 @@ class Customer {
   int id_;
 
   RecvHandle recv_handle_;
-  ThreadsafeQueue<Message> recv_queue_;
+  /** \brief pushed by the receiving threads of the van, popped by recv_thread_ */
+  MPSCQueue<Message> recv_queue_;
   std::unique_ptr<std::thread> recv_thread_;
+  /** \brief runs the tasks given to Defer, sharded by timestamp */
+  std::unique_ptr<ShardedThreadPool> callback_pool_;
+
+  /** \brief the initial size of tracker_, a power of 2 */
+  static const int kInitTrackerSize = 1024;
+
+  /** \brief a request being tracked */
+  struct Request {
+    /** \brief -1 if the slot has never been used */
+    int timestamp = -1;
+    int num_expected = 0;
+    int num_received = 0;
+    /**
+     * \brief the condition variables of the threads waiting for this
+     * request, notified once it is finished
+     */
+    std::vector<std::condition_variable*> waiters;
+    bool Done() const { return num_received >= num_expected; }
+  };
+
+  /**
+   * \brief the request of timestamp, nullptr if its slot has been recycled.
+   * tracker_mu_ held
+   */
+  Request* FindRequest(int timestamp) {
+    Request* req = &tracker_[timestamp & (tracker_.size() - 1)];
+    return req->timestamp == timestamp ? req : nullptr;
+  }
+
+  /** \brief double the size of tracker_, keeping all requests. tracker_mu_ held */
+  void GrowTracker();
+
+  /**
+   * \brief add num responses to req, and wake up its waiters if it is
+   * finished. tracker_mu_ held
+   */
+  void AddReceived(Request* req, int num);
+
+  /**
+   * \brief the index of a finished request in timestamps, -1 if none.
+   * tracker_mu_ held
+   */
+  int FindDone(const std::vector<int>& timestamps);
 
   std::mutex tracker_mu_;
-  std::condition_variable tracker_cond_;
-  std::vector<std::pair<int, int>> tracker_;
+  /**
+   * \brief a ring of requests, the request of timestamp t is in the slot
+   * t & (size - 1). the slot of a finished request is recycled by a new one,
+   * a new request skips the timestamps of the slots in use, and the ring only
+   * grows if all slots are in use
+   */
+  std::vector<Request> tracker_;
+  /** \brief the number of unfinished requests in tracker_ */
+  size_t num_unfinished_ = 0;
+  /** \brief the timestamp of the next request, wraps to 0 after INT_MAX */
+  int next_timestamp_ = 0;
   // // expected number of responses
   // // -1 for default (number of servers)
   // std::vector<int> response_tracker_;
@@ -105,7 +105,7 @@ struct Control {
   std::string DebugString() const {
     if (empty()) return "";
     std::vector<std::string> cmds = {
-      "EMPTY", "TERMINATE", "ADD_NODE", "BARRIER", "ACK", "HEARTBEAT"};
+      "EMPTY", "TERMINATE", "ADD_NODE", "BARRIER", "ACK", "HEARTBEAT", "NACK"};
     std::stringstream ss;
     ss << "cmd=" << cmds[cmd];
     if (node.size()) {
@@ -115,17 +115,23 @@ struct Control {
     }
     if (cmd == BARRIER) ss << ", barrier_group=" << barrier_group;
     if (cmd == ACK) ss << ", msg_sig=" << msg_sig;
+    if (cmd == NACK) {
+      ss << ", seq=[" << (msg_sig >> 32) << ", " << (msg_sig & 0xffffffff) << ")";
+    }
     return ss.str();
   }
   /** \brief all commands */
-  enum Command { EMPTY, TERMINATE, ADD_NODE, BARRIER, ACK, HEARTBEAT };
+  enum Command { EMPTY, TERMINATE, ADD_NODE, BARRIER, ACK, HEARTBEAT, NACK };
   /** \brief the command */
   Command cmd;
   /** \brief node infos */
   std::vector<Node> node;
   /** \brief the node group for a barrier, such as kWorkerGroup */
   int barrier_group;
-  /** message signature */
+  /**
+   * message signature. for NACK, (begin << 32) | end of a range of sequence
+   * numbers, see \ref Resender
+   */
   uint64_t msg_sig;
 };
 /**
@@ -137,7 +143,9 @@ struct Meta {
   /** \brief default constructor */
   Meta() : head(kEmpty), customer_id(kEmpty), timestamp(kEmpty),
            sender(kEmpty), recver(kEmpty),
-           request(false), push(false), simple_app(false) {}
+           request(false), push(false), simple_app(false),
+           iteration(0), fake(false), reliability(DEFAULT), seq(kEmpty),
+           best_effort_response(false), part(false) {}
   std::string DebugString() const {
     std::stringstream ss;
     if (sender == Node::kEmpty) {
@@ -156,6 +164,10 @@ struct Meta {
          << ", push=" << push;
     }
     if (head != kEmpty) ss << ", head=" << head;
+    if (reliability != DEFAULT) ss << ", reliability=" << reliability;
+    if (seq != kEmpty) ss << ", seq=" << seq;
+    if (best_effort_response) ss << ", best_effort_response=1";
+    if (part) ss << ", part=1";
     if (body.size()) ss << ", body=" << body;
     if (data_type.size()) {
       ss << ", data_type={";
@@ -190,6 +202,35 @@ struct Meta {
   int iteration;
   /** \brief fake flag */
   bool fake;
+  /**
+   * \brief how a message is recovered if it is lost, which is honored by
+   * \ref Resender if PS_RESEND=2
+   */
+  enum Reliability {
+    /** \brief RELIABLE, unless a van decides otherwise */
+    DEFAULT,
+    /** \brief acknowledged one by one, and resent on timeout */
+    RELIABLE,
+    /** \brief resent if the receiver detects a gap in the sequence numbers */
+    NACK,
+    /** \brief never resent */
+    BEST_EFFORT
+  };
+  /** \brief the reliability class */
+  Reliability reliability;
+  /** \brief the sequence number of a NACK message to its receiver */
+  int seq;
+  /**
+   * \brief whether the response to this request may be BEST_EFFORT, because
+   * the requester does not wait for it
+   */
+  bool best_effort_response;
+  /**
+   * \brief whether this is a part of a key-value message delivered before the
+   * rest is received, which does not complete a request. only set by the
+   * receiving van, see \ref Reassembler
+   */
+  bool part;
 };
 /**
  * \brief messages that communicated amaong nodes.
@@ -0,0 +1,187 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_MPSC_QUEUE_H_
+#define PS_INTERNAL_MPSC_QUEUE_H_
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "ps/base.h"
+namespace ps {
+
+/**
+ * \brief bounded lock-free queue with multiple producers and a single consumer
+ *
+ * the values are kept in a ring of cells, each with a sequence number telling
+ * whether it is free or filled for the current lap, so a push is a single CAS
+ * and a pop takes no lock at all. a push blocks while the ring is full.
+ *
+ * the consumer spins for a while before it parks on a condition variable, and
+ * a producer only takes the lock to wake it up if it is parked.
+ *
+ * values pushed by \ref PushPriority go to a separate locked deque, which is
+ * popped before the ring.
+ */
+template<typename T> class MPSCQueue {
+ public:
+  /**
+   * \param capacity the number of cells, rounded up to a power of 2
+   */
+  explicit MPSCQueue(size_t capacity = 4096) {
+    size_t size = 1;
+    while (size < capacity) size <<= 1;
+    mask_ = size - 1;
+    cells_ = std::unique_ptr<Cell[]>(new Cell[size]);
+    for (size_t i = 0; i < size; ++i) {
+      cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+  }
+  ~MPSCQueue() { }
+
+  /**
+   * \brief push a value into the end. threadsafe
+   */
+  void Push(T new_value) {
+    Cell* cell;
+    size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells_[pos & mask_];
+      size_t seq = cell->seq.load(std::memory_order_acquire);
+      intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (dif == 0) {
+        if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (dif < 0) {
+        // full, wait for the consumer
+        std::this_thread::yield();
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      } else {
+        pos = enqueue_pos_.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = std::move(new_value);
+    cell->seq.store(pos + 1, std::memory_order_release);
+    Wake();
+  }
+
+  /**
+   * \brief push a value to be popped before all others. threadsafe
+   */
+  void PushPriority(T new_value) {
+    {
+      std::lock_guard<std::mutex> lk(priority_mu_);
+      priority_.push_front(std::move(new_value));
+      num_priority_.fetch_add(1, std::memory_order_release);
+    }
+    Wake();
+  }
+
+  /**
+   * \brief pop a value if there is any. only called by the consumer
+   * \return false if empty
+   */
+  bool TryPop(T* value) {
+    if (num_priority_.load(std::memory_order_acquire)) {
+      std::lock_guard<std::mutex> lk(priority_mu_);
+      *value = std::move(priority_.front());
+      priority_.pop_front();
+      num_priority_.fetch_sub(1, std::memory_order_relaxed);
+      return true;
+    }
+    Cell* cell = &cells_[dequeue_pos_ & mask_];
+    if (cell->seq.load(std::memory_order_acquire) != dequeue_pos_ + 1) return false;
+    *value = std::move(cell->value);
+    // release what the moved-from value may still hold
+    cell->value = T();
+    cell->seq.store(dequeue_pos_ + mask_ + 1, std::memory_order_release);
+    ++dequeue_pos_;
+    return true;
+  }
+
+  /**
+   * \brief wait until pop a value from the beginning. only called by the
+   * consumer
+   */
+  void WaitAndPop(T* value) {
+    while (!TryPop(value)) Park();
+  }
+
+  /**
+   * \brief wait until there is any value, and then pop all of them. only
+   * called by the consumer
+   * \param values the popped values are appended to it
+   * \return the number of popped values
+   */
+  size_t PopAll(std::vector<T>* values) {
+    T value;
+    WaitAndPop(&value);
+    size_t num = 1;
+    values->push_back(std::move(value));
+    while (TryPop(&value)) {
+      values->push_back(std::move(value));
+      ++num;
+    }
+    return num;
+  }
+
+ private:
+  struct Cell {
+    std::atomic<size_t> seq;
+    T value;
+  };
+
+  /** \brief whether the next pop will succeed. only called by the consumer */
+  bool Ready() {
+    return num_priority_.load(std::memory_order_acquire) ||
+        cells_[dequeue_pos_ & mask_].seq.load(std::memory_order_acquire) ==
+        dequeue_pos_ + 1;
+  }
+
+  /** \brief block the consumer until something is pushed */
+  void Park() {
+    for (int i = 0; i < kSpins; ++i) {
+      if (Ready()) return;
+      std::this_thread::yield();
+    }
+    std::unique_lock<std::mutex> lk(mu_);
+    sleeping_.store(true, std::memory_order_relaxed);
+    // pairs with the fence in Wake, so either the producer sees sleeping_ or
+    // the consumer sees the pushed value
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    cond_.wait(lk, [this] { return Ready(); });
+    sleeping_.store(false, std::memory_order_relaxed);
+  }
+
+  /** \brief wake up the consumer if it is parked */
+  void Wake() {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!sleeping_.load(std::memory_order_relaxed)) return;
+    std::lock_guard<std::mutex> lk(mu_);
+    cond_.notify_one();
+  }
+
+  /** \brief the number of Ready checks before parking */
+  static const int kSpins = 64;
+  std::unique_ptr<Cell[]> cells_;
+  size_t mask_;
+  /** \brief padded so that producers and the consumer do not share a line */
+  char pad0_[64];
+  std::atomic<size_t> enqueue_pos_{0};
+  char pad1_[64];
+  size_t dequeue_pos_ = 0;
+  std::atomic<bool> sleeping_{false};
+  std::mutex mu_;
+  std::condition_variable cond_;
+  std::mutex priority_mu_;
+  std::deque<T> priority_;
+  std::atomic<size_t> num_priority_{0};
+  DISALLOW_COPY_AND_ASSIGN(MPSCQueue);
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_MPSC_QUEUE_H_
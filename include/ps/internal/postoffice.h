@@ -4,6 +4,8 @@
 #ifndef PS_INTERNAL_POSTOFFICE_H_
 #define PS_INTERNAL_POSTOFFICE_H_
 #include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <algorithm>
 #include <vector>
 #include "ps/range.h"
@@ -49,11 +51,16 @@ class Postoffice {
   void RemoveCustomer(Customer* customer);
   /**
    * \brief get the customer by id, threadsafe
+   *
+   * it takes no lock if the customer exists and its id is less than
+   * \ref kCustomerTableSize, otherwise it waits until the customer is added.
    * \param id the customer id
    * \param timeout timeout in sec
    * \return return nullptr if doesn't exist and timeout
    */
   Customer* GetCustomer(int id, int timeout = 0) const;
+  /** \brief the customers of ids below it are found without locking */
+  static const int kCustomerTableSize = 64;
   /**
    * \brief get the id of a node (group), threadsafe
    *
@@ -167,8 +174,15 @@ class Postoffice {
   Postoffice();
   ~Postoffice() { delete van_; }
   Van* van_;
+  /** \brief the customer of id, nullptr if none. mu_ held */
+  Customer* FindCustomer(int id) const;
   mutable std::mutex mu_;
+  /** \brief the customers of ids below kCustomerTableSize, written with mu_ held */
+  std::atomic<Customer*> customer_table_[kCustomerTableSize];
+  /** \brief the customers of the other ids */
   std::unordered_map<int, Customer*> customers_;
+  /** \brief notified when a customer is added */
+  mutable std::condition_variable customer_cond_;
   std::unordered_map<int, std::vector<int>> node_ids_;
   std::vector<Range> server_key_ranges_;
   std::vector<int> range_to_server_map_;
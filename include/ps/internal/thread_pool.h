@@ -0,0 +1,80 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_INTERNAL_THREAD_POOL_H_
+#define PS_INTERNAL_THREAD_POOL_H_
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "ps/base.h"
+#include "ps/internal/mpsc_queue.h"
+namespace ps {
+
+/**
+ * \brief a pool of threads, each running the tasks of its own shard
+ *
+ * the tasks submitted to the same shard run one after another in the order
+ * of submission, while the tasks of different shards run in parallel
+ */
+class ShardedThreadPool {
+ public:
+  /** \brief a task, an empty one is not allowed */
+  using Task = std::function<void()>;
+
+  /**
+   * \param num_threads the number of threads, which is also the number of
+   * shards
+   */
+  explicit ShardedThreadPool(int num_threads) {
+    CHECK_GT(num_threads, 0);
+    for (int i = 0; i < num_threads; ++i) {
+      queues_.emplace_back(new MPSCQueue<Task>());
+    }
+    for (int i = 0; i < num_threads; ++i) {
+      threads_.emplace_back(new std::thread(&ShardedThreadPool::Running, this, i));
+    }
+  }
+
+  /**
+   * \brief run the tasks already submitted, and then stop all threads
+   */
+  ~ShardedThreadPool() {
+    // an empty task stops a thread
+    for (auto& q : queues_) q->Push(Task());
+    for (auto& t : threads_) t->join();
+  }
+
+  /**
+   * \brief submit a task. threadsafe
+   * \param shard the task runs in the thread shard % num_threads
+   */
+  void Submit(size_t shard, Task task) {
+    CHECK(task);
+    queues_[shard % queues_.size()]->Push(std::move(task));
+  }
+
+  /** \brief the number of threads */
+  int num_threads() const { return threads_.size(); }
+
+ private:
+  /** \brief thread function running the tasks of a shard */
+  void Running(int shard) {
+    std::vector<Task> tasks;
+    while (true) {
+      tasks.clear();
+      queues_[shard]->PopAll(&tasks);
+      for (auto& task : tasks) {
+        if (!task) return;
+        task();
+      }
+    }
+  }
+
+  std::vector<std::unique_ptr<MPSCQueue<Task>>> queues_;
+  std::vector<std::unique_ptr<std::thread>> threads_;
+  DISALLOW_COPY_AND_ASSIGN(ShardedThreadPool);
+};
+
+}  // namespace ps
+#endif  // PS_INTERNAL_THREAD_POOL_H_
@@ -11,8 +11,10 @@
 #include <memory>
 #include <atomic>
 #include <ctime>
+#include <functional>
 #include "ps/base.h"
 #include "ps/internal/message.h"
+#include "ps/internal/threadsafe_queue.h"
 namespace ps {
 class Resender;
 /**
@@ -68,10 +70,29 @@ class Van {
    * \brief whether it is ready for sending. thread safe
    */
   bool IsReady() { return ready_; }
+  /**
+   * \brief connect to the nodes now rather than on the first message to each
+   * of them, up to PS_CONNECT_THREADS at a time. thread safe
+   *
+   * it returns after all connections are made. the nodes not known from
+   * ADD_NODE yet are skipped
+   * \param ids the node ids
+   */
+  void Preconnect(const std::vector<int>& ids);
+  /**
+   * \brief whether the node is connected, either by \ref Preconnect or by a
+   * message sent to it. thread safe
+   */
+  bool IsConnected(int id) {
+    return id >= 0 && id < static_cast<int>(peers_.size()) &&
+        peers_[id]->connected.load(std::memory_order_acquire);
+  }
 
  protected:
   /**
-   * \brief connect to a node
+   * \brief connect to a node, or reconnect if it is connected already
+   *
+   * the van decides which nodes to connect to and when, see \ref AddPeer
    */
   virtual void Connect(const Node& node) = 0;
   /**
@@ -86,6 +107,20 @@ class Van {
    * \return the number of bytes received. -1 if failed or timeout
    */
   virtual int RecvMsg(Message* msg) = 0;
+  /**
+   * \brief the number of receive shards
+   *
+   * shard 0 is received by \ref RecvMsg in the receiving thread, which handles
+   * all control messages. every other shard is received by \ref RecvShardMsg
+   * in its own thread, which only dispatches data messages
+   */
+  virtual int NumRecvShards() { return 1; }
+  /**
+   * \brief block until a shard other than 0 received a message
+   * \return the number of bytes received. -1 if failed or stopped, which the
+   * van must ensure once its Stop is called
+   */
+  virtual int RecvShardMsg(int shard, Message* msg) { return -1; }
   /**
    * \brief send a mesage
    * \return the number of bytes sent
@@ -93,38 +128,112 @@ class Van {
   virtual int SendMsg(const Message& msg) = 0;
   /**
    * \brief pack meta into a string
+   *
+   * the meta of a data message is packed into a fixed-size binary header,
+   * see \ref PackRawMeta. others are packed by protobuf
    */
   void PackMeta(const Meta& meta, char** meta_buf, int* buf_size);
+  /** \brief the size of a meta packed by \ref PackRawMeta */
+  static const int kRawMetaSize = 28;
+  /**
+   * \brief pack the meta of a data message into a fixed-size binary header
+   * without any memory allocation
+   * \param meta_buf a buffer of at least \ref kRawMetaSize bytes
+   * \return false if the meta has a control, a body or too many data types,
+   * which can only be packed by \ref PackMeta
+   */
+  bool PackRawMeta(const Meta& meta, char* meta_buf, int* buf_size);
   /**
-   * \brief unpack meta from a string
+   * \brief unpack meta from a string packed by either \ref PackMeta or
+   * \ref PackRawMeta
    */
   void UnpackMeta(const char* meta_buf, int buf_size, Meta* meta);
-    /**
-   * \brief pack meta and data into a string
-   */
-   void PackMetaData(const Message& msg, int sender_id, uint8_t** data_buf, int* buf_size);
-   /**
-    * \brief unpack meta and data from a string
-    */
-   void UnpackMetaData(const uint8_t* data_buf, int buf_size, Message* msg);
+  /**
+   * \brief pack meta and data into a single string, for transports without
+   * multi-part messages. the data are padded so that they can be referenced in
+   * place by \ref UnpackMetaData
+   */
+  void PackMetaData(const Message& msg, int sender_id, uint8_t** data_buf, int* buf_size);
+  /**
+   * \brief pack only the part of \ref PackMetaData before the data, so that a
+   * transport can copy the data into its own buffers
+   * \return the size of the whole string, the data are padded to 8 bytes
+   */
+  size_t PackMetaDataHead(const Message& msg, int sender_id, std::string* head);
+  /**
+   * \brief unpack meta and data from a string packed by \ref PackMetaData
+   *
+   * zero-copy: msg->data are segments of buf
+   */
+  void UnpackMetaData(const SArray<char>& buf, Message* msg);
+  /**
+   * \brief unpack a data message of which only some bytes are received
+   *
+   * if the meta and the keys are received, msg is a fake message with only
+   * the keys, which tells the application which keys are lost
+   * \param received returns whether all bytes in [begin, end) are received
+   * \return false if nothing useful can be recovered
+   */
+  bool UnpackPartialMetaData(const SArray<char>& buf,
+                             const std::function<bool(size_t, size_t)>& received,
+                             Message* msg);
 
   Node scheduler_;
   Node my_node_;
   bool is_scheduler_;
 
  private:
-  /** thread function for receving */
+  /** send a message prepared by the resender */
+  int Send_(const Message& msg);
+  /** thread function for receving, which dispatches the data messages */
   void Receiving();
+  /** thread function for handling the control messages */
+  void Controlling();
+  /** thread function for receiving a shard other than 0 */
+  void ReceivingShard(int shard);
+  /** whether to drop a received message for debug */
+  bool Drop(const Message& msg);
+  /** give a data message to its customer */
+  void Dispatch(const Message& msg);
   /** thread function for heartbeat */
   void Heartbeat();
+  /**
+   * \brief a node known from ADD_NODE. connected on the first send to it, or
+   * before ready if PS_LAZY_CONNECT is 0
+   */
+  struct Peer {
+    /** guards node and known */
+    std::mutex mu;
+    Node node;
+    bool known = false;
+    std::atomic<bool> connected{false};
+  };
+  /**
+   * record a node from ADD_NODE
+   * \return whether to connect to it before ready if PS_LAZY_CONNECT is 0
+   */
+  bool AddPeer(const Node& node);
+  /** connect to the peer of id if it is not connected yet. threadsafe */
+  void ConnectPeer(int id);
+  /**
+   * forward the node list of the bootstrap ADD_NODE to my children in the
+   * tree of PS_BOOTSTRAP_FANOUT
+   */
+  void ForwardNodes(const Message& msg);
   /** whether it is ready for sending */
   std::atomic<bool> ready_{false};
   std::atomic<size_t> send_bytes_{0};
-  size_t recv_bytes_ = 0;
+  std::atomic<size_t> recv_bytes_{0};
   int num_servers_ = 0;
   int num_workers_ = 0;
   /** the thread for receiving messages */
   std::unique_ptr<std::thread> receiver_thread_;
+  /** the thread for handling the control messages */
+  std::unique_ptr<std::thread> control_thread_;
+  /** the control messages received by the receiving thread */
+  ThreadsafeQueue<Message> control_queue_;
+  /** the threads for receiving the shards other than 0 */
+  std::vector<std::unique_ptr<std::thread>> shard_threads_;
   /** the thread for sending heartbeat */
   std::unique_ptr<std::thread> heartbeat_thread_;
   std::vector<int> barrier_count_;
@@ -132,6 +241,16 @@ class Van {
   Resender* resender_ = nullptr;
   int drop_rate_ = 0;
   std::atomic<int> timestamp_{0};
+  /** the peers indexed by node id, allocated in Start */
+  std::vector<std::unique_ptr<Peer>> peers_;
+  /** whether to connect to a peer only on the first send to it */
+  int lazy_connect_ = 1;
+  /** the max number of connections made at a time by Preconnect */
+  int connect_threads_ = 16;
+  /** the fanout of the tree spreading the node list, 0 means no tree */
+  int bootstrap_fanout_ = 0;
+  /** the time spent on connecting to the peers in ADD_NODE, in millisecond */
+  double startup_connect_ms_ = 0;
   DISALLOW_COPY_AND_ASSIGN(Van);
 };
 }  // namespace ps
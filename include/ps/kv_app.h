@@ -11,6 +11,8 @@
 #include <vector>
 #include "ps/base.h"
 #include "ps/simple_app.h"
+#include "ps/future.h"
+#include "ps/internal/thread_pool.h"
 namespace ps {
 
 /**
@@ -76,6 +78,7 @@ class KVWorker : public SimpleApp {
     using namespace std::placeholders;
     slicer_ = std::bind(&KVWorker<Val>::DefaultSlicer, this, _1, _2, _3);
     obj_ = new Customer(app_id, std::bind(&KVWorker<Val>::Process, this, _1));
+    obj_->StartCallbackThreads(GetEnv("PS_WORKER_CALLBACK_THREADS", 0));
     std::srand ( unsigned ( std::time(0) ) );
     partial_pull_active_ = false;
     const char *pull_threshold = Environment::Get()->find("DMLC_PS_PULL_THRESHOLD");
@@ -171,7 +174,8 @@ class KVWorker : public SimpleApp {
            std::vector<int>* lens = nullptr,
            int cmd = 0,
            const Callback& cb = nullptr) {
-    return Pull_(SArray<Key>(keys), vals, lens, cmd, cb);
+    // a full pull, which also records the value lengths for partial pulls
+    return Pull_(SArray<Key>(keys), vals, lens, cmd, cb, -1);
   }
 
   /**
@@ -188,6 +192,84 @@ class KVWorker : public SimpleApp {
    */
   void Wait(int timestamp) { obj_->WaitRequest(timestamp); }
 
+  /**
+   * \brief Waits until any of the pushes and pulls has been finished
+   *
+   * \param timestamps the timestamps returned by the pushes and pulls
+   * \return the timestamp of a finished one
+   */
+  int WaitAny(const std::vector<int>& timestamps) {
+    return obj_->WaitAny(timestamps);
+  }
+
+  /**
+   * \brief Waits until all of the pushes and pulls have been finished
+   *
+   * \param timestamps the timestamps returned by the pushes and pulls
+   */
+  void WaitAll(const std::vector<int>& timestamps) { obj_->WaitAll(timestamps); }
+
+  /**
+   * \brief \ref Push returning a \ref Future
+   *
+   * the future is finished on the data receiving thread, so do not block in a
+   * continuation running there, but give \ref Future::Then an executor
+   * instead.
+   *
+   * Sample usage:
+   * \code
+   *   w.PushAsync(keys, grads).Then([&]() { return w.PullAsync(keys, &vals); })
+   *       .Then([&]() { Update(vals); }, executor);
+   * \endcode
+   */
+  Future PushAsync(const std::vector<Key>& keys,
+                   const std::vector<Val>& vals,
+                   const std::vector<int>& lens = {},
+                   int cmd = 0) {
+    return ZPushAsync(SArray<Key>(keys), SArray<Val>(vals), SArray<int>(lens), cmd);
+  }
+
+  /**
+   * \brief \ref Pull returning a \ref Future, see \ref PushAsync
+   */
+  Future PullAsync(const std::vector<Key>& keys,
+                   std::vector<Val>* vals,
+                   std::vector<int>* lens = nullptr,
+                   int cmd = 0) {
+    Future f = Future::Pending();
+    f.state_->timestamp = Pull_(SArray<Key>(keys), vals, lens, cmd,
+                                [f]() { f.Finish(); }, -1);
+    return f;
+  }
+
+  /**
+   * \brief \ref ZPush returning a \ref Future, see \ref PushAsync
+   */
+  Future ZPushAsync(const SArray<Key>& keys,
+                    const SArray<Val>& vals,
+                    const SArray<int>& lens = {},
+                    int cmd = 0,
+                    int iteration = 0) {
+    Future f = Future::Pending();
+    f.state_->timestamp = ZPush(keys, vals, lens, cmd,
+                                [f]() { f.Finish(); }, iteration);
+    return f;
+  }
+
+  /**
+   * \brief \ref ZPull returning a \ref Future, see \ref PushAsync
+   */
+  Future ZPullAsync(const SArray<Key>& keys,
+                    SArray<Val>* vals,
+                    SArray<int>* lens = nullptr,
+                    int cmd = 0,
+                    int iteration = 0) {
+    Future f = Future::Pending();
+    f.state_->timestamp = Pull_(keys, vals, lens, cmd,
+                                [f]() { f.Finish(); }, iteration);
+    return f;
+  }
+
   /**
    * \brief zero-copy Push
    *
@@ -271,6 +353,13 @@ class KVWorker : public SimpleApp {
    * \param timestamp the timestamp of the callback
    */
   void RunCallback(int timestamp);
+  /**
+   * \brief whether a pull of the iteration finishes once
+   * DMLC_PS_PULL_THRESHOLD of the responses arrive
+   */
+  bool PartialPull(int iteration) const {
+    return pull_threshold_ < 1 && iteration > 0;
+  }
   /**
    * \brief send the kv list to all servers
    * @param timestamp the timestamp of the request
@@ -323,6 +412,13 @@ struct KVMeta {
   int customer_id;
   /** \brief fake flag */
   bool fake;
+  /** \brief whether the response to a pull may be BEST_EFFORT */
+  bool best_effort_response = false;
+  /**
+   * \brief whether the request is a part of a push, whose response is only
+   * sent for the last part, see \ref Meta::part
+   */
+  bool part = false;
 };
 
 /**
@@ -335,8 +431,15 @@ class KVServer : public SimpleApp {
    * \brief constructor
    * \param app_id the app id, should match with \ref KVWorker's id
    */
-  explicit KVServer(int app_id) : SimpleApp() {
+  explicit KVServer(int app_id) : SimpleApp(), customer_id_(app_id) {
     using namespace std::placeholders;
+    // PS_SERVER_THREADS > 1 runs the request handle on a pool of threads.
+    // the requests to the same key range run in order on the same thread, so
+    // the handle must only be safe to call concurrently for different ranges
+    int num_threads = GetEnv("PS_SERVER_THREADS", 1);
+    if (num_threads > 1) {
+      pool_ = std::unique_ptr<ShardedThreadPool>(new ShardedThreadPool(num_threads));
+    }
     obj_ = new Customer(app_id, std::bind(&KVServer<Val>::Process, this, _1));
 
     const char *pull_delay = Environment::Get()->find("DMLC_PS_PULL_DELAY");
@@ -353,6 +456,8 @@ class KVServer : public SimpleApp {
   virtual ~KVServer() { 
     std::this_thread::sleep_for(std::chrono::seconds(1));
     delete obj_; obj_ = nullptr; 
+    // no more requests are submitted, run the pending ones
+    pool_.reset();
   }
 
   /**
@@ -376,20 +481,36 @@ class KVServer : public SimpleApp {
    */
   void Response(const KVMeta& req, const KVPairs<Val>& res = KVPairs<Val>());
 
+  /**
+   * \brief the index of the server key range of the request. the requests of
+   * different ranges may run concurrently if PS_SERVER_THREADS > 1
+   */
+  static size_t KeyRange(const KVPairs<Val>& data);
+
  private:
   /** \brief internal receive handle */
   void Process(const Message& msg);
   /** \brief request handle */
   ReqHandle request_handle_;
+  /** \brief the id of obj_, which responses still use after obj_ is deleted */
+  int customer_id_;
+  /** \brief runs the request handle if PS_SERVER_THREADS > 1 */
+  std::unique_ptr<ShardedThreadPool> pool_;
   // only for simulating message delay
   int pull_delay_;
 };
 
 /**
  * \brief an example handle adding pushed kv into store
+ *
+ * it keeps a store per server key range, so it is safe with
+ * PS_SERVER_THREADS > 1
  */
 template <typename Val>
 struct KVServerDefaultHandle {
+  KVServerDefaultHandle()
+      : stores(Postoffice::Get()->GetServerKeyRanges().size()) { }
+
   void operator()(
       const KVMeta& req_meta, const KVPairs<Val>& req_data, KVServer<Val>* server) {
     size_t n = req_data.keys.size();
@@ -399,6 +520,7 @@ struct KVServerDefaultHandle {
     } else {
       res.keys = req_data.keys; res.vals.resize(n);
     }
+    auto& store = stores[KVServer<Val>::KeyRange(req_data)];
     for (size_t i = 0; i < n; ++i) {
       Key key = req_data.keys[i];
       if (req_meta.push) {
@@ -409,7 +531,8 @@ struct KVServerDefaultHandle {
     }
     server->Response(req_meta, res);
   }
-  std::unordered_map<Key, Val> store;
+  /** \brief the key-value pairs of each server key range */
+  std::vector<std::unordered_map<Key, Val>> stores;
 };
 
 
@@ -427,6 +550,8 @@ void KVServer<Val>::Process(const Message& msg) {
   meta.timestamp = msg.meta.timestamp;
   meta.customer_id = msg.meta.customer_id;
   meta.fake = msg.meta.fake;
+  meta.best_effort_response = msg.meta.best_effort_response;
+  meta.part = msg.meta.part;
   KVPairs<Val> data;
   if (!meta.fake) {
     int n = msg.data.size();
@@ -451,19 +576,39 @@ void KVServer<Val>::Process(const Message& msg) {
   // iteration counter
   data.iteration = msg.meta.iteration;
   CHECK(request_handle_);
+  if (pool_) {
+    pool_->Submit(KeyRange(data), [this, meta, data]() {
+        request_handle_(meta, data, this);
+      });
+    return;
+  }
   request_handle_(meta, data, this);
 }
 
+template <typename Val>
+size_t KVServer<Val>::KeyRange(const KVPairs<Val>& data) {
+  if (data.keys.empty()) return 0;
+  // a request from a worker never spans two ranges
+  const auto& ranges = Postoffice::Get()->GetServerKeyRanges();
+  auto it = std::upper_bound(ranges.begin(), ranges.end(), data.keys[0],
+                             [](Key key, const Range& range) { return key < range.end(); });
+  return it - ranges.begin();
+}
+
 template <typename Val>
 void KVServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
+  // the worker expects a single response per request
+  if (req.part) return;
   Message msg;
-  msg.meta.customer_id = obj_->id();
+  msg.meta.customer_id = customer_id_;
   msg.meta.request     = false;
   msg.meta.push        = req.push;
   msg.meta.head        = req.cmd;
   msg.meta.timestamp   = req.timestamp;
   msg.meta.recver      = req.sender;
   msg.meta.iteration   = res.iteration;
+  // the worker finishes a partial pull without the lost responses
+  if (!req.push && req.best_effort_response) msg.meta.reliability = Meta::BEST_EFFORT;
   if (res.keys.size()) {
     msg.AddData(res.keys);
     msg.AddData(res.vals);
@@ -554,10 +699,12 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>&
   for (size_t i = 0; i < sliced.size(); ++i) {
     if (!sliced[i].first) ++skipped;
   }
-  obj_->AddResponse(timestamp, skipped);
+  // run the callback before the request is finished, so a deferred one is
+  // still counted by the tracker
   if ((size_t)skipped == sliced.size()) {
     RunCallback(timestamp);
   }
+  obj_->AddResponse(timestamp, skipped);
 
   // random shuffle
   std::vector<int> shuffled_index;
@@ -577,6 +724,10 @@ void KVWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<Val>&
     // msg.meta.recver      = Postoffice::Get()->ServerRankToID(i);
     // key range rank -> server rank -> server id
     msg.meta.recver      = Postoffice::Get()->ServerRankToID(Postoffice::Get()->RangeToServerRank(j));
+    // recover lost push slices by NACK
+    if (push) msg.meta.reliability = Meta::NACK;
+    // a partial pull does not wait for all responses, see Process
+    if (!push && PartialPull(iteration)) msg.meta.best_effort_response = true;
     const auto& kvs = s.second;
     if (kvs.keys.size()) {
       msg.AddData(kvs.keys);
@@ -600,13 +751,17 @@ void KVWorker<Val>::Process(const Message& msg) {
     SimpleApp::Process(msg); return;
   }
 
-  // store the data for pulling
+  // store the data for pulling. the keys of a fake response are lost, they
+  // are skipped as in partial pull
   int ts = msg.meta.timestamp;
-  if (!msg.meta.push && msg.data.size()) {
+  if (!msg.meta.push && msg.data.size() && !msg.meta.fake) {
     CHECK_GE(msg.data.size(), (size_t)2);
     KVPairs<Val> kvs;
     kvs.keys = msg.data[0];
-    if (msg.meta.iteration < pull_iteration_[kvs.keys[0]]) {
+    mu_.lock();
+    int desired = pull_iteration_[kvs.keys[0]];
+    mu_.unlock();
+    if (msg.meta.iteration < desired) {
       // LG << "ignore delayed pulling!";
       return;
     }
@@ -629,17 +784,28 @@ void KVWorker<Val>::Process(const Message& msg) {
     }
     kvs.iteration = msg.meta.iteration;
     mu_.lock();
-    recv_kvs_[ts].push_back(kvs);
+    // the callback of a partial pull may have run already
+    if (callbacks_.count(ts)) recv_kvs_[ts].push_back(kvs);
     mu_.unlock();
   }
+  // the rest of the response is still on the way
+  if (msg.meta.part) return;
 
   // finished, run callbacks
   if (obj_->NumResponse(ts) == Postoffice::Get()->GetServerKeyRanges().size() - 1)  {
     RunCallback(ts);
   }
-  else if (!msg.meta.push && msg.data.size() && msg.meta.iteration > 0 && (double)(obj_->NumResponse(ts)+1) >= Postoffice::Get()->GetServerKeyRanges().size() * pull_threshold_) {
-    // TODO: partial pull
+  else if (!msg.meta.push && msg.data.size() && PartialPull(msg.meta.iteration) && (double)(obj_->NumResponse(ts)+1) >= Postoffice::Get()->GetServerKeyRanges().size() * pull_threshold_) {
+    mu_.lock();
+    bool waiting = callbacks_.count(ts);
+    mu_.unlock();
+    if (!waiting) return;
+    // the rest responses are dropped, and may be lost, so the request is
+    // finished without them. counted before the callback is deferred, which
+    // is counted by itself
+    int rest = Postoffice::Get()->GetServerKeyRanges().size() - 1 - obj_->NumResponse(ts);
     RunCallback(ts);
+    obj_->AddResponse(ts, rest);
   }
 }
 
@@ -647,16 +813,15 @@ template <typename Val>
 void KVWorker<Val>::RunCallback(int timestamp) {
   mu_.lock();
   auto it = callbacks_.find(timestamp);
-  if (it != callbacks_.end()) {
+  if (it == callbacks_.end()) {
     mu_.unlock();
-
-    CHECK(it->second);
-    it->second();
-
-    mu_.lock();
-    callbacks_.erase(it);
+    return;
   }
+  Callback cb = std::move(it->second);
+  callbacks_.erase(it);
   mu_.unlock();
+  CHECK(cb);
+  obj_->Defer(timestamp, cb);
 }
 
 template <typename Val>
@@ -664,14 +829,19 @@ template <typename C, typename D>
 int KVWorker<Val>::Pull_(
     const SArray<Key>& keys, C* vals, D* lens, int cmd, const Callback& cb, int iteration) {
   int iteration_desired = iteration + 1;
+  mu_.lock();
   for (int i = 0; i < keys.size(); i++) {
     pull_iteration_[keys[i]] = iteration_desired;
   }
+  mu_.unlock();
   int ts = obj_->NewRequest(kServerGroup);
   AddCallback(ts, [this, ts, keys, vals, lens, cb, iteration]() mutable {
-      mu_.lock();
-      auto& kvs = recv_kvs_[ts];
-      mu_.unlock();
+      // the callback may run on a callback thread, so the per key states are
+      // only touched with mu_ held
+      std::unique_lock<std::mutex> lk(mu_);
+      // the responses after a partial pull are dropped by Process
+      std::vector<KVPairs<Val>> kvs = std::move(recv_kvs_[ts]);
+      recv_kvs_.erase(ts);
 
       for (int i = 0; i < keys.size(); i++) {
         pull_iteration_[keys[i]] = pull_iteration_[keys[i]]+1;
@@ -692,22 +862,26 @@ int KVWorker<Val>::Pull_(
 
       size_t total_val = 0;
       if (iteration == -1) {
-        // the first pull
+        // the first pull, record the value size of each key
         for (const auto& s : kvs) {
-          // record the offset
-          val_size_[s.keys[0]] = s.vals.size();
-          if (lens) len_size_[s.keys[0]] = s.lens.size();
+          for (size_t j = 0; j < s.keys.size(); ++j) {
+            val_size_[s.keys[j]] = s.lens.size() ? s.lens[j] : s.vals.size() / s.keys.size();
+            len_size_[s.keys[j]] = s.lens.size() ? 1 : 0;
+          }
         }
       }
+      // the offsets of each key in vals and lens
+      std::vector<size_t> val_offset(keys.size()), len_offset(keys.size());
+      std::vector<size_t> val_size(keys.size());
+      size_t total_len = 0;
       for (int i = 0; i < keys.size(); i++) {
-        total_val += val_size_[keys[i]];
+        val_offset[i] = total_val;
+        len_offset[i] = total_len;
+        val_size[i] = val_size_[keys[i]];
+        total_val += val_size[i];
+        total_len += len_size_[keys[i]];
       }
-
-      // // fill vals and lens
-      // std::sort(kvs.begin(), kvs.end(), [](
-      //     const KVPairs<Val>& a, const KVPairs<Val>& b) {
-      //             return a.keys.front() < b.keys.front();
-      //   });
+      lk.unlock();
 
       CHECK_NOTNULL(vals);
       if (vals->empty()) {
@@ -715,7 +889,6 @@ int KVWorker<Val>::Pull_(
       } else {
         CHECK_EQ(vals->size(), total_val);
       }
-      Val* p_vals = vals->data();
       int *p_lens = nullptr;
       if (lens) {
         if (lens->empty()) {
@@ -726,43 +899,27 @@ int KVWorker<Val>::Pull_(
         p_lens = lens->data();
       }
 
-      // for (const auto& s : kvs) {
-      //   memcpy(p_vals, s.vals.data(), s.vals.size() * sizeof(Val));
-      //   p_vals += s.vals.size();
-      //   if (p_lens) {
-      //     memcpy(p_lens, s.lens.data(), s.lens.size() * sizeof(int));
-      //     p_lens += s.lens.size();
-      //   }
-      //   // LG << s.iteration << ", " << iteration;
-      // }
-
-      for (int i = 0; i < keys.size(); i++) {
-        Key key = keys[i];
-        bool key_found = false;
-        for (const auto& s : kvs) {
-          if (s.keys[0] == key) {
-            key_found = true;
-            memcpy(p_vals, s.vals.data(), s.vals.size() * sizeof(Val));
-            p_vals += s.vals.size();
-            if (p_lens) {
-              memcpy(p_lens, s.lens.data(), s.lens.size() * sizeof(int));
-              p_lens += s.lens.size();
-            }
-          }
-        }
-        if (!key_found) {
-          // partial pull
-          // LG << "some pulling is skipped";
-          p_vals += val_size_[key];
-          if (p_lens) {
-            p_lens += len_size_[key];
+      // a slice may have only a part of its keys if some are lost on the
+      // way, the missing keys are skipped as in partial pull
+      for (const auto& s : kvs) {
+        size_t i = std::lower_bound(keys.begin(), keys.end(), s.keys.front()) - keys.begin();
+        size_t pos = 0;
+        for (size_t j = 0; j < s.keys.size(); ++j) {
+          while (i < keys.size() && keys[i] < s.keys[j]) ++i;
+          CHECK(i < keys.size() && keys[i] == s.keys[j]) << "unmatched keys from one server";
+          size_t n = s.lens.size() ? s.lens[j] : s.vals.size() / s.keys.size();
+          if (n != val_size[i]) {
+            LOG(WARNING) << "skip key " << keys[i] << " with " << n
+                         << " values, expected " << val_size[i];
+            pos += n;
+            continue;
           }
+          memcpy(vals->data() + val_offset[i], s.vals.data() + pos, n * sizeof(Val));
+          pos += n;
+          if (p_lens && s.lens.size()) p_lens[len_offset[i]] = s.lens[j];
         }
       }
 
-      mu_.lock();
-      recv_kvs_.erase(ts);
-      mu_.unlock();
       if (cb) cb();
     });
 
@@ -975,6 +1132,21 @@ class KVCheapWorker : public SimpleApp {
     CHECK(slicer); slicer_ = slicer;
   }
 
+  /**
+   * \brief the handle of the keys lost by a pull
+   * \param timestamp the timestamp of the pull
+   * \param keys the keys whose values are not received and left unchanged
+   */
+  using LostHandle = std::function<void(int timestamp, const std::vector<Key>& keys)>;
+
+  /**
+   * \brief set a handle which is called before the callback of a pull if some
+   * keys are lost, which happens only with an unreliable van
+   */
+  void set_lost_handle(const LostHandle& lost_handle) {
+    CHECK(lost_handle); lost_handle_ = lost_handle;
+  }
+
  private:
   /**
    * \brief internal pull, C/D can be either SArray or std::vector
@@ -1020,6 +1192,8 @@ class KVCheapWorker : public SimpleApp {
   std::mutex mu_;
   /** \brief kv list slicer */
   Slicer slicer_;
+  /** \brief lost keys handle */
+  LostHandle lost_handle_;
 };
 
 /**
@@ -1108,6 +1282,7 @@ void KVCheapServer<Val>::Process(const Message& msg) {
   meta.push      = msg.meta.push;
   meta.sender    = msg.meta.sender;
   meta.timestamp = msg.meta.timestamp;
+  meta.part = msg.meta.part;
   KVPairs<Val> data;
   int n = msg.data.size();
   if (n) {
@@ -1126,6 +1301,8 @@ void KVCheapServer<Val>::Process(const Message& msg) {
 
 template <typename Val>
 void KVCheapServer<Val>::Response(const KVMeta& req, const KVPairs<Val>& res) {
+  // the worker expects a single response per request
+  if (req.part) return;
   Message msg;
   msg.meta.customer_id = obj_->id();
   msg.meta.request     = false;
@@ -1237,6 +1414,8 @@ void KVCheapWorker<Val>::Send(int timestamp, bool push, int cmd, const KVPairs<V
     msg.meta.timestamp   = timestamp;
     // key range rank -> server rank -> server id
     msg.meta.recver      = Postoffice::Get()->ServerRankToID(Postoffice::Get()->RangeToServerRank(i));
+    // recover lost push slices by NACK
+    if (push) msg.meta.reliability = Meta::NACK;
     const auto& kvs = s.second;
     if (kvs.keys.size()) {
       msg.AddData(kvs.keys);
@@ -1263,9 +1442,9 @@ void KVCheapWorker<Val>::Process(const Message& msg) {
     SimpleApp::Process(msg); return;
   }
 
-  // store the data for pulling
+  // store the data for pulling. the keys of a fake response are lost
   int ts = msg.meta.timestamp;
-  if (!msg.meta.push && msg.data.size()) {
+  if (!msg.meta.push && msg.data.size() && !msg.meta.fake) {
     CHECK_GE(msg.data.size(), (size_t)2);
     KVPairs<Val> kvs;
     kvs.keys = msg.data[0];
@@ -1280,6 +1459,8 @@ void KVCheapWorker<Val>::Process(const Message& msg) {
     recv_kvs_[ts].push_back(kvs);
     mu_.unlock();
   }
+  // the rest of the response is still on the way
+  if (msg.meta.part) return;
   // // debug
   // if (msg.meta.push) {
   //   LG << "push response received";
@@ -1330,30 +1511,52 @@ int KVCheapWorker<Val>::Pull_(
       auto& kvs = recv_kvs_[ts];
       mu_.unlock();
 
-      // do check
-      size_t total_key = 0, total_val = 0;
+      // locate the received keys, a slice may miss some keys or be lost as
+      // a whole on an unreliable van
+      std::vector<int> recv_len(keys.size(), -1);
+      size_t num_lost = keys.size();
       for (const auto& s : kvs) {
-        Range range = FindRange(keys, s.keys.front(), s.keys.back()+1);
-        CHECK_EQ(range.size(), s.keys.size())
-            << "unmatched keys size from one server";
         if (lens) CHECK_EQ(s.lens.size(), s.keys.size());
-        total_key += s.keys.size();
-        total_val += s.vals.size();
+        size_t i = std::lower_bound(keys.begin(), keys.end(), s.keys.front()) - keys.begin();
+        for (size_t j = 0; j < s.keys.size(); ++j) {
+          while (i < keys.size() && keys[i] < s.keys[j]) ++i;
+          CHECK(i < keys.size() && keys[i] == s.keys[j])
+              << "unmatched keys from one server";
+          recv_len[i] = s.lens.size() ? s.lens[j] : s.vals.size() / s.keys.size();
+          --num_lost;
+        }
       }
-      CHECK_EQ(total_key, keys.size()) << "lost some servers?";
 
-      // fill vals and lens
-      std::sort(kvs.begin(), kvs.end(), [](
-          const KVPairs<Val>& a, const KVPairs<Val>& b) {
-                  return a.keys.front() < b.keys.front();
-        });
+      // a lost key keeps its previous value length, which is known from
+      // lens if it is filled. otherwise the lost keys share the room left in
+      // a preallocated vals, or have the max received length
       CHECK_NOTNULL(vals);
+      bool known_lens = lens && lens->size() == keys.size();
+      int uniform_len = 0;
+      if (!known_lens && num_lost) {
+        if (!vals->empty()) {
+          size_t received = 0;
+          for (int l : recv_len) received += std::max(l, 0);
+          size_t left = vals->size() > received ? vals->size() - received : 0;
+          CHECK_EQ(left % num_lost, 0) << "the lost keys do not fit into vals";
+          uniform_len = left / num_lost;
+        } else {
+          for (int l : recv_len) uniform_len = std::max(uniform_len, l);
+        }
+      }
+      std::vector<size_t> offset(keys.size() + 1, 0);
+      for (size_t i = 0; i < keys.size(); ++i) {
+        int len = recv_len[i];
+        if (len < 0) len = known_lens ? (*lens)[i] : uniform_len;
+        offset[i + 1] = offset[i] + len;
+      }
+      size_t total_val = offset.back();
+
       if (vals->empty()) {
         vals->resize(total_val);
       } else {
         CHECK_EQ(vals->size(), total_val);
       }
-      Val* p_vals = vals->data();
       int *p_lens = nullptr;
       if (lens) {
         if (lens->empty()) {
@@ -1364,11 +1567,27 @@ int KVCheapWorker<Val>::Pull_(
         p_lens = lens->data();
       }
       for (const auto& s : kvs) {
-        memcpy(p_vals, s.vals.data(), s.vals.size() * sizeof(Val));
-        p_vals += s.vals.size();
-        if (p_lens) {
-          memcpy(p_lens, s.lens.data(), s.lens.size() * sizeof(int));
-          p_lens += s.lens.size();
+        size_t i = std::lower_bound(keys.begin(), keys.end(), s.keys.front()) - keys.begin();
+        size_t pos = 0;
+        for (size_t j = 0; j < s.keys.size(); ++j) {
+          while (keys[i] < s.keys[j]) ++i;
+          size_t n = offset[i + 1] - offset[i];
+          memcpy(vals->data() + offset[i], s.vals.data() + pos, n * sizeof(Val));
+          pos += n;
+        }
+      }
+      if (p_lens) {
+        for (size_t i = 0; i < keys.size(); ++i) p_lens[i] = offset[i + 1] - offset[i];
+      }
+
+      if (num_lost) {
+        PS_VLOG(1) << "lost " << num_lost << " of " << keys.size() << " keys";
+        if (lost_handle_) {
+          std::vector<Key> lost;
+          for (size_t i = 0; i < keys.size(); ++i) {
+            if (recv_len[i] < 0) lost.push_back(keys[i]);
+          }
+          lost_handle_(ts, lost);
         }
       }
 
@@ -11,3 +11,8 @@ endif
 
 PS_LDFLAGS_SO = -L$(DEPS_PATH)/lib -lprotobuf-lite -lzmq
 PS_LDFLAGS_A = $(addprefix $(DEPS_PATH)/lib/, libprotobuf-lite.a libzmq.a)
+
+# shm_open of the shared memory van
+ifeq ($(shell uname), Linux)
+PS_LDFLAGS_SO += -lrt
+endif
@@ -1,6 +1,7 @@
 /**
  *  Copyright (c) 2015 by Contributors
  */
+#include <algorithm>
 #include "ps/internal/customer.h"
 #include "ps/internal/postoffice.h"
 namespace ps {
@@ -9,7 +10,7 @@ const int Node::kEmpty = std::numeric_limits<int>::max();
 const int Meta::kEmpty = std::numeric_limits<int>::max();
 
 Customer::Customer(int id, const Customer::RecvHandle& recv_handle)
-    : id_(id), recv_handle_(recv_handle) {
+    : id_(id), recv_handle_(recv_handle), tracker_(kInitTrackerSize) {
   Postoffice::Get()->AddCustomer(this);
   recv_thread_ = std::unique_ptr<std::thread>(new std::thread(&Customer::Receiving, this));
 }
@@ -20,13 +21,45 @@ Customer::~Customer() {
   msg.meta.control.cmd = Control::TERMINATE;
   recv_queue_.Push(msg);
   recv_thread_->join();
+  // run the deferred tasks left
+  callback_pool_.reset();
 }
 
 int Customer::NewRequest(int recver) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
   int num = Postoffice::Get()->GetNodeIDs(recver).size();
-  tracker_.push_back(std::make_pair(num, 0));
-  return tracker_.size() - 1;
+  if (num_unfinished_ == tracker_.size()) GrowTracker();
+  // skip the timestamps whose slots are held by unfinished requests, such as
+  // one whose responses are lost, so the ring does not grow because of them.
+  // the ring size divides 2^31, so the slots stay consistent over the wrap
+  int timestamp;
+  while (true) {
+    timestamp = next_timestamp_;
+    next_timestamp_ = (next_timestamp_ + 1) & std::numeric_limits<int>::max();
+    const Request& old = tracker_[timestamp & (tracker_.size() - 1)];
+    if (old.timestamp == -1 || old.Done()) break;
+  }
+  Request& req = tracker_[timestamp & (tracker_.size() - 1)];
+  req.timestamp = timestamp;
+  req.num_expected = num;
+  req.num_received = 0;
+  req.waiters.clear();
+  if (!req.Done()) ++num_unfinished_;
+  return timestamp;
+}
+
+void Customer::GrowTracker() {
+  std::vector<Request> tracker(tracker_.size() * 2);
+  for (const auto& req : tracker_) {
+    // distinct slots of the old ring are distinct in the new one as well, so
+    // the finished requests are kept too
+    if (req.timestamp != -1) {
+      tracker[req.timestamp & (tracker.size() - 1)] = req;
+    }
+  }
+  tracker_.swap(tracker);
+  PS_VLOG(1) << "customer " << id_ << " tracks up to " << tracker_.size()
+             << " unfinished requests";
 }
 // int Customer::NewRequest(int recver, int num_response) {
 //   std::lock_guard<std::mutex> lk(tracker_mu_);
@@ -37,15 +70,58 @@ int Customer::NewRequest(int recver) {
 // }
 
 void Customer::WaitRequest(int timestamp) {
+  WaitAny({timestamp});
+}
+
+int Customer::FindDone(const std::vector<int>& timestamps) {
+  for (size_t i = 0; i < timestamps.size(); ++i) {
+    // a recycled request is finished
+    Request* req = FindRequest(timestamps[i]);
+    if (req == nullptr || req->Done()) return i;
+  }
+  return -1;
+}
+
+int Customer::WaitAny(const std::vector<int>& timestamps) {
+  CHECK(!timestamps.empty());
+  // a thread waits for one call at a time, so its condition variable is
+  // registered to the requests it waits for and only woken up by them
+  static thread_local std::condition_variable cond;
   std::unique_lock<std::mutex> lk(tracker_mu_);
-  tracker_cond_.wait(lk, [this, timestamp]{
-      return tracker_[timestamp].first == tracker_[timestamp].second;
+  int i = FindDone(timestamps);
+  if (i != -1) return timestamps[i];
+  for (int ts : timestamps) FindRequest(ts)->waiters.push_back(&cond);
+  cond.wait(lk, [this, &timestamps, &i] {
+      i = FindDone(timestamps);
+      return i != -1;
     });
+  // the finished requests have dropped their waiters already
+  for (int ts : timestamps) {
+    Request* req = FindRequest(ts);
+    if (req == nullptr || req->Done()) continue;
+    auto& w = req->waiters;
+    w.erase(std::remove(w.begin(), w.end(), &cond), w.end());
+  }
+  return timestamps[i];
+}
+
+void Customer::WaitAll(const std::vector<int>& timestamps) {
+  for (int ts : timestamps) WaitRequest(ts);
+}
+
+void Customer::AddReceived(Request* req, int num) {
+  bool done = req->Done();
+  req->num_received += num;
+  if (!req->Done()) return;
+  if (!done) --num_unfinished_;
+  for (auto cond : req->waiters) cond->notify_one();
+  req->waiters.clear();
 }
 
 int Customer::NumResponse(int timestamp) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
-  return tracker_[timestamp].second;
+  Request* req = FindRequest(timestamp);
+  return req ? req->num_received : 0;
 }
 
 // int Customer::NumExpectedResponse(int timestamp) {
@@ -55,23 +131,64 @@ int Customer::NumResponse(int timestamp) {
 
 void Customer::AddResponse(int timestamp, int num) {
   std::lock_guard<std::mutex> lk(tracker_mu_);
-  tracker_[timestamp].second += num;
+  Request* req = FindRequest(timestamp);
+  if (req) AddReceived(req, num);
+}
+
+void Customer::StartCallbackThreads(int num_threads) {
+  if (num_threads <= 0) return;
+  callback_pool_ = std::unique_ptr<ShardedThreadPool>(
+      new ShardedThreadPool(num_threads));
+}
+
+void Customer::Defer(int timestamp, const std::function<void()>& task) {
+  if (!callback_pool_) {
+    task();
+    return;
+  }
+  // count the task as one more response, so the request is not finished
+  // before it returns
+  bool track = false;
+  {
+    std::lock_guard<std::mutex> lk(tracker_mu_);
+    Request* req = FindRequest(timestamp);
+    if (req && !req->Done()) {
+      ++req->num_expected;
+      track = true;
+    }
+  }
+  callback_pool_->Submit(timestamp, [this, timestamp, task, track]() {
+      task();
+      if (track) AddResponse(timestamp);
+    });
 }
 
 void Customer::Receiving() {
+  std::vector<Message> recvs;
   while (true) {
-    Message recv;
-    recv_queue_.WaitAndPop(&recv);
-    if (!recv.meta.control.empty() &&
-        recv.meta.control.cmd == Control::TERMINATE) {
-      break;
-    }
-    // process happen before the tracker increases
-    recv_handle_(recv);
-    if (!recv.meta.request) {
-      std::lock_guard<std::mutex> lk(tracker_mu_);
-      tracker_[recv.meta.timestamp].second++;
-      tracker_cond_.notify_all();
+    // drain all queued messages at once
+    recvs.clear();
+    recv_queue_.PopAll(&recvs);
+    for (const auto& recv : recvs) {
+      if (!recv.meta.control.empty() &&
+          recv.meta.control.cmd == Control::TERMINATE) {
+        return;
+      }
+      if (!recv.meta.request) {
+        // a late response to a request whose slot is recycled
+        std::lock_guard<std::mutex> lk(tracker_mu_);
+        if (!FindRequest(recv.meta.timestamp)) {
+          PS_VLOG(1) << "drop a stale response: " << recv.DebugString();
+          continue;
+        }
+      }
+      // process happen before the tracker increases
+      recv_handle_(recv);
+      if (!recv.meta.request && !recv.meta.part) {
+        std::lock_guard<std::mutex> lk(tracker_mu_);
+        Request* req = FindRequest(recv.meta.timestamp);
+        if (req) AddReceived(req, 1);
+      }
     }
   }
 }
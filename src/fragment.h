@@ -0,0 +1,749 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_FRAGMENT_H_
+#define PS_FRAGMENT_H_
+#include <string.h>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <unordered_set>
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <algorithm>
+#include "ps/sarray.h"
+#include "ps/internal/message.h"
+#include "dmlc/logging.h"
+namespace ps {
+
+/**
+ * \brief the header of a datagram carrying a byte range of a packed message
+ *
+ * a message packed by \ref Van::PackMetaData is split into fragments of at
+ * most frag_size bytes each. fragment i carries the bytes
+ * [i * frag_size, (i+1) * frag_size) of the packed message
+ */
+struct FragmentHeader {
+  /** \brief {0, 'F'} */
+  char tag[2];
+  uint16_t reserved;
+  /** \brief the sender's node id */
+  int32_t sender;
+  /** \brief the message id, consecutive per sender and receiver */
+  uint32_t msg_id;
+  /** \brief the index of this fragment */
+  uint32_t frag;
+  /** \brief the number of fragments of this message */
+  uint32_t num_frags;
+  /** \brief the payload size of every but the last fragment */
+  uint32_t frag_size;
+  /** \brief the size of the packed message */
+  uint64_t total_size;
+};
+
+/**
+ * \brief the header of a datagram carrying a run of key-value pairs
+ *
+ * it is followed by a message packed by \ref Van::PackMetaData with the meta
+ * of the whole message and the keys, values and lens of this run, so each
+ * datagram can be applied on its own. a key whose value is larger than a
+ * datagram is split into several runs by value offset
+ */
+struct KVFragmentHeader {
+  /** \brief {0, 'K'} */
+  char tag[2];
+  /** \brief whether the message has lens */
+  uint16_t has_lens;
+  /** \brief the sender's node id */
+  int32_t sender;
+  /** \brief the message id, consecutive per sender and receiver */
+  uint32_t msg_id;
+  /** \brief the index of this fragment */
+  uint32_t frag;
+  /** \brief the number of fragments of this message */
+  uint32_t num_frags;
+  /** \brief the number of keys of the whole message */
+  uint32_t num_keys;
+  /** \brief the index of the first key of this run */
+  uint32_t key_begin;
+  /** \brief the bytes of a value element if has_lens */
+  uint32_t val_elem;
+  /** \brief the bytes of the first key's value carried by the previous runs */
+  uint64_t val_skip;
+  /** \brief the offset in bytes of this run in the values of the message */
+  uint64_t val_begin;
+  /** \brief the bytes of the values of the message */
+  uint64_t val_total;
+};
+
+/**
+ * \brief the datagram a receiver sends back every interval to report the
+ * datagrams received and lost from a sender, see \ref Pacer
+ */
+struct LossReport {
+  /** \brief {0, 'R'} */
+  char tag[2];
+  uint16_t reserved;
+  /** \brief the reporter's node id */
+  int32_t sender;
+  /** \brief the datagrams received since the last report */
+  uint32_t received;
+  /** \brief the datagrams lost since the last report */
+  uint32_t lost;
+};
+
+/**
+ * \brief split a packed message into datagrams
+ *
+ * the message is described by the head returned by \ref Van::PackMetaDataHead
+ * and the data, so that each byte is copied only once, directly into the
+ * datagram
+ */
+class Fragmenter {
+ public:
+  /**
+   * \param mtu the max size of a datagram, including the \ref FragmentHeader
+   */
+  Fragmenter(int sender, uint32_t msg_id, const std::string& head,
+             const std::vector<SArray<char>>& data, size_t total_size, size_t mtu) {
+    CHECK_GT(mtu, sizeof(FragmentHeader) + 8) << "too small mtu";
+    hdr_.tag[0] = 0;
+    hdr_.tag[1] = 'F';
+    hdr_.reserved = 0;
+    hdr_.sender = sender;
+    hdr_.msg_id = msg_id;
+    // keep the fragments 8-byte aligned
+    hdr_.frag_size = (mtu - sizeof(FragmentHeader)) & ~static_cast<size_t>(7);
+    hdr_.total_size = total_size;
+    size_t num_frags = std::max(static_cast<size_t>(1),
+                                (total_size + hdr_.frag_size - 1) / hdr_.frag_size);
+    hdr_.num_frags = num_frags;
+    CHECK_EQ(hdr_.num_frags, num_frags) << "message too large";
+
+    size_t pos = 0;
+    pieces_.push_back({pos, head.data(), head.size()});
+    pos += head.size();
+    for (const auto& d : data) {
+      pieces_.push_back({pos, d.data(), d.size()});
+      pos += (d.size() + 7) & ~static_cast<size_t>(7);
+    }
+    CHECK_EQ(pos, total_size);
+  }
+
+  /** \brief the number of datagrams */
+  size_t num_frags() const { return hdr_.num_frags; }
+
+  /** \brief the size of datagram i */
+  size_t size(size_t i) const {
+    size_t begin = i * hdr_.frag_size;
+    size_t end = std::min(begin + hdr_.frag_size, static_cast<size_t>(hdr_.total_size));
+    return sizeof(FragmentHeader) + end - begin;
+  }
+
+  /** \brief write datagram i into buf, which has at least size(i) bytes */
+  void Write(size_t i, char* buf) const {
+    FragmentHeader hdr = hdr_;
+    hdr.frag = i;
+    memcpy(buf, &hdr, sizeof(hdr));
+    WritePayload(i, buf + sizeof(hdr));
+  }
+
+ private:
+  /** \brief write the payload of datagram i */
+  void WritePayload(size_t i, char* buf) const {
+    size_t begin = i * hdr_.frag_size;
+    size_t end = begin + size(i) - sizeof(FragmentHeader);
+    // the last piece starting at or before begin
+    auto it = std::upper_bound(
+        pieces_.begin(), pieces_.end(), begin,
+        [](size_t pos, const Piece& p) { return pos < p.pos; }) - 1;
+    for (size_t pos = begin; pos < end; ++it) {
+      size_t piece_end = std::min(end, it + 1 == pieces_.end() ?
+                                  end : (it + 1)->pos);
+      size_t n = pos < it->pos + it->size ?
+                 std::min(piece_end, it->pos + it->size) - pos : 0;
+      if (n) memcpy(buf, it->data + pos - it->pos, n);
+      // zero the padding
+      memset(buf + n, 0, piece_end - pos - n);
+      buf += piece_end - pos;
+      pos = piece_end;
+    }
+  }
+
+  struct Piece {
+    size_t pos;
+    const char* data;
+    size_t size;
+  };
+  FragmentHeader hdr_;
+  std::vector<Piece> pieces_;
+};
+
+/**
+ * \brief split a key-value message into self-contained runs of key-value
+ * pairs, see \ref KVFragmentHeader
+ */
+class KVFragmenter {
+ public:
+  /**
+   * \brief whether msg is a key-value message that can be split into runs
+   */
+  static bool IsKV(const Message& msg) {
+    const auto& data = msg.data;
+    if (!msg.meta.control.empty() || msg.meta.simple_app) return false;
+    if (data.size() != 2 && data.size() != 3) return false;
+    if (data[0].size() % sizeof(Key)) return false;
+    size_t num_keys = data[0].size() / sizeof(Key);
+    if (data.size() == 2) {
+      return num_keys && data[1].size() % num_keys == 0;
+    }
+    if (data[2].size() != num_keys * sizeof(int)) return false;
+    SArray<int> lens(data[2]);
+    size_t num_vals = 0;
+    for (int l : lens) num_vals += l;
+    return num_vals ? data[1].size() % num_vals == 0 : data[1].empty();
+  }
+
+  /**
+   * \param head_size the size of the head packed by \ref Van::PackMetaDataHead
+   * for msg
+   * \param mtu the max size of a datagram, including the \ref KVFragmentHeader
+   */
+  KVFragmenter(int sender, uint32_t msg_id, const Message& msg,
+               size_t head_size, size_t mtu) : msg_(msg) {
+    const auto& data = msg.data;
+    hdr_.tag[0] = 0;
+    hdr_.tag[1] = 'K';
+    hdr_.has_lens = data.size() == 3;
+    hdr_.sender = sender;
+    hdr_.msg_id = msg_id;
+    hdr_.num_keys = data[0].size() / sizeof(Key);
+    hdr_.val_total = data[1].size();
+    if (hdr_.has_lens) lens_ = data[2];
+    size_t num_vals = 0;
+    for (int l : lens_) num_vals += l;
+    hdr_.val_elem = num_vals ? hdr_.val_total / num_vals : 0;
+
+    // the room for keys, lens and values, minus the padding of three data
+    CHECK_GT(mtu, sizeof(KVFragmentHeader) + head_size + 24 + 64) << "too small mtu";
+    size_t room = mtu - sizeof(KVFragmentHeader) - head_size - 24;
+    size_t fixed = sizeof(Key) + (hdr_.has_lens ? sizeof(int) : 0);
+    size_t k = 0, skip = 0, val_pos = 0;
+    do {
+      Run run;
+      run.key_begin = k;
+      run.val_skip = skip;
+      run.val_begin = val_pos;
+      size_t used = 0;
+      while (k < hdr_.num_keys) {
+        size_t rest = KeyBytes(k) - skip;
+        if (used + fixed + rest <= room) {
+          used += fixed + rest;
+          val_pos += rest;
+          skip = 0;
+          ++k;
+        } else {
+          if (used == 0) {
+            // split a large value by offset
+            size_t n = (room - fixed) & ~static_cast<size_t>(7);
+            val_pos += n;
+            skip += n;
+            run.key_end = k + 1;
+          }
+          break;
+        }
+      }
+      if (run.key_end < k) run.key_end = k;
+      run.val_end = val_pos;
+      runs_.push_back(run);
+    } while (k < hdr_.num_keys);
+    hdr_.num_frags = runs_.size();
+    CHECK_EQ(hdr_.num_frags, runs_.size()) << "message too large";
+  }
+
+  /** \brief the number of datagrams */
+  size_t num_frags() const { return runs_.size(); }
+
+  /** \brief the message carried by datagram i */
+  Message msg(size_t i) const {
+    const auto& run = runs_[i];
+    Message sub;
+    sub.meta = msg_.meta;
+    sub.data.push_back(msg_.data[0].segment(
+        run.key_begin * sizeof(Key), run.key_end * sizeof(Key)));
+    sub.data.push_back(msg_.data[1].segment(run.val_begin, run.val_end));
+    if (hdr_.has_lens) {
+      sub.data.push_back(msg_.data[2].segment(
+          run.key_begin * sizeof(int), run.key_end * sizeof(int)));
+    }
+    return sub;
+  }
+
+  /**
+   * \brief write datagram i into buf
+   * \param run the message returned by \ref msg for i
+   * \param head the head packed by \ref Van::PackMetaDataHead for run
+   * \param buf at least sizeof(KVFragmentHeader) plus the size returned by
+   * \ref Van::PackMetaDataHead bytes
+   */
+  void Write(size_t i, const Message& run, const std::string& head, char* buf) const {
+    KVFragmentHeader hdr = hdr_;
+    hdr.frag = i;
+    hdr.key_begin = runs_[i].key_begin;
+    hdr.val_skip = runs_[i].val_skip;
+    hdr.val_begin = runs_[i].val_begin;
+    memcpy(buf, &hdr, sizeof(hdr));
+    buf += sizeof(hdr);
+    memcpy(buf, head.data(), head.size());
+    buf += head.size();
+    for (const auto& d : run.data) {
+      size_t padded = (d.size() + 7) & ~static_cast<size_t>(7);
+      memcpy(buf, d.data(), d.size());
+      memset(buf + d.size(), 0, padded - d.size());
+      buf += padded;
+    }
+  }
+
+ private:
+  size_t KeyBytes(size_t k) const {
+    return hdr_.has_lens ? lens_[k] * hdr_.val_elem : hdr_.val_total / hdr_.num_keys;
+  }
+  struct Run {
+    size_t key_begin = 0, key_end = 0;
+    size_t val_skip = 0, val_begin = 0, val_end = 0;
+  };
+  const Message& msg_;
+  KVFragmentHeader hdr_;
+  SArray<int> lens_;
+  std::vector<Run> runs_;
+};
+
+/**
+ * \brief reassemble datagrams produced by \ref Fragmenter and
+ * \ref KVFragmenter into messages
+ *
+ * not thread safe, it is supposed to be used by the receiving thread only
+ */
+class Reassembler {
+ public:
+  /** \brief unpack a message packed by \ref Van::PackMetaData */
+  using Unpack = std::function<void(const SArray<char>& buf, Message* msg)>;
+  /**
+   * \brief unpack a partially received message, see
+   * \ref Van::UnpackPartialMetaData
+   */
+  using UnpackPartial = std::function<bool(
+      const SArray<char>& buf, const std::function<bool(size_t, size_t)>& received,
+      Message* msg)>;
+
+  /**
+   * \param timeout timeout in millisecond of an incomplete message
+   * \param partial whether to return what is received of a timed out message
+   */
+  Reassembler(int timeout, bool partial, const Unpack& unpack,
+              const UnpackPartial& unpack_partial)
+      : timeout_(timeout), partial_(partial), unpack_(unpack),
+        unpack_partial_(unpack_partial) { }
+
+  /** \brief the datagrams received and lost from a sender */
+  struct Loss {
+    uint32_t received = 0;
+    uint32_t lost = 0;
+  };
+
+  /**
+   * \brief add a datagram
+   * \return true if a message is complete, which is then stored in msg.
+   * a message of a single datagram references the datagram without copying.
+   *
+   * if partial, the runs of a key-value message with values that is neither
+   * RELIABLE nor NACK are delivered as they arrive, see \ref AddKV. msg is
+   * then a part of the message, and another part may be left for
+   * \ref PopReady
+   */
+  bool Add(const SArray<char>& datagram, Message* msg) {
+    CHECK_GE(datagram.size(), 2) << "corrupted datagram";
+    if (datagram[0] == 0 && datagram[1] == 'K') return AddKV(datagram, msg);
+    FragmentHeader hdr;
+    CHECK_GE(datagram.size(), sizeof(hdr)) << "corrupted datagram";
+    memcpy(&hdr, datagram.data(), sizeof(hdr));
+    CHECK(hdr.tag[0] == 0 && hdr.tag[1] == 'F') << "corrupted datagram";
+    Count(hdr.sender, hdr.msg_id);
+    if (hdr.num_frags == 1) {
+      unpack_(datagram.segment(sizeof(hdr), datagram.size()), msg);
+      return true;
+    }
+    CHECK_LT(hdr.frag, hdr.num_frags) << "corrupted datagram";
+    uint64_t key = GetKey(hdr.sender, hdr.msg_id);
+    // late fragments of a timed out message
+    if (expired_ids_.count(key)) return false;
+    auto& pend = pending_[key];
+    if (pend.got.empty()) {
+      pend.buf.reset(new char[hdr.total_size], hdr.total_size,
+                     [](char* data) { delete [] data; });
+      pend.got.resize(hdr.num_frags, false);
+      pend.frag_size = hdr.frag_size;
+      pend.start = Clock::now();
+    }
+    if (pend.got[hdr.frag]) return false;
+    size_t n = datagram.size() - sizeof(hdr);
+    CHECK_LE(hdr.frag * pend.frag_size + n, pend.buf.size()) << "corrupted datagram";
+    memcpy(pend.buf.data() + hdr.frag * pend.frag_size,
+           datagram.data() + sizeof(hdr), n);
+    pend.got[hdr.frag] = true;
+    if (++pend.num_got < pend.got.size()) return false;
+    unpack_(pend.buf, msg);
+    pending_.erase(key);
+    return true;
+  }
+
+  /**
+   * \brief pop a part of a key-value message that is ready besides the one
+   * returned by \ref Add, which must be called until it returns false before
+   * the next datagram is added
+   */
+  bool PopReady(Message* msg) {
+    if (ready_.empty()) return false;
+    *msg = std::move(ready_.front());
+    ready_.pop_front();
+    return true;
+  }
+
+  /**
+   * \brief remove the incomplete messages that are timed out
+   * \return true if what is received of one of them is stored in msg.
+   *
+   * for a message split by \ref KVFragmenter whose runs are delivered as they
+   * arrive, msg has no data and completes the message. for any other one
+   * split by \ref KVFragmenter, msg has the keys that are received, which is
+   * all it carries if it is not resent. otherwise msg is a fake message with
+   * only the keys if they are received
+   */
+  bool PopExpired(Message* msg) {
+    auto now = Clock::now();
+    while (true) {
+      auto it = pending_.begin();
+      while (it != pending_.end() &&
+             now - it->second.start < std::chrono::milliseconds(timeout_)) {
+        ++it;
+      }
+      if (it == pending_.end()) return false;
+      uint64_t key = it->first;
+      Pending pend = std::move(it->second);
+      pending_.erase(it);
+      expired_ids_.insert(key);
+      expired_fifo_.push_back(key);
+      if (expired_fifo_.size() > kMaxExpiredIDs) {
+        expired_ids_.erase(expired_fifo_.front());
+        expired_fifo_.pop_front();
+      }
+      ++num_expired_;
+      loss_[static_cast<int32_t>(key >> 32)].lost += pend.got.size() - pend.num_got;
+      if (pend.kv) {
+        num_lost_keys_ += std::count(pend.key_got.begin(), pend.key_got.end(), false);
+      }
+      if (!partial_) continue;
+      if (pend.kv) {
+        ReceivedKV(pend, msg);
+        return true;
+      }
+      auto received = [&pend](size_t begin, size_t end) {
+        for (size_t i = begin / pend.frag_size; i * pend.frag_size < end; ++i) {
+          if (!pend.got[i]) return false;
+        }
+        return true;
+      };
+      if (unpack_partial_(pend.buf, received, msg)) return true;
+    }
+  }
+
+  /** \brief the number of messages timed out so far */
+  size_t num_expired() const { return num_expired_; }
+
+  /** \brief the number of keys of the timed out key-value messages lost */
+  size_t num_lost_keys() const { return num_lost_keys_; }
+
+  /**
+   * \brief move the datagrams received and lost from each sender since the
+   * last call into loss
+   *
+   * a datagram is lost if its message timed out, or if a whole message is
+   * missing, which is then counted as a single datagram. a message is missing
+   * if it is still not received at the call after the one its id is skipped,
+   * so a reordered message is not lost
+   */
+  void PopLoss(std::unordered_map<int, Loss>* loss) {
+    for (auto& it : senders_) {
+      auto& s = it.second;
+      if (!s.old_missing.empty()) loss_[it.first].lost += s.old_missing.size();
+      s.old_missing.clear();
+      s.old_missing.swap(s.missing);
+    }
+    loss->clear();
+    loss->swap(loss_);
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  /** \brief the number of timed out messages remembered */
+  static const size_t kMaxExpiredIDs = 4096;
+  /** \brief the max message ids a late message is behind */
+  static const int32_t kMaxReorder = 1 << 16;
+  /** \brief the max missing message ids remembered per sender */
+  static const size_t kMaxMissing = 1024;
+  /** \brief a value split by offset across runs */
+  struct Split {
+    /** \brief the value being received if stream */
+    SArray<char> val;
+    /** \brief the bytes received */
+    size_t recv = 0;
+  };
+  struct Pending {
+    // fragments
+    std::vector<bool> got;
+    size_t num_got = 0;
+    Clock::time_point start;
+    // byte ranges of a packed message
+    SArray<char> buf;
+    size_t frag_size = 0;
+    // runs of key-value pairs
+    bool kv = false;
+    /** \brief whether the runs are delivered as they arrive */
+    bool stream = false;
+    KVFragmentHeader hdr;
+    Meta meta;
+    /** \brief the whole message if not stream */
+    SArray<char> keys, vals, lens;
+    /** \brief whether each key's value is completely received */
+    std::vector<bool> key_got;
+    /** \brief the keys whose values are split by offset, see \ref Split */
+    std::unordered_map<size_t, Split> splits;
+  };
+
+  static uint64_t GetKey(int sender, uint32_t msg_id) {
+    return (static_cast<uint64_t>(static_cast<uint32_t>(sender)) << 32) | msg_id;
+  }
+
+  /**
+   * \brief count a datagram. the message ids from a sender are consecutive,
+   * so a gap is a missing message, unless it arrives late
+   */
+  void Count(int sender, uint32_t msg_id) {
+    auto& loss = loss_[sender];
+    ++loss.received;
+    auto it = senders_.find(sender);
+    if (it == senders_.end()) {
+      senders_[sender].next_msg_id = msg_id + 1;
+      return;
+    }
+    auto& s = it->second;
+    int32_t gap = static_cast<int32_t>(msg_id - s.next_msg_id);
+    if (gap >= 0) {
+      // wait for the skipped ids, up to kMaxMissing of them
+      size_t num = s.missing.size() + s.old_missing.size();
+      size_t wait = std::min(static_cast<size_t>(gap),
+                             kMaxMissing - std::min(kMaxMissing, num));
+      for (size_t i = 0; i < wait; ++i) s.missing.insert(s.next_msg_id + i);
+      loss.lost += gap - wait;
+      s.next_msg_id = msg_id + 1;
+    } else if (gap < -kMaxReorder) {
+      // the sender restarted
+      s.next_msg_id = msg_id + 1;
+      s.missing.clear();
+      s.old_missing.clear();
+    } else if (!s.missing.erase(msg_id)) {
+      s.old_missing.erase(msg_id);
+    }
+  }
+
+  size_t KeyBytes(const KVFragmentHeader& hdr, const int* lens, size_t i) const {
+    return hdr.has_lens ? lens[i] * hdr.val_elem : hdr.val_total / hdr.num_keys;
+  }
+
+  /**
+   * \brief add a datagram of a key-value message.
+   *
+   * a RELIABLE or NACK message is resent as a whole, and a message without
+   * values, such as a pull request, is answered once per delivery, so they
+   * are copied into the whole message until it is complete. the runs of any
+   * other message are delivered as they arrive, as parts referencing the
+   * datagram, and only a value split by offset is copied until all its runs
+   * arrive. the part delivered last completes the message
+   */
+  bool AddKV(const SArray<char>& datagram, Message* msg) {
+    KVFragmentHeader hdr;
+    CHECK_GE(datagram.size(), sizeof(hdr)) << "corrupted datagram";
+    memcpy(&hdr, datagram.data(), sizeof(hdr));
+    Count(hdr.sender, hdr.msg_id);
+    Message run;
+    unpack_(datagram.segment(sizeof(hdr), datagram.size()), &run);
+    if (hdr.num_frags == 1) {
+      *msg = run;
+      return true;
+    }
+    CHECK_LT(hdr.frag, hdr.num_frags) << "corrupted datagram";
+    CHECK_EQ(run.data.size(), hdr.has_lens ? 3 : 2) << "corrupted datagram";
+    uint64_t key = GetKey(hdr.sender, hdr.msg_id);
+    if (expired_ids_.count(key)) return false;
+    auto& pend = pending_[key];
+    if (pend.got.empty()) {
+      pend.kv = true;
+      pend.stream = partial_ && hdr.val_total &&
+                    run.meta.reliability != Meta::RELIABLE &&
+                    run.meta.reliability != Meta::NACK;
+      pend.hdr = hdr;
+      pend.meta = run.meta;
+      pend.got.resize(hdr.num_frags, false);
+      pend.start = Clock::now();
+      pend.key_got.resize(hdr.num_keys, false);
+      if (!pend.stream) {
+        pend.keys.resize(hdr.num_keys * sizeof(Key));
+        pend.vals.resize(hdr.val_total);
+        if (hdr.has_lens) pend.lens.resize(hdr.num_keys * sizeof(int));
+      }
+    }
+    if (pend.got[hdr.frag]) return false;
+    pend.got[hdr.frag] = true;
+    AddRun(hdr, run, &pend);
+    if (++pend.num_got < pend.got.size()) return PopReady(msg);
+    if (pend.stream) {
+      // all splits are completed by the last run, so it delivers a part
+      CHECK(!ready_.empty());
+      ready_.back().meta.part = false;
+    } else {
+      Message whole;
+      whole.meta = pend.meta;
+      whole.data = {pend.keys, pend.vals};
+      if (hdr.has_lens) whole.data.push_back(pend.lens);
+      ready_.push_back(std::move(whole));
+    }
+    pending_.erase(key);
+    return PopReady(msg);
+  }
+
+  /**
+   * \brief add a run to a pending message. if stream, the whole keys of the
+   * run and the split values it completes are put into ready_ as parts
+   */
+  void AddRun(const KVFragmentHeader& hdr, const Message& run, Pending* pend) {
+    const auto& keys = run.data[0];
+    const auto& vals = run.data[1];
+    size_t num_keys = keys.size() / sizeof(Key);
+    CHECK_LE(hdr.key_begin + num_keys, hdr.num_keys) << "corrupted datagram";
+    CHECK_LE(hdr.val_begin + vals.size(), hdr.val_total) << "corrupted datagram";
+    const int* lens = nullptr;
+    if (hdr.has_lens) {
+      CHECK_EQ(run.data[2].size(), num_keys * sizeof(int)) << "corrupted datagram";
+      lens = reinterpret_cast<const int*>(run.data[2].data());
+    }
+    if (!pend->stream) {
+      memcpy(pend->keys.data() + hdr.key_begin * sizeof(Key), keys.data(), keys.size());
+      memcpy(pend->vals.data() + hdr.val_begin, vals.data(), vals.size());
+      if (lens) {
+        memcpy(pend->lens.data() + hdr.key_begin * sizeof(int),
+               run.data[2].data(), run.data[2].size());
+      }
+    }
+    // only the first and the last key of a run can be split, so the whole
+    // keys are [first, last) with the values [first_pos, last_pos)
+    size_t first = num_keys, last = 0, first_pos = 0, last_pos = 0;
+    size_t pos = 0;
+    for (size_t i = 0; i < num_keys; ++i) {
+      size_t k = hdr.key_begin + i;
+      size_t skip = i == 0 ? hdr.val_skip : 0;
+      size_t bytes = KeyBytes(hdr, lens, i);
+      CHECK_LE(skip, bytes) << "corrupted datagram";
+      size_t n = std::min(bytes - skip, vals.size() - pos);
+      if (n == bytes) {
+        pend->key_got[k] = true;
+        if (first == num_keys) {
+          first = i;
+          first_pos = pos;
+        }
+        last = i + 1;
+        last_pos = pos + n;
+        pos += n;
+        continue;
+      }
+      auto& split = pend->splits[k];
+      if (pend->stream) {
+        if (split.val.empty()) split.val.resize(bytes);
+        memcpy(split.val.data() + skip, vals.data() + pos, n);
+      }
+      pos += n;
+      split.recv += n;
+      if (split.recv < bytes) continue;
+      pend->key_got[k] = true;
+      if (pend->stream) {
+        Message part;
+        part.meta = pend->meta;
+        part.meta.part = true;
+        part.data = {keys.segment(i * sizeof(Key), (i + 1) * sizeof(Key)), split.val};
+        if (lens) part.data.push_back(run.data[2].segment(i * sizeof(int), (i + 1) * sizeof(int)));
+        ready_.push_back(std::move(part));
+      }
+      pend->splits.erase(k);
+    }
+    if (!pend->stream || first == num_keys) return;
+    Message part;
+    part.meta = pend->meta;
+    part.meta.part = true;
+    part.data = {keys.segment(first * sizeof(Key), last * sizeof(Key)),
+                 vals.segment(first_pos, last_pos)};
+    if (lens) {
+      part.data.push_back(run.data[2].segment(first * sizeof(int), last * sizeof(int)));
+    }
+    ready_.push_back(std::move(part));
+  }
+
+  /**
+   * \brief what is received of a timed out key-value message. the parts
+   * delivered so far are not repeated
+   */
+  void ReceivedKV(const Pending& pend, Message* msg) {
+    msg->meta = pend.meta;
+    msg->data.clear();
+    // a message without data still completes the request
+    if (pend.stream) return;
+    // only the keys, the values of a message that is not resent are empty
+    const auto& hdr = pend.hdr;
+    SArray<char> keys, lens;
+    for (size_t k = 0; k < hdr.num_keys; ++k) {
+      if (!pend.key_got[k]) continue;
+      keys.append(pend.keys.segment(k * sizeof(Key), (k + 1) * sizeof(Key)));
+      if (hdr.has_lens) {
+        lens.append(pend.lens.segment(k * sizeof(int), (k + 1) * sizeof(int)));
+      }
+    }
+    if (keys.empty()) return;
+    msg->data = {keys, SArray<char>()};
+    if (hdr.has_lens) msg->data.push_back(lens);
+  }
+
+  int timeout_;
+  bool partial_;
+  Unpack unpack_;
+  UnpackPartial unpack_partial_;
+  std::unordered_map<uint64_t, Pending> pending_;
+  std::unordered_set<uint64_t> expired_ids_;
+  std::deque<uint64_t> expired_fifo_;
+  size_t num_expired_ = 0;
+  size_t num_lost_keys_ = 0;
+  /** \brief the parts of key-value messages not yet returned */
+  std::deque<Message> ready_;
+  std::unordered_map<int, Loss> loss_;
+  /** \brief the message ids seen from a sender */
+  struct Sender {
+    /** \brief the next message id expected */
+    uint32_t next_msg_id;
+    /** \brief the ids skipped since the last \ref PopLoss */
+    std::unordered_set<uint32_t> missing;
+    /** \brief the ids skipped before the last \ref PopLoss */
+    std::unordered_set<uint32_t> old_missing;
+  };
+  std::unordered_map<int, Sender> senders_;
+};
+
+}  // namespace ps
+#endif  // PS_FRAGMENT_H_
@@ -0,0 +1,220 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_HYBRID_VAN_H_
+#define PS_HYBRID_VAN_H_
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <unordered_set>
+#include "ps/internal/van.h"
+#include "ps/internal/threadsafe_queue.h"
+#include "./zmq_van.h"
+#ifdef __linux__
+#include "./shm_van.h"
+#endif
+namespace ps {
+
+/**
+ * \brief a van sending control messages over TCP and loss-tolerant data over
+ * UDP
+ *
+ * it owns a \ref ZMQVan and a \ref ZMQUDPVan, which bind the same port number
+ * and connect to every node the same way. they share the node id of this van,
+ * and the messages received by both are handed to the single receiving thread
+ * of this van. so node registration, barriers, heartbeats and the ACKs of the
+ * resender are never lost, while pull responses travel over UDP.
+ *
+ * a data message goes over UDP if it is a response to a pull, or its class is
+ * \ref Meta::BEST_EFFORT. push requests go over UDP only if PS_HYBRID_UDP_PUSH
+ * is set, and everything else goes over TCP.
+ *
+ * on linux, all messages to a node on the same host go through a \ref SHMVan
+ * instead, unless PS_HYBRID_SHM is 0. the transport of a node is chosen by
+ * its hostname when connecting to it.
+ */
+class HybridVan : public Van {
+ public:
+  HybridVan() { }
+  virtual ~HybridVan() { }
+
+ protected:
+  void Start() override {
+    udp_push_ = GetEnv("PS_HYBRID_UDP_PUSH", 0);
+    tcp_.StartTransport();
+    udp_.StartTransport();
+    // the messages of the tcp van are only received from its first shard
+    tcp_.num_recv_shards_ = 1;
+#ifdef __linux__
+    use_shm_ = GetEnv("PS_HYBRID_SHM", 1);
+    if (use_shm_) shm_.StartTransport();
+#endif
+    Van::Start();
+  }
+
+  void Stop() override {
+    PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
+    // the TERMINATE sent by Van::Stop stops the thread of the van it goes
+    // through. send another one through each other van to stop its thread
+    Van::Stop();
+    stopping_ = true;
+    Message exit;
+    exit.meta.control.cmd = Control::TERMINATE;
+    exit.meta.recver = my_node_.id;
+    tcp_.SendMsg(exit);
+    tcp_thread_->join();
+#ifdef __linux__
+    if (use_shm_) {
+      shm_.SendMsg(exit);
+      shm_thread_->join();
+      shm_.StopTransport();
+    }
+#endif
+    // wake up the blocked receive of the UDP van
+    zmq_ctx_shutdown(udp_.context_);
+    udp_thread_->join();
+    tcp_.StopTransport();
+    udp_.StopTransport();
+  }
+
+  int Bind(const Node& node, int max_retry) override {
+    // the nodes only know a single port of each other, so both vans bind the
+    // same one. binding the tcp van again closes its previous sockets
+    Node bind_node = node;
+    unsigned seed = static_cast<unsigned>(time(NULL) + node.port);
+    int port = -1;
+    for (int i = 0; i < max_retry + 1; ++i) {
+      port = tcp_.Bind(bind_node, 0);
+      if (port != -1) {
+        if (udp_.Bind(bind_node, 0) == port) break;
+        PS_VLOG(1) << "the tcp port " << port << " is free but the udp one is not";
+        port = -1;
+      }
+      bind_node.port = 10000 + rand_r(&seed) % 40000;
+    }
+    if (port == -1) return -1;
+#ifdef __linux__
+    if (use_shm_) {
+      // the tcp socket holds the port
+      if (!shm_.BindInbox(port)) {
+        LOG(WARNING) << "failed to create the shared memory inbox of port " << port;
+        return -1;
+      }
+      shm_thread_ = std::unique_ptr<std::thread>(
+          new std::thread(&HybridVan::Forwarding<SHMVan>, this, &shm_));
+    }
+#endif
+    tcp_thread_ = std::unique_ptr<std::thread>(
+        new std::thread(&HybridVan::Forwarding<ZMQVan>, this, &tcp_));
+    udp_thread_ = std::unique_ptr<std::thread>(
+        new std::thread(&HybridVan::Forwarding<ZMQUDPVan>, this, &udp_));
+    return port;
+  }
+
+  void Connect(const Node& node) override {
+    {
+      // my id is assigned by the scheduler before connecting to the others.
+      // several nodes may be connected at a time, see Van::Preconnect
+      std::lock_guard<std::mutex> lk(mu_);
+      if (tcp_.my_node_.id != my_node_.id || tcp_.my_node_.port != my_node_.port) {
+        tcp_.my_node_ = my_node_;
+        udp_.my_node_ = my_node_;
+#ifdef __linux__
+        shm_.my_node_ = my_node_;
+#endif
+      }
+    }
+    tcp_.Connect(node);
+    udp_.Connect(node);
+#ifdef __linux__
+    if (use_shm_) {
+      std::lock_guard<std::mutex> lk(mu_);
+      // a node binds before it is known to the others, so it has no inbox if
+      // it does not use shared memory, such as with PS_HYBRID_SHM=0
+      if (IsLocal(node.hostname) && shm_.HasInbox(node.port)) {
+        shm_.Connect(node);
+        local_.insert(node.id);
+      } else {
+        local_.erase(node.id);
+      }
+    }
+#endif
+  }
+
+  int SendMsg(const Message& msg) override {
+#ifdef __linux__
+    if (use_shm_ && IsLocalNode(msg.meta.recver)) return shm_.SendMsg(msg);
+#endif
+    return UseUDP(msg) ? udp_.SendMsg(msg) : tcp_.SendMsg(msg);
+  }
+
+  int RecvMsg(Message* msg) override {
+    Received recv;
+    recv_queue_.WaitAndPop(&recv);
+    *msg = std::move(recv.msg);
+    return recv.bytes;
+  }
+
+ private:
+  /** \brief a message received by one of the vans */
+  struct Received {
+    Message msg;
+    int bytes = 0;
+  };
+
+  /** \brief whether hostname is the host of this node */
+  bool IsLocal(const std::string& hostname) {
+    return hostname == my_node_.hostname || hostname == "localhost" ||
+        hostname.compare(0, 4, "127.") == 0;
+  }
+
+  /** \brief whether messages to the node go through shared memory */
+  bool IsLocalNode(int id) {
+    std::lock_guard<std::mutex> lk(mu_);
+    return local_.count(id) > 0;
+  }
+
+  /** \brief whether msg is sent over UDP */
+  bool UseUDP(const Message& msg) {
+    const auto& meta = msg.meta;
+    if (!meta.control.empty() || meta.simple_app) return false;
+    if (meta.reliability == Meta::BEST_EFFORT) return true;
+    if (meta.push) return meta.request && udp_push_;
+    return !meta.request;
+  }
+
+  /** \brief thread function moving the messages received by van to recv_queue_ */
+  template <typename V>
+  void Forwarding(V* van) {
+    while (true) {
+      Received recv;
+      recv.bytes = van->RecvMsg(&recv.msg);
+      // the context of the UDP van is shut down
+      if (recv.bytes == -1 && static_cast<void*>(van) == &udp_) break;
+      bool terminate = recv.msg.meta.control.cmd == Control::TERMINATE;
+      // Van::Receiving has stopped
+      if (terminate && stopping_) break;
+      recv_queue_.Push(std::move(recv));
+      if (terminate) break;
+    }
+  }
+
+  ZMQVan tcp_;
+  ZMQUDPVan udp_;
+  /** \brief whether push requests are sent over UDP */
+  int udp_push_ = 0;
+  std::unique_ptr<std::thread> tcp_thread_;
+  std::unique_ptr<std::thread> udp_thread_;
+#ifdef __linux__
+  SHMVan shm_;
+  int use_shm_ = 0;
+  std::unique_ptr<std::thread> shm_thread_;
+#endif
+  /** \brief the nodes on the same host, guarded by mu_ */
+  std::unordered_set<int> local_;
+  std::mutex mu_;
+  std::atomic<bool> stopping_{false};
+  ThreadsafeQueue<Received> recv_queue_;
+};
+}  // namespace ps
+#endif  // PS_HYBRID_VAN_H_
@@ -0,0 +1,112 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_PACER_H_
+#define PS_PACER_H_
+#include <chrono>
+#include <mutex>
+#include <thread>
+#include <string>
+#include <sstream>
+#include <algorithm>
+namespace ps {
+
+/**
+ * \brief pace the datagrams sent to a node by a token bucket
+ *
+ * the rate is adjusted AIMD-style by the loss the receiver reports every
+ * interval: it is halved if more than 1% of the datagrams are lost, and is
+ * otherwise increased by 1/64 of the max rate. after a decrease, the reports
+ * of the next interval are ignored, since they still count the datagrams sent
+ * at the old rate.
+ */
+class Pacer {
+ public:
+  /**
+   * \param max_rate the max rate in bytes per second, which is also the
+   * initial rate
+   * \param min_rate the min rate in bytes per second
+   * \param burst the max bytes sent back to back
+   * \param interval the report interval in millisecond
+   */
+  Pacer(double max_rate, double min_rate, double burst, int interval)
+      : max_rate_(max_rate), min_rate_(min_rate), burst_(burst),
+        interval_(interval), rate_(max_rate), tokens_(burst) {
+    last_ = Clock::now();
+    last_decrease_ = last_;
+  }
+
+  /**
+   * \brief block until bytes can be sent
+   */
+  void Wait(size_t bytes) {
+    std::unique_lock<std::mutex> lk(mu_);
+    auto now = Clock::now();
+    tokens_ = std::min(burst_, tokens_ + rate_ * Seconds(now - last_));
+    last_ = now;
+    tokens_ -= bytes;
+    sent_bytes_ += bytes;
+    if (tokens_ >= 0) return;
+    // the debt is paid by the time the tokens are refilled
+    std::chrono::duration<double> wait(-tokens_ / rate_);
+    waited_ += wait.count();
+    lk.unlock();
+    std::this_thread::sleep_for(wait);
+  }
+
+  /**
+   * \brief adjust the rate by a report of the receiver
+   * \param received the datagrams received since the last report
+   * \param lost the datagrams lost since the last report
+   */
+  void OnReport(uint32_t received, uint32_t lost) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto now = Clock::now();
+    lost_ += lost;
+    if (now - last_decrease_ < std::chrono::milliseconds(2 * interval_)) return;
+    if (lost * 100 > received + lost) {
+      rate_ = std::max(min_rate_, rate_ / 2);
+      last_decrease_ = now;
+      ++num_decreases_;
+    } else {
+      rate_ = std::min(max_rate_, rate_ + max_rate_ / 64);
+    }
+  }
+
+  /** \brief the current rate in bytes per second */
+  double rate() {
+    std::lock_guard<std::mutex> lk(mu_);
+    return rate_;
+  }
+
+  /** \brief the rate and the counters */
+  std::string DebugString() {
+    std::lock_guard<std::mutex> lk(mu_);
+    std::stringstream ss;
+    ss << "rate " << rate_ * 8 / 1e6 << " Mbit/s, sent " << sent_bytes_
+       << " bytes, waited " << waited_ * 1e3 << " ms, " << lost_
+       << " datagrams reported lost, " << num_decreases_ << " decreases";
+    return ss.str();
+  }
+
+ private:
+  using Clock = std::chrono::steady_clock;
+  static double Seconds(Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+  }
+  std::mutex mu_;
+  double max_rate_, min_rate_, burst_;
+  int interval_;
+  /** \brief bytes per second */
+  double rate_;
+  /** \brief bytes that can be sent now, negative if in debt */
+  double tokens_;
+  Clock::time_point last_, last_decrease_;
+  size_t sent_bytes_ = 0;
+  size_t lost_ = 0;
+  size_t num_decreases_ = 0;
+  /** \brief seconds waited */
+  double waited_ = 0;
+};
+}  // namespace ps
+#endif  // PS_PACER_H_
@@ -10,6 +10,7 @@
 
 namespace ps {
 Postoffice::Postoffice() {
+  for (auto& c : customer_table_) c.store(nullptr, std::memory_order_relaxed);
   std::string van_mode = GetEnvStr("PS_VAN", "zmq");
   // van_ = Van::Create("zmq");
   // van_ = Van::Create("zmqudp");
@@ -90,31 +91,48 @@ void Postoffice::Finalize(const bool do_barrier) {
 void Postoffice::AddCustomer(Customer* customer) {
   std::lock_guard<std::mutex> lk(mu_);
   int id = CHECK_NOTNULL(customer)->id();
-  CHECK_EQ(customers_.count(id), (size_t)0) << "id " << id << " already exists";
-  customers_[id] = customer;
+  CHECK(FindCustomer(id) == nullptr) << "id " << id << " already exists";
+  if (id >= 0 && id < kCustomerTableSize) {
+    customer_table_[id].store(customer, std::memory_order_release);
+  } else {
+    customers_[id] = customer;
+  }
+  customer_cond_.notify_all();
 }
 
 
 void Postoffice::RemoveCustomer(Customer* customer) {
   std::lock_guard<std::mutex> lk(mu_);
   int id = CHECK_NOTNULL(customer)->id();
-  customers_.erase(id);
+  if (id >= 0 && id < kCustomerTableSize) {
+    customer_table_[id].store(nullptr, std::memory_order_release);
+  } else {
+    customers_.erase(id);
+  }
+}
+
+
+Customer* Postoffice::FindCustomer(int id) const {
+  if (id >= 0 && id < kCustomerTableSize) {
+    return customer_table_[id].load(std::memory_order_relaxed);
+  }
+  const auto it = customers_.find(id);
+  return it == customers_.end() ? nullptr : it->second;
 }
 
 
 Customer* Postoffice::GetCustomer(int id, int timeout) const {
-  Customer* obj = nullptr;
-  for (int i = 0; i < timeout*1000+1; ++i) {
-    {
-      std::lock_guard<std::mutex> lk(mu_);
-      const auto it = customers_.find(id);
-      if (it != customers_.end()) {
-        obj = it->second;
-        break;
-      }
-    }
-    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  if (id >= 0 && id < kCustomerTableSize) {
+    Customer* obj = customer_table_[id].load(std::memory_order_acquire);
+    if (obj) return obj;
   }
+  // wait for a late registration
+  Customer* obj = nullptr;
+  std::unique_lock<std::mutex> lk(mu_);
+  customer_cond_.wait_for(lk, std::chrono::seconds(timeout), [this, id, &obj] {
+      obj = FindCustomer(id);
+      return obj != nullptr;
+    });
   return obj;
 }
 
@@ -1,351 +1,534 @@
 /**
  *  Copyright (c) 2015 by Contributors
  */
- #ifndef PS_ZMQ_VAN_H_
- #define PS_ZMQ_VAN_H_
- #define ZMQ_BUILD_DRAFT_API 1
- #include <zmq.h>
- #include <stdlib.h>
- #include <thread>
- #include <string>
- #include "ps/internal/van.h"
- #include "./meta_generated.h"
- #if _MSC_VER
- #define rand_r(x) rand()
- #endif
- 
- #define ZMQ_GROUP_NAME "PS"
- 
- namespace ps {
- 
- class RAWUDPVan : public Van {
+#ifndef PS_RAW_VAN_H_
+#define PS_RAW_VAN_H_
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <thread>
+#include <string>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include "ps/internal/van.h"
+#include "ps/internal/threadsafe_queue.h"
+#include "./fragment.h"
+#include "./pacer.h"
+#if _MSC_VER
+#define rand_r(x) rand()
+#endif
+
+namespace ps {
+
+/**
+ * \brief UDP van on plain sockets
+ *
+ * messages are split into datagrams by \ref Fragmenter and \ref KVFragmenter
+ * and reassembled by \ref Reassembler, the same as \ref ZMQUDPVan, but without
+ * the framing and the group of zmq. all datagrams of a message are sent by a
+ * single sendmmsg, and up to PS_UDP_BATCH datagrams are received by a single
+ * recvmmsg. the received datagrams are referenced in place by the messages.
+ *
+ * if PS_UDP_REUSEPORT is larger than 1, that many sockets are bound to the
+ * port with SO_REUSEPORT, each read by its own thread. the kernel dispatches
+ * the datagrams by the address of the sender, so all fragments of a message
+ * arrive at the same socket.
+ *
+ * the datagrams to each node are paced the same as \ref ZMQUDPVan.
+ */
+class RAWUDPVan : public Van {
  public:
-   RAWUDPVan() { }
+  RAWUDPVan() { }
   virtual ~RAWUDPVan() { }
- 
+
  protected:
   void Start() override {
-    // start zmq
-    context_ = zmq_ctx_new();
-    CHECK(context_ != NULL) << "create 0mq context failed";
-    zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
-    // TODO: join?
-    // zmq_ctx_set(context_, ZMQ_IO_THREADS, 4);
+    mtu_ = GetEnv("PS_UDP_MTU", kDefaultMTU);
+    CHECK(mtu_ <= kMaxMTU) << "PS_UDP_MTU is larger than the max UDP datagram";
+    stride_ = (mtu_ + 7) & ~7;
+    reassembly_timeout_ = GetEnv("PS_UDP_REASSEMBLY_TIMEOUT", 200);
+    batch_ = std::max(1, GetEnv("PS_UDP_BATCH", 32));
+    buffer_size_ = GetEnv("PS_UDP_BUFFER_SIZE", 4 << 20);
+    num_shards_ = std::max(1, GetEnv("PS_UDP_REUSEPORT", 1));
+    // Mbit/s to bytes per second
+    max_rate_ = GetEnv("PS_UDP_MAX_RATE", 10000) * 125000.0;
+    min_rate_ = GetEnv("PS_UDP_MIN_RATE", 10) * 125000.0;
+    report_interval_ = GetEnv("PS_UDP_REPORT_INTERVAL", 50);
     Van::Start();
   }
- 
+
   void Stop() override {
     PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
     Van::Stop();
-    // close sockets
-    int linger = 0;
-    int rc = zmq_setsockopt(receiver_, ZMQ_LINGER, &linger, sizeof(linger));
-    CHECK(rc == 0 || errno == ETERM);
-    CHECK_EQ(zmq_close(receiver_), 0);
+    stop_ = true;
+    for (auto& t : shard_threads_) t->join();
+    size_t num_expired = 0, num_lost_keys = 0;
+    for (auto& s : shards_) {
+      num_expired += s->reassembler->num_expired();
+      num_lost_keys += s->reassembler->num_lost_keys();
+      close(s->fd);
+    }
+    PS_VLOG(1) << my_node_.ShortDebugString() << " received " << num_datagrams_
+               << " datagrams in " << num_recv_calls_ << " calls, timed out "
+               << num_expired << " incomplete messages, lost "
+               << num_lost_keys << " keys";
+    std::lock_guard<std::mutex> lk(mu_);
     for (auto& it : senders_) {
-      int rc = zmq_setsockopt(it.second, ZMQ_LINGER, &linger, sizeof(linger));
-      CHECK(rc == 0 || errno == ETERM);
-      CHECK_EQ(zmq_close(it.second), 0);
+      std::lock_guard<std::mutex> lane_lk(it.second->mu);
+      if (it.second->pacer) {
+        PS_VLOG(1) << my_node_.ShortDebugString() << " to node " << it.first
+                   << ": " << it.second->pacer->DebugString();
+      }
+      if (it.second->fd != -1) close(it.second->fd);
+      it.second->fd = -1;
     }
-    zmq_ctx_destroy(context_);
   }
- 
+
   int Bind(const Node& node, int max_retry) override {
-     // for UDP, only dish is supported
-     receiver_ = zmq_socket(context_, ZMQ_DISH);
-     CHECK(receiver_ != NULL)
-         << "create dish socket failed: " << zmq_strerror(errno);
-     std::string addr = "udp://*:";
-     int port = node.port;
-     unsigned seed = static_cast<unsigned>(time(NULL)+port);
-     for (int i = 0; i < max_retry+1; ++i) {
-       auto address = addr + std::to_string(port);
-       // for UDP, must join a group
-       if (zmq_bind(receiver_, address.c_str()) == 0 && zmq_join(receiver_, ZMQ_GROUP_NAME) == 0) break;
-       if (i == max_retry) {
-         port = -1;
-       } else {
-         port = 10000 + rand_r(&seed) % 40000;
-       }
-     }
-     return port;
+    int port = node.port;
+    unsigned seed = static_cast<unsigned>(time(NULL)+port);
+    for (int i = 0; i < max_retry+1; ++i) {
+      if (BindShards(port)) break;
+      if (i == max_retry) {
+        port = -1;
+      } else {
+        port = 10000 + rand_r(&seed) % 40000;
+      }
+    }
+    if (port != -1 && num_shards_ > 1) {
+      for (auto& s : shards_) {
+        shard_threads_.emplace_back(new std::thread(&RAWUDPVan::Sharding, this, s.get()));
+      }
+    }
+    return port;
   }
- 
+
   void Connect(const Node& node) override {
     CHECK_NE(node.id, node.kEmpty);
     CHECK_NE(node.port, node.kEmpty);
     CHECK(node.hostname.size());
     int id = node.id;
-    auto it = senders_.find(id);
-    if (it != senders_.end()) {
-      zmq_close(it->second);
-    }
-    // worker doesn't need to connect to the other workers. same for server
-    if ((node.role == my_node_.role) &&
-        (node.id != my_node_.id)) {
-      return;
+    {
+      // close the old lane, waiting for any in-flight send on it
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = senders_.find(id);
+      if (it != senders_.end()) {
+        std::lock_guard<std::mutex> lane_lk(it->second->mu);
+        close(it->second->fd);
+        it->second->fd = -1;
+        senders_.erase(it);
+      }
     }
-    // for UDP, only radio is supported
-    void *sender = zmq_socket(context_, ZMQ_RADIO);
-    CHECK(sender != NULL)
-        << zmq_strerror(errno)
+    addrinfo hints, *addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    int rc = getaddrinfo(node.hostname.c_str(), std::to_string(node.port).c_str(),
+                         &hints, &addr);
+    CHECK_EQ(rc, 0) << "failed to resolve " << node.hostname << ": " << gai_strerror(rc);
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    CHECK_NE(fd, -1)
+        << strerror(errno)
         << ". it often can be solved by \"sudo ulimit -n 65536\""
         << " or edit /etc/security/limits.conf";
-   //  if (my_node_.id != Node::kEmpty) {
-   //    std::string my_id = "ps" + std::to_string(my_node_.id);
-   //    zmq_setsockopt(sender, ZMQ_IDENTITY, my_id.data(), my_id.size());
-   //  }
-    // connect
-    std::string addr = "udp://" + node.hostname + ":" + std::to_string(node.port);
-    // TODO: need checking
-    if (GetEnv("DMLC_LOCAL", 0)) {
-      addr = "ipc:///tmp/" + std::to_string(node.port);
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size_, sizeof(buffer_size_));
+    // a connected socket saves the address lookup of every datagram
+    if (connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+      LOG(FATAL) << "connect to " << node.hostname << ":" << node.port
+                 << " failed: " << strerror(errno);
     }
-    if (zmq_connect(sender, addr.c_str()) != 0) {
-      LOG(FATAL) <<  "connect to " + addr + " failed: " + zmq_strerror(errno);
+    freeaddrinfo(addr);
+    std::shared_ptr<SendLane> lane(new SendLane());
+    lane->fd = fd;
+    lane->buf.resize(static_cast<size_t>(batch_) * stride_);
+    lane->iov.resize(batch_);
+    lane->hdrs.resize(batch_);
+    if (max_rate_ > 0) {
+      lane->pacer = std::unique_ptr<Pacer>(
+          new Pacer(max_rate_, min_rate_, 16.0 * mtu_, report_interval_));
     }
-    senders_[id] = sender;
+    std::lock_guard<std::mutex> lk(mu_);
+    senders_[id] = lane;
   }
- 
+
   int SendMsg(const Message& msg) override {
-    std::lock_guard<std::mutex> lk(mu_);
-    // find the socket
     int id = msg.meta.recver;
     CHECK_NE(id, Meta::kEmpty);
-    auto it = senders_.find(id);
-    if (it == senders_.end()) {
+    auto lane = GetLane(id);
+    if (!lane) {
       LOG(WARNING) << "there is no socket to node " << id;
       return -1;
     }
-    void *socket = it->second;
- 
-   //  // debug
-   //  int buf_size_fb; uint8_t* data_buf_fb;
-   //  PackMetaDataFB(msg, my_node_.id, &data_buf_fb, &buf_size_fb);
-   //  Message msg_tmp;
-   //  UnpackMetaDataFB(data_buf_fb, buf_size_fb, &msg_tmp);
- 
-    // send meta
-    int buf_size; uint8_t* data_buf;
- 
-   //  PackMetaData(msg, my_node_.id, &data_buf, &buf_size);
-   flatbuffers::FlatBufferBuilder* flatbuf_builder = new flatbuffers::FlatBufferBuilder();
-   PackMetaDataFB(flatbuf_builder, msg, my_node_.id, &data_buf, &buf_size);
-   // LG << "pack size: " << buf_size;
- 
-   // debug
-   // int buf_size_fb; uint8_t* data_buf_fb;
-   // PackTestMsg(8, "abc", &data_buf_fb, &buf_size_fb);
-   // flatbuffers::FlatBufferBuilder* flatbuf_builder = new flatbuffers::FlatBufferBuilder();
-   // PackTestMsg(flatbuf_builder, 8, "abc", &data_buf, &buf_size);
-   // LG << "buf_size: " << buf_size;
- 
-    int tag = 0;
-    zmq_msg_t metadata_msg;
-   //  zmq_msg_init_data(&metadata_msg, data_buf, buf_size, FreeData, NULL);
-    zmq_msg_init_data(&metadata_msg, data_buf, buf_size, FreeDataFB, static_cast<void*>(flatbuf_builder));
-    while (true) {
-      if (zmq_msg_set_group(&metadata_msg, ZMQ_GROUP_NAME) != 0) {
-       LOG(WARNING) << "failed to send message to node [" << id
-       << "] errno: " << errno << " " << zmq_strerror(errno);
-       return -1;
-      }
-      if (zmq_msg_send(&metadata_msg, socket, tag) == buf_size) break;
-      if (errno == EINTR) continue;
-      LOG(WARNING) << "failed to send message to node [" << id
-                   << "] errno: " << errno << " " << zmq_strerror(errno);
+    std::lock_guard<std::mutex> lk(lane->mu);
+    if (lane->fd == -1) {
+      LOG(WARNING) << "the socket to node " << id << " has been closed";
       return -1;
     }
-    zmq_msg_close(&metadata_msg);
- 
-    return buf_size;
+
+    // split the message into datagrams, each byte is copied once
+    std::string head;
+    size_t size = PackMetaDataHead(msg, my_node_.id, &head);
+    if (size + sizeof(FragmentHeader) > static_cast<size_t>(mtu_) &&
+        KVFragmenter::IsKV(msg)) {
+      // runs of key-value pairs, so a lost datagram only loses its own keys
+      KVFragmenter frags(my_node_.id, lane->msg_id++, msg, head.size(), mtu_);
+      for (size_t i = 0; i < frags.num_frags(); ++i) {
+        Message run = frags.msg(i);
+        size_t run_size = PackMetaDataHead(run, my_node_.id, &head);
+        frags.Write(i, run, head,
+                    NextDatagram(lane.get(), sizeof(KVFragmentHeader) + run_size));
+        if (lane->num == batch_ && !Flush(id, lane.get())) return -1;
+      }
+    } else {
+      Fragmenter frags(my_node_.id, lane->msg_id++, head, msg.data, size, mtu_);
+      for (size_t i = 0; i < frags.num_frags(); ++i) {
+        frags.Write(i, NextDatagram(lane.get(), frags.size(i)));
+        if (lane->num == batch_ && !Flush(id, lane.get())) return -1;
+      }
+    }
+    if (!Flush(id, lane.get())) return -1;
+    return size;
   }
- 
+
   int RecvMsg(Message* msg) override {
-    msg->data.clear();
+    if (shard_threads_.empty()) return RecvShardMsg(shards_[0].get(), msg);
+    Received recv;
+    recv_queue_.WaitAndPop(&recv);
+    *msg = std::move(recv.msg);
+    return recv.bytes;
+  }
+
+ private:
+  /**
+   * \brief the send path to one node. the datagrams of a message are written
+   * into buf and then sent by a single sendmmsg
+   */
+  struct SendLane {
+    int fd = -1;
+    std::mutex mu;
+    /** \brief batch_ slots of stride_ bytes */
+    std::vector<char> buf;
+    std::vector<iovec> iov;
+    std::vector<mmsghdr> hdrs;
+    /** \brief the number of datagrams written into buf */
+    int num = 0;
+    /** \brief the id of the next message sent to this node */
+    uint32_t msg_id = 0;
+    /** \brief nullptr if PS_UDP_MAX_RATE is 0 */
+    std::unique_ptr<Pacer> pacer;
+  };
+
+  /** \brief a socket bound to my port */
+  struct Shard {
+    int fd = -1;
+    /** \brief batch_ slots of stride_ bytes, referenced by received messages */
+    SArray<char> buf;
+    std::vector<iovec> iov;
+    std::vector<mmsghdr> hdrs;
+    std::unique_ptr<Reassembler> reassembler;
+    /** \brief the messages completed by the last recvmmsg */
+    std::deque<Message> ready;
+    /** \brief the bytes received since the last returned message */
     size_t recv_bytes = 0;
-    zmq_msg_t* zmsg = new zmq_msg_t;
-    CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
-    while (true) {
-      if (zmq_msg_recv(zmsg, receiver_, 0) != -1 && strcmp(zmq_msg_group(zmsg), ZMQ_GROUP_NAME) == 0) break;
+    std::chrono::steady_clock::time_point last_expire, last_report;
+  };
+
+  /** \brief a message received by a shard thread */
+  struct Received {
+    Message msg;
+    int bytes = 0;
+  };
+
+  std::shared_ptr<SendLane> GetLane(int id) {
+    std::lock_guard<std::mutex> lk(mu_);
+    auto it = senders_.find(id);
+    return it == senders_.end() ? nullptr : it->second;
+  }
+
+  /** \brief the next free slot of the lane. lane lock held */
+  char* NextDatagram(SendLane* lane, size_t size) {
+    CHECK_LE(size, static_cast<size_t>(stride_));
+    char* buf = lane->buf.data() + static_cast<size_t>(lane->num) * stride_;
+    lane->iov[lane->num].iov_base = buf;
+    lane->iov[lane->num].iov_len = size;
+    ++lane->num;
+    return buf;
+  }
+
+  /**
+   * \brief send the datagrams written into the lane. lane lock held
+   * \return false if failed
+   */
+  bool Flush(int id, SendLane* lane) {
+    if (lane->pacer) {
+      size_t bytes = 0;
+      for (int i = 0; i < lane->num; ++i) bytes += lane->iov[i].iov_len;
+      lane->pacer->Wait(bytes);
+    }
+    int sent = 0;
+    while (sent < lane->num) {
+      for (int i = sent; i < lane->num; ++i) {
+        memset(&lane->hdrs[i], 0, sizeof(mmsghdr));
+        lane->hdrs[i].msg_hdr.msg_iov = &lane->iov[i];
+        lane->hdrs[i].msg_hdr.msg_iovlen = 1;
+      }
+      int n = sendmmsg(lane->fd, &lane->hdrs[sent], lane->num - sent, 0);
+      if (n > 0) {
+        sent += n;
+        continue;
+      }
       if (errno == EINTR) continue;
-      LOG(WARNING) << "failed to receive message. errno: "
-                   << errno << " " << zmq_strerror(errno);
-      return -1;
+      if (errno == ECONNREFUSED) {
+        // an earlier datagram found the port closed, skip this one as lost
+        ++sent;
+        continue;
+      }
+      LOG(WARNING) << "failed to send message to node [" << id
+                   << "] errno: " << errno << " " << strerror(errno);
+      lane->num = 0;
+      return false;
     }
-    uint8_t* buf = CHECK_NOTNULL((uint8_t *)zmq_msg_data(zmsg));
-    recv_bytes = zmq_msg_size(zmsg);
-   //  LG << "unpack size: " << recv_bytes;
- 
-   //  UnpackMetaData(buf, recv_bytes, msg);
-   UnpackMetaDataFB(buf, recv_bytes, msg);
- 
-   // // debug
-   // UnpackTestMsg(buf, recv_bytes);
- 
-    zmq_msg_close(zmsg);
-    delete zmsg;
-    msg->meta.recver = my_node_.id;
-    return recv_bytes;
+    lane->num = 0;
+    return true;
   }
- 
- private:
- 
-  void *context_ = nullptr;
+
   /**
-   * \brief node_id to the socket for sending data to this node
+   * \brief bind num_shards_ sockets to port
+   * \return false if the port is taken
    */
-  std::unordered_map<int, void*> senders_;
-  std::mutex mu_;
-  // as dish
-  void *receiver_ = nullptr;
- 
- //  // debug
- //  Message msg_tmp;
- 
-  void PackTestMsg(flatbuffers::FlatBufferBuilder* flatbuf_builder, int num, const std::string& str, uint8_t** data_buf, int* buf_size) {
-   
-   // preparation
-   auto str_str = flatbuf_builder->CreateString(str);
- 
-   // serialize
-   TestMsgBuilder test_msg_builder(*flatbuf_builder);
-   test_msg_builder.add_num(num);
-   test_msg_builder.add_str(str_str);
- 
-   auto test_msg = test_msg_builder.Finish();
-   // to string
-   flatbuf_builder->Finish(test_msg);
-   *data_buf = flatbuf_builder->GetBufferPointer();
-   *buf_size = flatbuf_builder->GetSize();
+  bool BindShards(int port) {
+    for (auto& s : shards_) close(s->fd);
+    shards_.clear();
+    int timeout = std::max(1, reassembly_timeout_ / 2);
+    timeval tv;
+    tv.tv_sec = timeout / 1000;
+    tv.tv_usec = (timeout % 1000) * 1000;
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    // with PS_RESEND=1, the resender recovers all lost messages
+    bool partial = GetEnv("PS_RESEND", 0) != 1;
+    using namespace std::placeholders;
+    for (int i = 0; i < num_shards_; ++i) {
+      std::unique_ptr<Shard> s(new Shard());
+      s->fd = socket(AF_INET, SOCK_DGRAM, 0);
+      CHECK_NE(s->fd, -1) << "create socket failed: " << strerror(errno);
+      int one = 1;
+      if (num_shards_ > 1) {
+        CHECK_EQ(setsockopt(s->fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)), 0)
+            << "SO_REUSEPORT is not supported: " << strerror(errno);
+      }
+      setsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &buffer_size_, sizeof(buffer_size_));
+      // wake up periodically to time out incomplete messages
+      setsockopt(s->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      int fd = s->fd;
+      shards_.push_back(std::move(s));
+      if (bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) return false;
+    }
+    for (auto& s : shards_) {
+      int size = 0;
+      socklen_t len = sizeof(size);
+      getsockopt(s->fd, SOL_SOCKET, SO_RCVBUF, &size, &len);
+      // linux reports the doubled value of what is granted
+      if (size / 2 < buffer_size_) {
+        PS_VLOG(1) << "the receive buffer is only " << size / 2 << " bytes, raise"
+                   << " net.core.rmem_max for PS_UDP_BUFFER_SIZE=" << buffer_size_;
+      }
+      s->iov.resize(batch_);
+      s->hdrs.resize(batch_);
+      ResetBuffer(s.get());
+      s->reassembler = std::unique_ptr<Reassembler>(new Reassembler(
+          reassembly_timeout_, partial,
+          std::bind(&RAWUDPVan::UnpackMetaData, this, _1, _2),
+          std::bind(&RAWUDPVan::UnpackPartialMetaData, this, _1, _2, _3)));
+    }
+    return true;
   }
- 
-  void UnpackTestMsg(const uint8_t* data_buf, int buf_size) {
-   auto test_msg = GetTestMsg(data_buf);
- 
-   // deserialize
-   LG << "num: " << test_msg->num() << " str: " << test_msg->str()->str();
+
+  /** \brief give the shard a new receive buffer */
+  void ResetBuffer(Shard* s) {
+    s->buf = SArray<char>();
+    s->buf.resize(static_cast<size_t>(batch_) * stride_);
+    for (int i = 0; i < batch_; ++i) {
+      s->iov[i].iov_base = s->buf.data() + static_cast<size_t>(i) * stride_;
+      s->iov[i].iov_len = stride_;
+    }
   }
- 
-  void PackMetaDataFB(flatbuffers::FlatBufferBuilder* flatbuf_builder, const Message& msg, int sender_id, uint8_t** data_buf, int* buf_size) {
-   // convert into flatbuf
- 
-   // meta
-   // not nested
-   // preparation
-   // node
-   std::vector<flatbuffers::Offset<FBNode>> fbnode_vector;
-   if (!msg.meta.control.empty()) {
-     for (const auto& n : msg.meta.control.node) {
-       auto hostname_str = flatbuf_builder->CreateString(n.hostname);
-       auto fbnode = CreateFBNode(*flatbuf_builder, n.role, n.id, hostname_str, n.port, n.is_recovery);
-       fbnode_vector.push_back(fbnode);
-     }
-   }
-   auto fbnodes = flatbuf_builder->CreateVector(fbnode_vector);
-   // body
-   // LG << "body size: " << msg.meta.body.size();
-   std::string body_string_copy = msg.meta.body;
-   auto body_str = flatbuf_builder->CreateString(body_string_copy);
-   // data type
-   // LG << "pack data_type length: " << msg.meta.data_type.size();
-   std::vector<int> data_type_vector;
-   for (auto d : msg.meta.data_type) {
-     data_type_vector.push_back(d);
-   }
-   auto data_types = flatbuf_builder->CreateVector(data_type_vector);
-   // data
-   std::vector<flatbuffers::Offset<flatbuffers::String>> data_vector;
-   for (auto d : msg.data) {
-     SArray<char>* data = new SArray<char>(d);
-     int data_size = data->size();
-     auto data_str = flatbuf_builder->CreateString(data->data(), data_size);
-     data_vector.push_back(data_str);
-   }
-   auto data_strs = flatbuf_builder->CreateVector(data_vector);
- 
-   FBMetaDataBuilder fbmetadata_builder(*flatbuf_builder);
-   fbmetadata_builder.add_head(msg.meta.head);
-   if (msg.meta.body.size()) {
-     fbmetadata_builder.add_body(body_str);
-   }
-   // control
-   if (!msg.meta.control.empty()) {
-     fbmetadata_builder.add_cmd(msg.meta.control.cmd);
-     fbmetadata_builder.add_node(fbnodes);
-     if (msg.meta.control.cmd == Control::BARRIER) {
-       fbmetadata_builder.add_barrier_group(msg.meta.control.barrier_group);
-     } else if (msg.meta.control.cmd == Control::ACK) {
-       fbmetadata_builder.add_msg_sig(msg.meta.control.msg_sig);
-     }
-   }
-   fbmetadata_builder.add_request(msg.meta.request);
-   fbmetadata_builder.add_sender_id(sender_id);
-   fbmetadata_builder.add_customer_id(msg.meta.customer_id);
-   fbmetadata_builder.add_timestamp(msg.meta.timestamp);
-   if (msg.meta.data_type.size() > 0) fbmetadata_builder.add_data_type(data_types);
-   fbmetadata_builder.add_push(msg.meta.push);
-   fbmetadata_builder.add_simple_app(msg.meta.simple_app);
-   fbmetadata_builder.add_data(data_strs);
- 
-   auto fbmetadata = fbmetadata_builder.Finish();
- 
-   // to string
-   flatbuf_builder->Finish(fbmetadata);
-   *data_buf = flatbuf_builder->GetBufferPointer();
-   *buf_size = flatbuf_builder->GetSize();
- }
- 
- void UnpackMetaDataFB(const uint8_t* data_buf, int buf_size, Message* msg) {
-   // to flatbuf
-   auto fbmetadata = GetFBMetaData(data_buf);
- 
-   // to meta
-   msg->meta.head = fbmetadata->head();
-   if (fbmetadata->body() != NULL) msg->meta.body = fbmetadata->body()->c_str();
-   if (fbmetadata->node() != NULL) {
-     msg->meta.control.cmd = static_cast<Control::Command>(fbmetadata->cmd());
-     msg->meta.control.barrier_group = fbmetadata->barrier_group();
-     msg->meta.control.msg_sig = fbmetadata->msg_sig();
-     for (int i = 0; i < fbmetadata->node()->Length(); ++i) {
-       auto p = fbmetadata->node()->Get(i);
-       Node n;
-       n.role = static_cast<Node::Role>(p->role());
-       n.port = p->port();
-       n.hostname = p->hostname()->c_str();
-       n.id = p->id();
-       n.is_recovery = p->is_recovery();
-       msg->meta.control.node.push_back(n);
-     }
-   } else {
-     msg->meta.control.cmd = Control::EMPTY;
-   }
-   msg->meta.request = fbmetadata->request();
-   msg->meta.sender = fbmetadata->sender_id();
-   msg->meta.customer_id = fbmetadata->customer_id();
-   msg->meta.timestamp = fbmetadata->timestamp();  
-   if (fbmetadata->data_type() != NULL) {
-     msg->meta.data_type.resize(fbmetadata->data_type()->Length());
-     for (int i = 0; i < fbmetadata->data_type()->Length(); ++i) {
-       msg->meta.data_type[i] = static_cast<DataType>(fbmetadata->data_type()->Get(i));
-     }
-   }
-   msg->meta.push = fbmetadata->push();
-   msg->meta.simple_app = fbmetadata->simple_app();
- 
-   // data
-   for (int i = 0; i < fbmetadata->data()->Length(); ++i) {
-     // TODO: zero-copy
-     SArray<char> data;
-     data.CopyFrom(fbmetadata->data()->Get(i)->c_str(), fbmetadata->data()->Get(i)->str().size());
-     msg->data.push_back(data);
-   }
- }
- 
- }; //RAWUDPVan
- 
- 
- 
- }  // namespace ps
- 
- #endif  // PS_RAW_VAN_H_
\ No newline at end of file
+
+  /**
+   * \brief receive a message from a shard
+   * \return the number of bytes received, -1 if failed or stopped
+   */
+  int RecvShardMsg(Shard* s, Message* msg) {
+    while (true) {
+      if (!s->ready.empty()) {
+        *msg = std::move(s->ready.front());
+        s->ready.pop_front();
+        int bytes = s->recv_bytes;
+        s->recv_bytes = 0;
+        return bytes;
+      }
+      if (stop_) return -1;
+      for (int i = 0; i < batch_; ++i) {
+        memset(&s->hdrs[i], 0, sizeof(mmsghdr));
+        s->hdrs[i].msg_hdr.msg_iov = &s->iov[i];
+        s->hdrs[i].msg_hdr.msg_iovlen = 1;
+      }
+      int n = recvmmsg(s->fd, s->hdrs.data(), batch_, MSG_WAITFORONE, nullptr);
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          Report(s);
+          if (PopExpired(s, msg)) return 0;
+          continue;
+        }
+        LOG(WARNING) << "failed to receive message. errno: "
+                     << errno << " " << strerror(errno);
+        return -1;
+      }
+      ++num_recv_calls_;
+      num_datagrams_ += n;
+      for (int i = 0; i < n; ++i) {
+        size_t size = s->hdrs[i].msg_len;
+        if (s->hdrs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+          LOG(WARNING) << "drop a datagram larger than PS_UDP_MTU=" << mtu_;
+          continue;
+        }
+        s->recv_bytes += size;
+        // zero-copy, the slot is released when the last data referencing it is
+        size_t begin = static_cast<size_t>(i) * stride_;
+        const char* buf = s->buf.data() + begin;
+        if (size >= 2 && buf[0] == 0 && buf[1] == 'R') {
+          OnReport(buf, size);
+          continue;
+        }
+        Message m;
+        if (!s->reassembler->Add(s->buf.segment(begin, begin + size), &m)) continue;
+        do {
+          m.meta.recver = my_node_.id;
+          s->ready.push_back(std::move(m));
+        } while (s->reassembler->PopReady(&m));
+      }
+      // some slots are still referenced by messages or fragments
+      if (s->buf.ptr().use_count() > 1) ResetBuffer(s);
+      Report(s);
+      if (s->ready.empty() && PopExpired(s, msg)) return 0;
+    }
+  }
+
+  /**
+   * \brief report the datagrams received and lost by the shard from each
+   * sender to it, every report_interval_
+   */
+  void Report(Shard* s) {
+    if (max_rate_ <= 0) return;
+    auto now = std::chrono::steady_clock::now();
+    if (now - s->last_report < std::chrono::milliseconds(report_interval_)) return;
+    s->last_report = now;
+    std::unordered_map<int, Reassembler::Loss> loss;
+    s->reassembler->PopLoss(&loss);
+    for (const auto& it : loss) {
+      auto lane = GetLane(it.first);
+      if (!lane) continue;
+      LossReport report;
+      report.tag[0] = 0;
+      report.tag[1] = 'R';
+      report.reserved = 0;
+      report.sender = my_node_.id;
+      report.received = it.second.received;
+      report.lost = it.second.lost;
+      std::lock_guard<std::mutex> lk(lane->mu);
+      // reports are never paced, and lost reports are not resent
+      if (lane->fd != -1) send(lane->fd, &report, sizeof(report), 0);
+    }
+  }
+
+  /** \brief adjust the rate to the reporter */
+  void OnReport(const char* buf, size_t size) {
+    LossReport report;
+    CHECK_GE(size, sizeof(report)) << "corrupted datagram";
+    memcpy(&report, buf, sizeof(report));
+    auto lane = GetLane(report.sender);
+    if (lane && lane->pacer) lane->pacer->OnReport(report.received, report.lost);
+  }
+
+  /** \brief thread function receiving a shard if there are multiple */
+  void Sharding(Shard* s) {
+    while (true) {
+      Received recv;
+      recv.bytes = RecvShardMsg(s, &recv.msg);
+      if (recv.bytes == -1) break;
+      recv_queue_.Push(std::move(recv));
+    }
+  }
+
+  /**
+   * \brief time out incomplete messages. returns true if what is received of
+   * one of them is delivered to the application
+   */
+  bool PopExpired(Shard* s, Message* msg) {
+    auto now = std::chrono::steady_clock::now();
+    if (now - s->last_expire < std::chrono::milliseconds(reassembly_timeout_ / 2)) {
+      return false;
+    }
+    s->last_expire = now;
+    while (s->reassembler->PopExpired(msg)) {
+      // the resender recovers the whole message
+      if (msg->meta.reliability == Meta::RELIABLE ||
+          msg->meta.reliability == Meta::NACK) {
+        continue;
+      }
+      PS_VLOG(1) << "lost a part of the message from node " << msg->meta.sender
+                 << ", received: " << msg->DebugString();
+      msg->meta.recver = my_node_.id;
+      return true;
+    }
+    return false;
+  }
+
+  /** \brief the default max datagram size */
+  static const int kDefaultMTU = 8000;
+  /** \brief the max payload of an IPv4 UDP datagram */
+  static const int kMaxMTU = 65507;
+
+  /** \brief node_id to the lane for sending data to this node */
+  std::unordered_map<int, std::shared_ptr<SendLane>> senders_;
+  /** \brief protects senders_ */
+  std::mutex mu_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+  std::vector<std::unique_ptr<std::thread>> shard_threads_;
+  /** \brief messages received by the shard threads */
+  ThreadsafeQueue<Received> recv_queue_;
+  std::atomic<bool> stop_{false};
+  /** \brief the max size of a datagram */
+  int mtu_ = kDefaultMTU;
+  /** \brief the size of a datagram slot, mtu_ rounded up to 8 bytes */
+  int stride_ = kDefaultMTU;
+  /** \brief the max number of datagrams per sendmmsg and recvmmsg */
+  int batch_ = 32;
+  /** \brief SO_SNDBUF and SO_RCVBUF in bytes */
+  int buffer_size_ = 4 << 20;
+  /** \brief the number of sockets bound to my port */
+  int num_shards_ = 1;
+  /** \brief the pacing rates in bytes per second, 0 disables pacing */
+  double max_rate_ = 0, min_rate_ = 0;
+  /** \brief the interval in millisecond between two loss reports */
+  int report_interval_ = 50;
+  /** \brief timeout in millisecond of an incomplete message */
+  int reassembly_timeout_ = 200;
+  std::atomic<size_t> num_recv_calls_{0};
+  std::atomic<size_t> num_datagrams_{0};
+};
+}  // namespace ps
+#endif  // PS_RAW_VAN_H_
@@ -5,22 +5,42 @@
 #define PS_RESENDER_H_
 #include <chrono>
 #include <vector>
+#include <map>
 #include <unordered_set>
 #include <unordered_map>
 namespace ps {
 
 /**
  * \brief resend a messsage if no ack is received within a given time
+ *
+ * by default every message is RELIABLE. if selective, each message is
+ * recovered according to its \ref Meta::Reliability:
+ *
+ * - RELIABLE: the receiver sends back an ACK for each message, the sender
+ *   resends the message if the ACK is not received within the timeout
+ * - NACK: the messages to a receiver are numbered. the receiver sends a NACK
+ *   with the missing range when it detects a gap, and the sender resends them
+ *   from a retention buffer. every timeout, the receiver acknowledges the
+ *   sequence number below which all messages are received, if it has received
+ *   any since the last time, which releases the retention buffer. when the
+ *   sender has been idle for a timeout with messages retained, it probes the
+ *   receiver with its next sequence number, so that a lost tail is detected.
+ *   the receiver answers a probe with the same acknowledgement
+ * - BEST_EFFORT: never resent
+ *
+ * control messages are always RELIABLE
  */
 class Resender {
  public:
   /**
    * \param timeout timeout in millisecond
+   * \param selective whether to honor \ref Meta::reliability
    */
-  Resender(int timeout, int max_num_retry, Van* van) {
+  Resender(int timeout, int max_num_retry, Van* van, bool selective = false) {
     timeout_ = timeout;
     max_num_retry_ = max_num_retry;
     van_ = van;
+    selective_ = selective;
     monitor_ = new std::thread(&Resender::Monitoring, this);
   }
   ~Resender() {
@@ -29,12 +49,36 @@ class Resender {
     delete monitor_;
   }
 
+  /**
+   * \brief resolve the reliability class of an outgoing message before it is
+   * sent, and number and retain it if it is NACK
+   */
+  void Prepare(Message* msg) {
+    auto& meta = msg->meta;
+    // resent by the monitor thread or for a NACK
+    if (meta.seq != Meta::kEmpty) return;
+    if (meta.control.cmd == Control::ACK || meta.control.cmd == Control::NACK) {
+      meta.reliability = Meta::BEST_EFFORT;
+    } else if (!selective_ || !meta.control.empty() ||
+               meta.reliability == Meta::DEFAULT) {
+      meta.reliability = Meta::RELIABLE;
+    }
+    if (meta.reliability != Meta::NACK) return;
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& out = outgoing_[meta.recver];
+    meta.seq = out.next++;
+    auto& ent = out.retained[meta.seq];
+    ent.msg = *msg;
+    ent.send = Now();
+    out.last_send = ent.send;
+  }
+
   /**
    * \brief add an outgoining message
    *
    */
   void AddOutgoing(const Message& msg) {
-    if (msg.meta.control.cmd == Control::ACK) return;
+    if (msg.meta.reliability != Meta::RELIABLE) return;
     CHECK_NE(msg.meta.timestamp, Meta::kEmpty) << msg.DebugString();
     auto key = GetKey(msg);
     std::lock_guard<std::mutex> lk(mu_);
@@ -49,7 +93,7 @@ class Resender {
 
   /**
    * \brief add an incomming message
-   * \brief return true if msg has been added before or a ACK message
+   * \brief return true if msg has been added before or a ACK/NACK message
    */
   bool AddIncomming(const Message& msg) {
     // a message can be received by multiple times
@@ -62,6 +106,15 @@ class Resender {
       if (it != send_buff_.end()) send_buff_.erase(it);
       mu_.unlock();
       return true;
+    } else if (msg.meta.control.cmd == Control::NACK) {
+      ProcessNack(msg);
+      return true;
+    } else if (msg.meta.reliability == Meta::NACK) {
+      bool duplicated = !AcceptSeq(msg.meta.sender, msg.meta.seq);
+      if (duplicated) PS_VLOG(1) << "Duplicated message: " << msg.DebugString();
+      return duplicated;
+    } else if (msg.meta.reliability == Meta::BEST_EFFORT) {
+      return false;
     } else {
       mu_.lock();
       auto key = GetKey(msg);
@@ -92,6 +145,28 @@ class Resender {
   };
   std::unordered_map<uint64_t, Entry> send_buff_;
 
+  /** \brief the NACK messages sent to a node */
+  struct Outgoing {
+    /** \brief the next sequence number */
+    int next = 0;
+    /** \brief the time of the last message or probe sent */
+    Time last_send;
+    /** \brief sequence number to the retained message */
+    std::map<int, Entry> retained;
+  };
+  std::unordered_map<int, Outgoing> outgoing_;
+
+  /** \brief the NACK messages received from a node */
+  struct Incoming {
+    /** \brief the next expected sequence number */
+    int next = 0;
+    /** \brief sequence number to the time it is found missing */
+    std::map<int, Entry> missing;
+    /** \brief whether a message is received since the last acknowledgement */
+    bool unacked = false;
+  };
+  std::unordered_map<int, Incoming> incoming_;
+
   uint64_t GetKey(const Message& msg) {
     CHECK_NE(msg.meta.timestamp, Meta::kEmpty) << msg.DebugString();
     uint16_t id = msg.meta.customer_id;
@@ -108,10 +183,92 @@ class Resender {
         std::chrono::high_resolution_clock::now().time_since_epoch());
   }
 
+  /**
+   * \brief send a NACK for the sequence numbers [begin, end)
+   * \param request false for the answer of a probe
+   */
+  void SendNack(int recver, int begin, int end, bool request = true) {
+    Message nack;
+    nack.meta.recver = recver;
+    nack.meta.sender = van_->my_node().id;
+    nack.meta.request = request;
+    nack.meta.control.cmd = Control::NACK;
+    nack.meta.control.msg_sig = (static_cast<uint64_t>(begin) << 32) |
+                                static_cast<uint32_t>(end);
+    van_->Send(nack);
+  }
+
+  /**
+   * \brief return false if the message with seq from sender is duplicated
+   */
+  bool AcceptSeq(int sender, int seq) {
+    std::unique_lock<std::mutex> lk(mu_);
+    auto& in = incoming_[sender];
+    if (seq < in.next) {
+      if (!in.missing.erase(seq)) return false;
+      in.unacked = true;
+      return true;
+    }
+    in.unacked = true;
+    int begin = in.next;
+    for (int i = begin; i < seq; ++i) in.missing[i].send = Now();
+    in.next = seq + 1;
+    lk.unlock();
+    if (begin < seq) SendNack(sender, begin, seq);
+    return true;
+  }
+
+  /** \brief the sequence number below which all messages are received */
+  static int Received(const Incoming& in) {
+    return in.missing.empty() ? in.next : in.missing.begin()->first;
+  }
+
+  void ProcessNack(const Message& msg) {
+    int peer = msg.meta.sender;
+    int begin = msg.meta.control.msg_sig >> 32;
+    int end = msg.meta.control.msg_sig & 0xffffffff;
+    std::unique_lock<std::mutex> lk(mu_);
+    if (!msg.meta.request) {
+      // all messages before begin are received
+      auto& out = outgoing_[peer];
+      out.retained.erase(out.retained.begin(), out.retained.lower_bound(begin));
+    } else if (begin < end) {
+      // resend the missing messages
+      auto& out = outgoing_[peer];
+      std::vector<Message> resend;
+      for (int i = begin; i < end; ++i) {
+        auto it = out.retained.find(i);
+        if (it == out.retained.end()) {
+          LOG(WARNING) << van_->my_node().ShortDebugString() << ": message "
+                       << i << " to node " << peer << " is no longer retained";
+          continue;
+        }
+        resend.push_back(it->second.msg);
+      }
+      out.last_send = Now();
+      lk.unlock();
+      for (const auto& m : resend) van_->Send(m);
+    } else {
+      // a probe, the sender has sent all messages before begin
+      auto& in = incoming_[peer];
+      int gap = in.next;
+      for (int i = in.next; i < begin; ++i) in.missing[i].send = Now();
+      in.next = std::max(in.next, begin);
+      int received = Received(in);
+      in.unacked = false;
+      lk.unlock();
+      if (gap < begin) SendNack(peer, gap, begin);
+      SendNack(peer, received, received, false);
+    }
+  }
+
   void Monitoring() {
     while (!exit_) {
       std::this_thread::sleep_for(Time(timeout_));
       std::vector<Message> resend;
+      std::vector<std::pair<int, int>> probe;
+      std::vector<std::pair<int, std::pair<int, int>>> nack;
+      std::vector<std::pair<int, int>> ack;
       Time now = Now();
       mu_.lock();
       for (auto& it : send_buff_) {
@@ -124,9 +281,53 @@ class Resender {
           CHECK_LT(it.second.num_retry, max_num_retry_);
         }
       }
+      for (auto& it : outgoing_) {
+        auto& out = it.second;
+        // release the messages nobody asks for anymore
+        while (out.retained.size() &&
+               out.retained.begin()->second.send + Time(timeout_) * max_num_retry_ < now) {
+          out.retained.erase(out.retained.begin());
+        }
+        if (out.retained.size() && out.last_send + Time(timeout_) < now) {
+          probe.push_back({it.first, out.next});
+          out.last_send = now;
+        }
+      }
+      for (auto& it : incoming_) {
+        auto& missing = it.second.missing;
+        // a cumulative acknowledgement, so a busy sender, which never probes,
+        // releases its retention buffer as well
+        if (it.second.unacked) {
+          ack.push_back({it.first, Received(it.second)});
+          it.second.unacked = false;
+        }
+        for (auto m = missing.begin(); m != missing.end();) {
+          if (m->second.send + Time(timeout_) * (1+m->second.num_retry) >= now) {
+            ++m;
+            continue;
+          }
+          if (++m->second.num_retry >= max_num_retry_) {
+            LOG(WARNING) << van_->my_node().ShortDebugString() << ": give up message "
+                         << m->first << " from node " << it.first;
+            m = missing.erase(m);
+            continue;
+          }
+          // merge consecutive sequence numbers into a range
+          if (nack.size() && nack.back().first == it.first &&
+              nack.back().second.second == m->first) {
+            ++nack.back().second.second;
+          } else {
+            nack.push_back({it.first, {m->first, m->first + 1}});
+          }
+          ++m;
+        }
+      }
       mu_.unlock();
 
       for (const auto& msg : resend) van_->Send(msg);
+      for (const auto& p : probe) SendNack(p.first, p.second, p.second);
+      for (const auto& n : nack) SendNack(n.first, n.second.first, n.second.second);
+      for (const auto& a : ack) SendNack(a.first, a.second, a.second, false);
     }
   }
   std::thread* monitor_;
@@ -135,6 +336,7 @@ class Resender {
   std::mutex mu_;
   int timeout_;
   int max_num_retry_;
+  bool selective_;
   Van* van_;
 };
 }  // namespace ps
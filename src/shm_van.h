@@ -0,0 +1,560 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_SHM_VAN_H_
+#define PS_SHM_VAN_H_
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <thread>
+#include <string>
+#include <memory>
+#include <atomic>
+#include <algorithm>
+#include <unordered_map>
+#include "ps/internal/van.h"
+#if _MSC_VER
+#define rand_r(x) rand()
+#endif
+
+namespace ps {
+
+/**
+ * \brief shared memory van for nodes on the same host
+ *
+ * when binding its port, a node creates an inbox, a lock-free queue of
+ * descriptors in the shared memory segment /ps-<port>. a node sending to
+ * another creates a ring /ps-<recver port>-<sender port>, copies each message
+ * into it in the format of \ref Van::PackMetaData, and pushes a descriptor of
+ * the message into the inbox of the receiver. the receiver maps the ring and
+ * references the data in place, and a message is released from the ring when
+ * the last data referencing it is. so a byte is copied only once.
+ *
+ * a message larger than half of the ring is sent in a segment of its own, so
+ * is a message for which the ring has no room, such as when the receiver holds
+ * the data of an earlier message.
+ *
+ * all nodes must run on the same host.
+ */
+class SHMVan : public Van {
+ public:
+  SHMVan() { }
+  virtual ~SHMVan() { }
+  friend class HybridVan;
+
+ protected:
+  void Start() override {
+    StartTransport();
+    Van::Start();
+  }
+
+  void Stop() override {
+    PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
+    Van::Stop();
+    StopTransport();
+    if (port_fd_ != -1) close(port_fd_);
+  }
+
+  /** \brief read the options, no segment is created */
+  void StartTransport() {
+    ring_size_ = GetEnv("PS_SHM_SIZE", 64 << 20);
+    ring_size_ = (ring_size_ + kAlign - 1) & ~(kAlign - 1);
+    timeout_ = GetEnv("PS_SHM_TIMEOUT", 10000);
+  }
+
+  /** \brief remove the segments created by this node */
+  void StopTransport() {
+    if (inbox_) shm_unlink(inbox_->name.c_str());
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& it : senders_) {
+      std::lock_guard<std::mutex> lane_lk(it.second->mu);
+      if (it.second->ring) shm_unlink(it.second->ring->name.c_str());
+    }
+    senders_.clear();
+  }
+
+  int Bind(const Node& node, int max_retry) override {
+    int port = node.port;
+    unsigned seed = static_cast<unsigned>(time(NULL)+port);
+    for (int i = 0; i < max_retry+1; ++i) {
+      // nothing else reserves the port, so hold it by a socket. then a
+      // segment left by a crashed node is safe to replace
+      port_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+      CHECK_NE(port_fd_, -1) << "create socket failed: " << strerror(errno);
+      sockaddr_in addr;
+      memset(&addr, 0, sizeof(addr));
+      addr.sin_family = AF_INET;
+      addr.sin_addr.s_addr = htonl(INADDR_ANY);
+      addr.sin_port = htons(port);
+      if (bind(port_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 &&
+          BindInbox(port)) {
+        break;
+      }
+      close(port_fd_);
+      port_fd_ = -1;
+      if (i == max_retry) {
+        port = -1;
+      } else {
+        port = 10000 + rand_r(&seed) % 40000;
+      }
+    }
+    return port;
+  }
+
+  void Connect(const Node& node) override {
+    CHECK_NE(node.id, node.kEmpty);
+    CHECK_NE(node.port, node.kEmpty);
+    CHECK(node.hostname.size());
+    std::lock_guard<std::mutex> lk(mu_);
+    auto& lane = senders_[node.id];
+    // keep the ring, the receiver may still reference it
+    if (lane && lane->port == node.port) return;
+    lane = std::make_shared<SendLane>();
+    lane->port = node.port;
+  }
+
+  int SendMsg(const Message& msg) override {
+    int id = msg.meta.recver;
+    CHECK_NE(id, Meta::kEmpty);
+    std::shared_ptr<SendLane> lane;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = senders_.find(id);
+      if (it == senders_.end()) {
+        LOG(WARNING) << "there is no socket to node " << id;
+        return -1;
+      }
+      lane = it->second;
+    }
+    std::lock_guard<std::mutex> lk(lane->mu);
+    if (!lane->inbox && !Open(lane.get())) {
+      LOG(WARNING) << "the inbox of node " << id << " is not created in "
+                   << timeout_ << " ms";
+      return -1;
+    }
+
+    std::string head;
+    size_t size = PackMetaDataHead(msg, my_node_.id, &head);
+    Descriptor desc;
+    desc.port = my_node_.port;
+    desc.size = size;
+    desc.generation = lane->generation;
+    size_t need = Align(sizeof(Record) + size);
+    char* buf = nullptr;
+    std::shared_ptr<Segment> seg;
+    desc.segment = 0;
+    if (need <= ring_size_ / 2) buf = Reserve(lane.get(), need, &desc.offset);
+    if (!buf) {
+      desc.segment = ++lane->num_segments;
+      desc.offset = 0;
+      std::string name = SegmentName(lane->port, my_node_.port, desc.segment);
+      shm_unlink(name.c_str());
+      seg = Map(name, size, true);
+      CHECK(seg) << "failed to create " << name << ": " << strerror(errno);
+      buf = seg->addr;
+    }
+    memcpy(buf, head.data(), head.size());
+    buf += head.size();
+    for (const auto& d : msg.data) {
+      memcpy(buf, d.data(), d.size());
+      memset(buf + d.size(), 0, Align8(d.size()) - d.size());
+      buf += Align8(d.size());
+    }
+    if (!Push(lane->inbox.get(), desc)) {
+      if (seg) shm_unlink(seg->name.c_str());
+      LOG(WARNING) << "the inbox of node " << id << " is full for " << timeout_
+                   << " ms";
+      return -1;
+    }
+    return size;
+  }
+
+  int RecvMsg(Message* msg) override {
+    Descriptor desc;
+    Pop(&desc);
+    SArray<char> buf;
+    if (desc.segment) {
+      std::string name = SegmentName(my_node_.port, desc.port, desc.segment);
+      auto seg = Map(name, desc.size, false);
+      CHECK(seg) << "failed to open " << name << ": " << strerror(errno);
+      shm_unlink(name.c_str());
+      // unmapped when the last data referencing it is released
+      buf.reset(seg->addr, desc.size, [seg](char*) { });
+    } else {
+      auto in = GetInbound(desc.port, desc.generation);
+      uint64_t pos = desc.offset;
+      uint64_t end = pos + Align(sizeof(Record) + desc.size);
+      {
+        std::lock_guard<std::mutex> lk(in->mu);
+        in->recv_end = std::max(in->recv_end, end);
+      }
+      char* data = in->ring->addr + kHeaderSize + pos % in->capacity + sizeof(Record);
+      buf.reset(data, desc.size, [in, pos](char*) { in->Release(pos); });
+    }
+    UnpackMetaData(buf, msg);
+    msg->meta.recver = my_node_.id;
+    return desc.size;
+  }
+
+  /**
+   * \brief create the inbox of the port
+   * \return false if failed
+   */
+  bool BindInbox(int port) {
+    std::string name = "/ps-" + std::to_string(port);
+    shm_unlink(name.c_str());
+    inbox_ = Map(name, kHeaderSize + kInboxSlots * sizeof(Cell), true);
+    if (!inbox_) return false;
+    auto hdr = InboxOf(inbox_.get());
+    Cell* cells = CellsOf(inbox_.get());
+    for (size_t i = 0; i < kInboxSlots; ++i) cells[i].seq.store(i);
+    hdr->enqueue_pos.store(0);
+    hdr->dequeue_pos.store(0);
+    hdr->signal.store(0);
+    hdr->sleeping.store(0);
+    return true;
+  }
+
+  /** \brief whether the node of port has created its inbox */
+  bool HasInbox(int port) {
+    std::string name = "/ps-" + std::to_string(port);
+    int fd = shm_open(name.c_str(), O_RDWR, 0600);
+    if (fd == -1) return false;
+    close(fd);
+    return true;
+  }
+
+ private:
+  static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+                "the atomics in shared memory must be lock-free");
+  /** \brief the size of the header of a segment */
+  static const size_t kHeaderSize = 256;
+  /** \brief the alignment of the records in a ring */
+  static const size_t kAlign = 16;
+  /** \brief the number of descriptors an inbox holds */
+  static const size_t kInboxSlots = 8192;
+
+  /** \brief a message in a ring or in a segment of its own */
+  struct Descriptor {
+    /** \brief the sender's port, which names the ring */
+    int32_t port;
+    /** \brief 0 for the ring, otherwise the sequence number of the segment */
+    uint32_t segment;
+    /** \brief the generation of the ring */
+    uint64_t generation;
+    /** \brief the position in the ring */
+    uint64_t offset;
+    /** \brief the size of the packed message */
+    uint64_t size;
+  };
+  /** \brief a slot of the inbox, a bounded queue by Dmitry Vyukov */
+  struct Cell {
+    std::atomic<uint64_t> seq;
+    Descriptor desc;
+  };
+  struct InboxHeader {
+    std::atomic<uint64_t> enqueue_pos;
+    char pad0[56];
+    std::atomic<uint64_t> dequeue_pos;
+    char pad1[56];
+    /** \brief bumped by every push, the receiver sleeps on it by futex */
+    std::atomic<uint32_t> signal;
+    std::atomic<uint32_t> sleeping;
+  };
+  struct RingHeader {
+    uint64_t generation;
+    uint64_t capacity;
+    char pad[48];
+    /** \brief the position below which the receiver released everything */
+    std::atomic<uint64_t> tail;
+  };
+  /** \brief the header of a record in a ring */
+  struct Record {
+    uint64_t size;
+    uint32_t state;
+    uint32_t reserved;
+  };
+  enum RecordState { kUsed = 0, kPadding = 1, kReleased = 2 };
+
+  /** \brief a mapped shared memory segment */
+  struct Segment {
+    std::string name;
+    char* addr = nullptr;
+    size_t size = 0;
+    ~Segment() { if (addr) munmap(addr, size); }
+  };
+
+  /** \brief the send path to one node */
+  struct SendLane {
+    int port = 0;
+    std::mutex mu;
+    /** \brief the inbox of the node, opened by the first send */
+    std::shared_ptr<Segment> inbox;
+    std::shared_ptr<Segment> ring;
+    uint64_t generation = 0;
+    /** \brief the position of the next record */
+    uint64_t head = 0;
+    uint32_t num_segments = 0;
+    /** \brief whether the ring had no room for the last message */
+    bool ring_full = false;
+  };
+
+  /** \brief a ring to this node */
+  struct Inbound {
+    std::shared_ptr<Segment> ring;
+    uint64_t generation = 0;
+    uint64_t capacity = 0;
+    std::mutex mu;
+    /** \brief the end of the last record received */
+    uint64_t recv_end = 0;
+
+    /** \brief release the record at pos, and move the tail over the
+     * released records */
+    void Release(uint64_t pos) {
+      std::lock_guard<std::mutex> lk(mu);
+      char* data = ring->addr + kHeaderSize;
+      reinterpret_cast<Record*>(data + pos % capacity)->state = kReleased;
+      auto hdr = reinterpret_cast<RingHeader*>(ring->addr);
+      uint64_t tail = hdr->tail.load(std::memory_order_relaxed);
+      while (tail < recv_end) {
+        auto rec = reinterpret_cast<Record*>(data + tail % capacity);
+        if (rec->state == kUsed) break;
+        tail += rec->size;
+      }
+      hdr->tail.store(tail, std::memory_order_release);
+    }
+  };
+
+  static size_t Align(size_t n) { return (n + kAlign - 1) & ~(kAlign - 1); }
+  static size_t Align8(size_t n) { return (n + 7) & ~static_cast<size_t>(7); }
+
+  static std::string SegmentName(int recver_port, int sender_port, uint32_t segment) {
+    std::string name = "/ps-" + std::to_string(recver_port) + "-" +
+                       std::to_string(sender_port);
+    if (segment) name += "-" + std::to_string(segment);
+    return name;
+  }
+
+  /**
+   * \brief map a segment
+   * \param create whether to create it, which fails if it exists
+   * \return nullptr if failed
+   */
+  static std::shared_ptr<Segment> Map(const std::string& name, size_t size, bool create) {
+    int fd = shm_open(name.c_str(), create ? O_CREAT | O_EXCL | O_RDWR : O_RDWR, 0600);
+    if (fd == -1) return nullptr;
+    if (create && ftruncate(fd, size) != 0) {
+      close(fd);
+      shm_unlink(name.c_str());
+      return nullptr;
+    }
+    void* addr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return nullptr;
+    std::shared_ptr<Segment> seg(new Segment());
+    seg->name = name;
+    seg->addr = static_cast<char*>(addr);
+    seg->size = size;
+    return seg;
+  }
+
+  static InboxHeader* InboxOf(Segment* seg) {
+    return reinterpret_cast<InboxHeader*>(seg->addr);
+  }
+  static Cell* CellsOf(Segment* seg) {
+    return reinterpret_cast<Cell*>(seg->addr + kHeaderSize);
+  }
+
+  /**
+   * \brief open the inbox of the node and create the ring to it. lane lock held
+   * \return false if the inbox is not created in PS_SHM_TIMEOUT, such as by a
+   * node that died
+   */
+  bool Open(SendLane* lane) {
+    std::string name = "/ps-" + std::to_string(lane->port);
+    size_t size = kHeaderSize + kInboxSlots * sizeof(Cell);
+    // the node may not have bound its port yet
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_);
+    while (!(lane->inbox = Map(name, size, false))) {
+      if (std::chrono::steady_clock::now() > deadline) return false;
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    name = SegmentName(lane->port, my_node_.port, 0);
+    shm_unlink(name.c_str());
+    lane->ring = Map(name, kHeaderSize + ring_size_, true);
+    CHECK(lane->ring) << "failed to create " << name << ": " << strerror(errno)
+                      << ". a smaller PS_SHM_SIZE may help";
+    auto hdr = reinterpret_cast<RingHeader*>(lane->ring->addr);
+    unsigned seed = static_cast<unsigned>(time(NULL) + lane->port);
+    lane->generation = (static_cast<uint64_t>(rand_r(&seed)) << 32) | getpid();
+    hdr->generation = lane->generation;
+    hdr->capacity = ring_size_;
+    hdr->tail.store(0);
+    lane->head = 0;
+    return true;
+  }
+
+  /**
+   * \brief reserve need bytes in the ring, waiting a while for the receiver to
+   * release enough. lane lock held
+   * \param pos the position of the record
+   * \return the buffer following the record header, nullptr if there is no
+   * room
+   */
+  char* Reserve(SendLane* lane, size_t need, uint64_t* pos) {
+    auto hdr = reinterpret_cast<RingHeader*>(lane->ring->addr);
+    char* data = lane->ring->addr + kHeaderSize;
+    uint64_t head = lane->head;
+    size_t off = head % ring_size_;
+    // a record never wraps around
+    size_t pad = off + need > ring_size_ ? ring_size_ - off : 0;
+    // a record is released only with the last data referencing it, which the
+    // receiver may hold for long. so do not wait again if the ring was full
+    // for the last message
+    int spins = lane->ring_full ? 0 : kNumSpins;
+    for (int i = 0;
+         head + pad + need - hdr->tail.load(std::memory_order_acquire) > ring_size_;
+         ++i) {
+      if (i == spins) {
+        lane->ring_full = true;
+        return nullptr;
+      }
+      std::this_thread::yield();
+    }
+    lane->ring_full = false;
+    if (pad) {
+      auto rec = reinterpret_cast<Record*>(data + off);
+      rec->size = pad;
+      rec->state = kPadding;
+      head += pad;
+    }
+    auto rec = reinterpret_cast<Record*>(data + head % ring_size_);
+    rec->size = need;
+    rec->state = kUsed;
+    *pos = head;
+    lane->head = head + need;
+    return reinterpret_cast<char*>(rec + 1);
+  }
+
+  /** \brief the ring from the sender of port, mapped at the first message */
+  std::shared_ptr<Inbound> GetInbound(int port, uint64_t generation) {
+    auto& in = inbound_[port];
+    // a new ring after the sender restarted. the old one is unmapped when the
+    // last data referencing it is released
+    if (in && in->generation == generation) return in;
+    in = std::make_shared<Inbound>();
+    std::string name = SegmentName(my_node_.port, port, 0);
+    in->ring = Map(name, kHeaderSize + ring_size_, false);
+    CHECK(in->ring) << "failed to open " << name << ": " << strerror(errno);
+    auto hdr = reinterpret_cast<RingHeader*>(in->ring->addr);
+    CHECK_EQ(hdr->generation, generation) << name << " is replaced";
+    CHECK_EQ(hdr->capacity, ring_size_) << "PS_SHM_SIZE differs from node at port " << port;
+    in->generation = generation;
+    in->capacity = hdr->capacity;
+    return in;
+  }
+
+  /**
+   * \brief push a descriptor into an inbox, waiting if it is full
+   * \return false if it is still full after PS_SHM_TIMEOUT, such as when the
+   * receiver died
+   */
+  bool Push(Segment* inbox, const Descriptor& desc) {
+    auto hdr = InboxOf(inbox);
+    Cell* cells = CellsOf(inbox);
+    uint64_t pos = hdr->enqueue_pos.load(std::memory_order_relaxed);
+    Cell* cell;
+    std::chrono::steady_clock::time_point deadline;
+    while (true) {
+      cell = &cells[pos & (kInboxSlots - 1)];
+      uint64_t seq = cell->seq.load(std::memory_order_acquire);
+      int64_t diff = static_cast<int64_t>(seq) - static_cast<int64_t>(pos);
+      if (diff == 0) {
+        if (hdr->enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                                   std::memory_order_relaxed)) {
+          break;
+        }
+      } else {
+        // full if diff < 0, otherwise another sender took the slot
+        if (diff < 0) {
+          auto now = std::chrono::steady_clock::now();
+          if (deadline == std::chrono::steady_clock::time_point()) {
+            deadline = now + std::chrono::milliseconds(timeout_);
+          }
+          if (now > deadline) return false;
+          std::this_thread::yield();
+        }
+        pos = hdr->enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->desc = desc;
+    cell->seq.store(pos + 1, std::memory_order_release);
+    hdr->signal.fetch_add(1);
+    if (hdr->sleeping.load()) {
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&hdr->signal), FUTEX_WAKE,
+              1, nullptr, nullptr, 0);
+    }
+    return true;
+  }
+
+  /** \brief try to pop a descriptor from my inbox */
+  bool TryPop(Descriptor* desc) {
+    auto hdr = InboxOf(inbox_.get());
+    uint64_t pos = hdr->dequeue_pos.load(std::memory_order_relaxed);
+    Cell* cell = &CellsOf(inbox_.get())[pos & (kInboxSlots - 1)];
+    if (cell->seq.load(std::memory_order_acquire) != pos + 1) return false;
+    *desc = cell->desc;
+    cell->seq.store(pos + kInboxSlots, std::memory_order_release);
+    hdr->dequeue_pos.store(pos + 1, std::memory_order_relaxed);
+    return true;
+  }
+
+  /** \brief pop a descriptor from my inbox, spin a while and then sleep */
+  void Pop(Descriptor* desc) {
+    auto hdr = InboxOf(inbox_.get());
+    for (int i = 0; ; ++i) {
+      if (TryPop(desc)) return;
+      if (i < kNumSpins) {
+        std::this_thread::yield();
+        continue;
+      }
+      uint32_t signal = hdr->signal.load();
+      hdr->sleeping.store(1);
+      if (TryPop(desc)) {
+        hdr->sleeping.store(0);
+        return;
+      }
+      // a push after reading signal changes it, so the wait returns at once
+      timespec timeout = {0, 100 * 1000 * 1000};
+      syscall(SYS_futex, reinterpret_cast<uint32_t*>(&hdr->signal), FUTEX_WAIT,
+              signal, &timeout, nullptr, 0);
+      hdr->sleeping.store(0);
+    }
+  }
+
+  static const int kNumSpins = 1000;
+
+  /** \brief the bytes of a ring */
+  size_t ring_size_ = 64 << 20;
+  /** \brief the max time in millisecond to wait for the inbox of a node */
+  int timeout_ = 10000;
+  /** \brief the socket holding my port */
+  int port_fd_ = -1;
+  std::shared_ptr<Segment> inbox_;
+  /** \brief node_id to the lane for sending data to this node */
+  std::unordered_map<int, std::shared_ptr<SendLane>> senders_;
+  /** \brief protects senders_ */
+  std::mutex mu_;
+  /** \brief sender's port to the ring from it, used by the receiving thread */
+  std::unordered_map<int, std::shared_ptr<Inbound>> inbound_;
+};
+}  // namespace ps
+#endif  // PS_SHM_VAN_H_
@@ -0,0 +1,393 @@
+/**
+ *  Copyright (c) 2015 by Contributors
+ */
+#ifndef PS_TCP_VAN_H_
+#define PS_TCP_VAN_H_
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <stdlib.h>
+#include <thread>
+#include <string>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <chrono>
+#include <unordered_map>
+#include "ps/internal/van.h"
+#if _MSC_VER
+#define rand_r(x) rand()
+#endif
+
+namespace ps {
+
+/**
+ * \brief TCP van on plain non-blocking sockets and epoll
+ *
+ * a message is packed as by \ref PackMetaDataHead and prefixed by its size.
+ * the sender writes the head and the data of a message by a single writev
+ * straight from the memory of the message, so neither the data are copied nor
+ * an extra thread is involved. the receiver reads each message into a single
+ * pooled buffer, which the received data reference in place.
+ */
+class TCPVan : public Van {
+ public:
+  TCPVan() { }
+  virtual ~TCPVan() { }
+
+ protected:
+  void Start() override {
+    buffer_size_ = GetEnv("PS_TCP_BUFFER_SIZE", 4 << 20);
+    Van::Start();
+  }
+
+  void Stop() override {
+    PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
+    Van::Stop();
+    for (auto& it : conns_) close(it.first);
+    conns_.clear();
+    if (listen_fd_ != -1) close(listen_fd_);
+    if (epoll_fd_ != -1) close(epoll_fd_);
+    listen_fd_ = epoll_fd_ = -1;
+    PS_VLOG(1) << my_node_.ShortDebugString() << " received " << num_msgs_
+               << " messages in " << num_reads_ << " reads";
+    std::lock_guard<std::mutex> lk(mu_);
+    for (auto& it : senders_) {
+      std::lock_guard<std::mutex> lane_lk(it.second->mu);
+      if (it.second->fd != -1) close(it.second->fd);
+      it.second->fd = -1;
+    }
+  }
+
+  int Bind(const Node& node, int max_retry) override {
+    epoll_fd_ = epoll_create1(0);
+    CHECK_NE(epoll_fd_, -1) << "create epoll failed: " << strerror(errno);
+    int port = node.port;
+    unsigned seed = static_cast<unsigned>(time(NULL)+port);
+    for (int i = 0; i < max_retry+1; ++i) {
+      if (Listen(port)) break;
+      if (i == max_retry) {
+        port = -1;
+      } else {
+        port = 10000 + rand_r(&seed) % 40000;
+      }
+    }
+    if (port == -1) return -1;
+    epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_fd_;
+    CHECK_EQ(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev), 0) << strerror(errno);
+    return port;
+  }
+
+  void Connect(const Node& node) override {
+    CHECK_NE(node.id, node.kEmpty);
+    CHECK_NE(node.port, node.kEmpty);
+    CHECK(node.hostname.size());
+    int id = node.id;
+    {
+      // close the old lane, waiting for any in-flight send on it
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = senders_.find(id);
+      if (it != senders_.end()) {
+        std::lock_guard<std::mutex> lane_lk(it->second->mu);
+        close(it->second->fd);
+        it->second->fd = -1;
+        senders_.erase(it);
+      }
+    }
+    addrinfo hints, *addr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int rc = getaddrinfo(node.hostname.c_str(), std::to_string(node.port).c_str(),
+                         &hints, &addr);
+    CHECK_EQ(rc, 0) << "failed to resolve " << node.hostname << ": " << gai_strerror(rc);
+    int fd = -1;
+    // the scheduler may not be listening yet
+    for (int i = 0; ; ++i) {
+      fd = socket(AF_INET, SOCK_STREAM, 0);
+      CHECK_NE(fd, -1)
+          << strerror(errno)
+          << ". it often can be solved by \"sudo ulimit -n 65536\""
+          << " or edit /etc/security/limits.conf";
+      if (connect(fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+      int err = errno;
+      close(fd);
+      if (i == kMaxConnectRetry) {
+        LOG(FATAL) << "connect to " << node.hostname << ":" << node.port
+                   << " failed: " << strerror(err);
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+    freeaddrinfo(addr);
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer_size_, sizeof(buffer_size_));
+    std::shared_ptr<SendLane> lane(new SendLane());
+    lane->fd = fd;
+    std::lock_guard<std::mutex> lk(mu_);
+    senders_[id] = lane;
+  }
+
+  int SendMsg(const Message& msg) override {
+    int id = msg.meta.recver;
+    CHECK_NE(id, Meta::kEmpty);
+    std::shared_ptr<SendLane> lane;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = senders_.find(id);
+      if (it == senders_.end()) {
+        LOG(WARNING) << "there is no socket to node " << id;
+        return -1;
+      }
+      lane = it->second;
+    }
+    std::string head;
+    uint64_t size = PackMetaDataHead(msg, my_node_.id, &head);
+    // the size prefix, the head, and each data followed by its padding
+    static char padding[8] = {0};
+    std::vector<iovec> iov;
+    iov.reserve(2 + 2 * msg.data.size());
+    iov.push_back({&size, sizeof(size)});
+    iov.push_back({&head[0], head.size()});
+    for (const auto& d : msg.data) {
+      if (d.size()) iov.push_back({const_cast<char*>(d.data()), d.size()});
+      size_t pad = Align8(d.size()) - d.size();
+      if (pad) iov.push_back({padding, pad});
+    }
+    std::lock_guard<std::mutex> lk(lane->mu);
+    if (lane->fd == -1) {
+      LOG(WARNING) << "the socket to node " << id << " has been closed";
+      return -1;
+    }
+    if (!WriteAll(lane->fd, iov.data(), iov.size())) {
+      LOG(WARNING) << "failed to send message to node [" << id
+                   << "] errno: " << errno << " " << strerror(errno);
+      return -1;
+    }
+    return size;
+  }
+
+  int RecvMsg(Message* msg) override {
+    while (ready_.empty()) {
+      epoll_event events[kMaxEvents];
+      int n = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        LOG(WARNING) << "failed to receive message. errno: "
+                     << errno << " " << strerror(errno);
+        return -1;
+      }
+      for (int i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        if (fd == listen_fd_) {
+          Accept();
+        } else if (!ReadConn(fd)) {
+          epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+          close(fd);
+          conns_.erase(fd);
+        }
+      }
+    }
+    *msg = std::move(ready_.front().msg);
+    int bytes = ready_.front().bytes;
+    ready_.pop_front();
+    msg->meta.recver = my_node_.id;
+    return bytes;
+  }
+
+ private:
+  /** \brief the send path to one node */
+  struct SendLane {
+    int fd = -1;
+    std::mutex mu;
+  };
+
+  /** \brief an accepted connection, read by the receiving thread only */
+  struct Conn {
+    /** \brief the size prefix of the message being read */
+    uint64_t size = 0;
+    /** \brief the bytes of the prefix or of buf read so far */
+    size_t got = 0;
+    /** \brief the message being read, empty while reading the prefix */
+    SArray<char> buf;
+  };
+
+  /** \brief a message read but not yet returned */
+  struct Received {
+    Message msg;
+    int bytes = 0;
+  };
+
+  static size_t Align8(size_t size) { return (size + 7) & ~static_cast<size_t>(7); }
+
+  /**
+   * \brief bind and listen on port
+   * \return false if the port is taken
+   */
+  bool Listen(int port) {
+    if (listen_fd_ != -1) close(listen_fd_);
+    listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+    CHECK_NE(listen_fd_, -1) << "create socket failed: " << strerror(errno);
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+      return false;
+    }
+    CHECK_EQ(listen(listen_fd_, SOMAXCONN), 0) << strerror(errno);
+    SetNonBlocking(listen_fd_);
+    return true;
+  }
+
+  void SetNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    CHECK_EQ(fcntl(fd, F_SETFL, flags | O_NONBLOCK), 0) << strerror(errno);
+  }
+
+  /** \brief accept all pending connections */
+  void Accept() {
+    while (true) {
+      int fd = accept(listen_fd_, nullptr, nullptr);
+      if (fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          LOG(WARNING) << "accept failed: " << strerror(errno);
+        }
+        if (errno == EINTR) continue;
+        return;
+      }
+      SetNonBlocking(fd);
+      setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size_, sizeof(buffer_size_));
+      epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      CHECK_EQ(epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev), 0) << strerror(errno);
+      conns_[fd] = Conn();
+    }
+  }
+
+  /**
+   * \brief read what is available on the connection, appending the completed
+   * messages to ready_
+   * \return false if the connection is closed
+   */
+  bool ReadConn(int fd) {
+    Conn& c = conns_[fd];
+    while (true) {
+      bool prefix = c.buf.empty();
+      char* dst = prefix ? reinterpret_cast<char*>(&c.size) + c.got : c.buf.data() + c.got;
+      size_t want = (prefix ? sizeof(c.size) : c.size) - c.got;
+      ssize_t n = read(fd, dst, want);
+      if (n == 0) return false;
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        if (errno == EAGAIN || errno == EWOULDBLOCK) return true;
+        LOG(WARNING) << "failed to read from socket: " << strerror(errno);
+        return false;
+      }
+      ++num_reads_;
+      c.got += n;
+      if (c.got < (prefix ? sizeof(c.size) : c.size)) continue;
+      c.got = 0;
+      if (prefix) {
+        c.buf = TakeBuffer(c.size);
+        continue;
+      }
+      Received recv;
+      // zero-copy, the data reference the pooled buffer
+      UnpackMetaData(c.buf, &recv.msg);
+      recv.bytes = c.size;
+      ready_.push_back(std::move(recv));
+      c.buf = SArray<char>();
+      ++num_msgs_;
+    }
+  }
+
+  /**
+   * \brief a buffer of size bytes. the buffers of up to kMaxPooledSize bytes
+   * are reused once no received data reference them
+   */
+  SArray<char> TakeBuffer(size_t size) {
+    if (size > kMaxPooledSize) {
+      SArray<char> buf;
+      buf.resize(size);
+      return buf;
+    }
+    // the buffers in a class are of the same power-of-two capacity
+    int cls = 0;
+    while ((static_cast<size_t>(kMinPooledSize) << cls) < size) ++cls;
+    auto& bufs = pool_[cls];
+    for (auto& b : bufs) {
+      if (b.ptr().use_count() == 1) return b.segment(0, size);
+    }
+    SArray<char> buf;
+    buf.resize(static_cast<size_t>(kMinPooledSize) << cls);
+    if (bufs.size() < kMaxPooledBuffers) bufs.push_back(buf);
+    return buf.segment(0, size);
+  }
+
+  /**
+   * \brief write all bytes of the iovecs to a blocking socket
+   * \return false if failed
+   */
+  static bool WriteAll(int fd, iovec* iov, size_t num) {
+    while (num) {
+      ssize_t n = writev(fd, iov, std::min(num, static_cast<size_t>(IOV_MAX)));
+      if (n == -1) {
+        if (errno == EINTR) continue;
+        return false;
+      }
+      // skip what is written, a partial iovec is advanced in place
+      while (num && static_cast<size_t>(n) >= iov->iov_len) {
+        n -= iov->iov_len;
+        ++iov;
+        --num;
+      }
+      if (num) {
+        iov->iov_base = static_cast<char*>(iov->iov_base) + n;
+        iov->iov_len -= n;
+      }
+    }
+    return true;
+  }
+
+  static const int kMaxEvents = 64;
+  /** \brief 100 ms each */
+  static const int kMaxConnectRetry = 600;
+  static const int kMinPooledSize = 4096;
+  static const size_t kMaxPooledSize = 64 << 20;
+  static const size_t kMaxPooledBuffers = 16;
+
+  /** \brief node_id to the lane for sending data to this node */
+  std::unordered_map<int, std::shared_ptr<SendLane>> senders_;
+  /** \brief protects senders_ */
+  std::mutex mu_;
+  int listen_fd_ = -1;
+  int epoll_fd_ = -1;
+  /** \brief fd to the accepted connection */
+  std::unordered_map<int, Conn> conns_;
+  std::deque<Received> ready_;
+  /** \brief the receive buffers by size class */
+  std::unordered_map<int, std::vector<SArray<char>>> pool_;
+  /** \brief SO_SNDBUF and SO_RCVBUF in bytes */
+  int buffer_size_ = 4 << 20;
+  size_t num_reads_ = 0;
+  size_t num_msgs_ = 0;
+};
+}  // namespace ps
+#endif  // PS_TCP_VAN_H_
@@ -4,6 +4,7 @@
 #include "ps/internal/van.h"
 #include <thread>
 #include <chrono>
+#include <cstring>
 #include "ps/base.h"
 #include "ps/sarray.h"
 #include "ps/internal/postoffice.h"
@@ -11,6 +12,12 @@
 #include "./network_utils.h"
 #include "./meta.pb.h"
 #include "./zmq_van.h"
+#include "./hybrid_van.h"
+#ifdef __linux__
+#include "./raw_van.h"
+#include "./shm_van.h"
+#include "./tcp_van.h"
+#endif
 #include "./resender.h"
 namespace ps {
 
@@ -20,6 +27,12 @@ namespace ps {
 // problem.
 static const int kDefaultHeartbeatInterval = 0;
 
+/** \brief the milliseconds from begin to end */
+static double ElapsedMs(const std::chrono::steady_clock::time_point& begin,
+                        const std::chrono::steady_clock::time_point& end) {
+  return std::chrono::duration<double, std::milli>(end - begin).count();
+}
+
 Van* Van::Create(const std::string& type) {
   if (type == "zmq") {
     return new ZMQVan();
@@ -27,6 +40,16 @@ Van* Van::Create(const std::string& type) {
     // debug
     LG << "Using UDP!";
     return new ZMQUDPVan();
+  } else if (type == "hybrid") {
+    return new HybridVan();
+#ifdef __linux__
+  } else if (type == "rawudp") {
+    return new RAWUDPVan();
+  } else if (type == "shm") {
+    return new SHMVan();
+  } else if (type == "tcp") {
+    return new TCPVan();
+#endif
   } else {
     LOG(FATAL) << "unsupported van type: " << type;
     return nullptr;
@@ -34,6 +57,7 @@ Van* Van::Create(const std::string& type) {
 }
 
 void Van::Start() {
+  auto start_time = std::chrono::steady_clock::now();
   // get scheduler info
   scheduler_.hostname = std::string(CHECK_NOTNULL(Environment::Get()->find("DMLC_PS_ROOT_URI")));
   scheduler_.port     = atoi(CHECK_NOTNULL(Environment::Get()->find("DMLC_PS_ROOT_PORT")));
@@ -74,21 +98,40 @@ void Van::Start() {
     my_node_.id = Node::kEmpty;
   }
 
+  // the peers, indexed by the node ids assigned by the scheduler
+  lazy_connect_ = GetEnv("PS_LAZY_CONNECT", 1);
+  connect_threads_ = std::max(GetEnv("PS_CONNECT_THREADS", 16), 1);
+  bootstrap_fanout_ = GetEnv("PS_BOOTSTRAP_FANOUT", 0);
+  int max_id = std::max(
+      Postoffice::ServerRankToID(Postoffice::Get()->num_servers() - 1),
+      Postoffice::WorkerRankToID(Postoffice::Get()->num_workers() - 1));
+  max_id = std::max(max_id, kScheduler);
+  peers_.clear();
+  for (int i = 0; i <= max_id; ++i) peers_.emplace_back(new Peer());
+  startup_connect_ms_ = 0;
+
   // bind.
   my_node_.port = Bind(my_node_, is_scheduler_ ? 0 : 40);
   PS_VLOG(1) << "Bind to " << my_node_.DebugString();
   CHECK_NE(my_node_.port, -1) << "bind failed";
+  auto bind_time = std::chrono::steady_clock::now();
 
   // connect to the scheduler
   Connect(scheduler_);
+  peers_[kScheduler]->connected = true;
 
   // for debug use
   if (Environment::Get()->find("PS_DROP_MSG")) {
     drop_rate_ = atoi(Environment::Get()->find("PS_DROP_MSG"));
   }
   // start receiver
+  control_thread_ = std::unique_ptr<std::thread>(
+      new std::thread(&Van::Controlling, this));
   receiver_thread_ = std::unique_ptr<std::thread>(
       new std::thread(&Van::Receiving, this));
+  for (int i = 1; i < NumRecvShards(); ++i) {
+    shard_threads_.emplace_back(new std::thread(&Van::ReceivingShard, this, i));
+  }
 
   if (!is_scheduler_) {
     // let the scheduler know myself
@@ -103,6 +146,12 @@ void Van::Start() {
   while (!ready_) {
     std::this_thread::sleep_for(std::chrono::milliseconds(1));
   }
+  auto ready_time = std::chrono::steady_clock::now();
+  PS_VLOG(1) << my_node_.ShortDebugString() << " is ready in "
+             << ElapsedMs(start_time, ready_time) << " ms: "
+             << ElapsedMs(start_time, bind_time) << " ms to bind, "
+             << ElapsedMs(bind_time, ready_time) << " ms to register, of which "
+             << startup_connect_ms_ << " ms to connect";
 
   // resender
   if (Environment::Get()->find("PS_RESEND") && atoi(Environment::Get()->find("PS_RESEND")) != 0) {
@@ -110,7 +159,9 @@ void Van::Start() {
     if (Environment::Get()->find("PS_RESEND_TIMEOUT")) {
       timeout = atoi(Environment::Get()->find("PS_RESEND_TIMEOUT"));
     }
-    resender_ = new Resender(timeout, 10, this);
+    // PS_RESEND=2 honors the reliability class of each message
+    bool selective = atoi(Environment::Get()->find("PS_RESEND")) == 2;
+    resender_ = new Resender(timeout, 10, this, selective);
   }
 
   if (!is_scheduler_) {
@@ -127,11 +178,25 @@ void Van::Stop() {
   exit.meta.recver = my_node_.id;
   SendMsg(exit);
   receiver_thread_->join();
+  control_thread_->join();
+  for (auto& t : shard_threads_) t->join();
+  shard_threads_.clear();
   if (!is_scheduler_) heartbeat_thread_->join();
   if (resender_) delete resender_;
 }
 
 int Van::Send(const Message& msg) {
+  if (resender_) {
+    // the resender resolves the reliability class and the sequence number
+    Message prepared = msg;
+    resender_->Prepare(&prepared);
+    return Send_(prepared);
+  }
+  return Send_(msg);
+}
+
+int Van::Send_(const Message& msg) {
+  ConnectPeer(msg.meta.recver);
   int send_bytes = SendMsg(msg);
   CHECK_NE(send_bytes, -1);
   send_bytes_ += send_bytes;
@@ -142,23 +207,82 @@ int Van::Send(const Message& msg) {
   return send_bytes;
 }
 
+bool Van::AddPeer(const Node& node) {
+  int id = node.id;
+  if (id < 0 || id >= static_cast<int>(peers_.size())) {
+    Connect(node);
+    return false;
+  }
+  Peer* peer = peers_[id].get();
+  std::lock_guard<std::mutex> lk(peer->mu);
+  peer->node = node;
+  peer->known = true;
+  // the node may have moved, such as a recovered one
+  peer->connected = false;
+  // the scheduler is reconnected with my assigned id, and the messages to
+  // myself such as TERMINATE bypass Send
+  if (id == kScheduler || id == my_node_.id) {
+    Connect(node);
+    peer->connected = true;
+    return false;
+  }
+  // worker doesn't need to connect to the other workers unless it sends
+  // something to them. same for server
+  return node.role != my_node_.role;
+}
+
+void Van::Preconnect(const std::vector<int>& ids) {
+  if (ids.empty()) return;
+  std::atomic<size_t> next{0};
+  auto connecting = [this, &ids, &next]() {
+    for (size_t i = next++; i < ids.size(); i = next++) ConnectPeer(ids[i]);
+  };
+  int num_threads = std::min(connect_threads_, static_cast<int>(ids.size()));
+  std::vector<std::thread> threads;
+  for (int i = 1; i < num_threads; ++i) threads.emplace_back(connecting);
+  connecting();
+  for (auto& t : threads) t.join();
+}
+
+void Van::ConnectPeer(int id) {
+  if (id < 0 || id >= static_cast<int>(peers_.size())) return;
+  Peer* peer = peers_[id].get();
+  if (peer->connected.load(std::memory_order_acquire)) return;
+  std::lock_guard<std::mutex> lk(peer->mu);
+  if (!peer->known || peer->connected.load(std::memory_order_relaxed)) return;
+  auto begin = std::chrono::steady_clock::now();
+  Connect(peer->node);
+  peer->connected.store(true, std::memory_order_release);
+  PS_VLOG(1) << my_node_.ShortDebugString() << " is connected to "
+             << peer->node.ShortDebugString() << " in "
+             << ElapsedMs(begin, std::chrono::steady_clock::now()) << " ms";
+}
+
+void Van::ForwardNodes(const Message& msg) {
+  // the scheduler is the last node and the root of the tree, the children of
+  // the node at i are at (i+1)*fanout, ..., (i+2)*fanout-1
+  const auto& nodes = msg.meta.control.node;
+  int num_nodes = static_cast<int>(nodes.size()) - 1;
+  int pos = 0;
+  while (pos < num_nodes && nodes[pos].id != my_node_.id) ++pos;
+  CHECK_LT(pos, num_nodes) << "cannot find myself in the node list";
+  Message fwd;
+  fwd.meta.control = msg.meta.control;
+  int end = std::min((pos + 2) * bootstrap_fanout_, num_nodes);
+  for (int i = (pos + 1) * bootstrap_fanout_; i < end; ++i) {
+    fwd.meta.recver = nodes[i].id;
+    fwd.meta.timestamp = timestamp_++;
+    Send(fwd);
+  }
+}
+
 void Van::Receiving() {
-  const char* heartbeat_timeout_val = Environment::Get()->find("PS_HEARTBEAT_TIMEOUT");
-  const int heartbeat_timeout
-      = heartbeat_timeout_val ? atoi(heartbeat_timeout_val) : kDefaultHeartbeatInterval;
-  Meta nodes;  // for scheduler usage
   while (true) {
     Message msg;
     int recv_bytes = RecvMsg(&msg);
 
     // For debug, drop received message
-    if (ready_ && drop_rate_ > 0) {
-      unsigned seed = time(NULL) + my_node_.id;
-      if (rand_r(&seed) % 100 < drop_rate_) {
-        LOG(WARNING) << "Drop message " << msg.DebugString();
-        continue;
-      }
-    }
+    if (Drop(msg)) continue;
 
     CHECK_NE(recv_bytes, -1);
     recv_bytes_ += recv_bytes;
@@ -168,175 +292,307 @@ void Van::Receiving() {
     // duplicated message
     if (resender_ && resender_->AddIncomming(msg)) continue;
 
-    if (!msg.meta.control.empty()) {
-      // do some management
-      auto& ctrl = msg.meta.control;
-      if (ctrl.cmd == Control::TERMINATE) {
-        PS_VLOG(1) << my_node_.ShortDebugString() << " is stopped";
-        ready_ = false;
-        break;
-      } else if (ctrl.cmd == Control::ADD_NODE) {
-        size_t num_nodes = Postoffice::Get()->num_servers() +
-                           Postoffice::Get()->num_workers();
-        auto dead_nodes = Postoffice::Get()->GetDeadNodes(heartbeat_timeout);
-        std::unordered_set<int> dead_set(dead_nodes.begin(), dead_nodes.end());
-        Meta recovery_nodes;  // store recovery nodes
-        recovery_nodes.control.cmd = Control::ADD_NODE;
-        // assign an id
-        if (msg.meta.sender == Meta::kEmpty) {
-          CHECK(is_scheduler_);
-          CHECK_EQ(ctrl.node.size(), 1);
-          if (nodes.control.node.size() < num_nodes) {
-            nodes.control.node.push_back(ctrl.node[0]);
-          } else {
-            // some node dies and restarts
-            CHECK(ready_);
-            for (size_t i = 0; i < nodes.control.node.size() - 1; ++i) {
-              const auto& node = nodes.control.node[i];
-              if (dead_set.find(node.id) != dead_set.end() && node.role == ctrl.node[0].role) {
-                auto& recovery_node = ctrl.node[0];
-                // assign previous node id
-                recovery_node.id = node.id;
-                recovery_node.is_recovery = true;
-                PS_VLOG(1) << "replace dead node " << node.DebugString()
-                           << " by node " << recovery_node.DebugString();
-                nodes.control.node[i] = recovery_node;
-                recovery_nodes.control.node.push_back(recovery_node);
-                break;
-              }
+    if (msg.meta.control.empty()) {
+      Dispatch(msg);
+      continue;
+    }
+    // a burst of data messages does not delay the control messages, nor
+    // does a barrier sending to every node delay the data messages
+    bool terminate = msg.meta.control.cmd == Control::TERMINATE;
+    control_queue_.Push(std::move(msg));
+    if (terminate) break;
+  }
+}
+
+void Van::Controlling() {
+  const char* heartbeat_timeout_val = Environment::Get()->find("PS_HEARTBEAT_TIMEOUT");
+  const int heartbeat_timeout
+      = heartbeat_timeout_val ? atoi(heartbeat_timeout_val) : kDefaultHeartbeatInterval;
+  Meta nodes;  // for scheduler usage
+  while (true) {
+    Message msg;
+    control_queue_.WaitAndPop(&msg);
+    // do some management
+    auto& ctrl = msg.meta.control;
+    if (ctrl.cmd == Control::TERMINATE) {
+      PS_VLOG(1) << my_node_.ShortDebugString() << " is stopped";
+      ready_ = false;
+      break;
+    } else if (ctrl.cmd == Control::ADD_NODE) {
+      size_t num_nodes = Postoffice::Get()->num_servers() +
+                         Postoffice::Get()->num_workers();
+      auto dead_nodes = Postoffice::Get()->GetDeadNodes(heartbeat_timeout);
+      std::unordered_set<int> dead_set(dead_nodes.begin(), dead_nodes.end());
+      Meta recovery_nodes;  // store recovery nodes
+      recovery_nodes.control.cmd = Control::ADD_NODE;
+      // assign an id
+      if (msg.meta.sender == Meta::kEmpty) {
+        CHECK(is_scheduler_);
+        CHECK_EQ(ctrl.node.size(), 1);
+        if (nodes.control.node.size() < num_nodes) {
+          nodes.control.node.push_back(ctrl.node[0]);
+        } else {
+          // some node dies and restarts
+          CHECK(ready_);
+          for (size_t i = 0; i < nodes.control.node.size() - 1; ++i) {
+            const auto& node = nodes.control.node[i];
+            if (dead_set.find(node.id) != dead_set.end() && node.role == ctrl.node[0].role) {
+              auto& recovery_node = ctrl.node[0];
+              // assign previous node id
+              recovery_node.id = node.id;
+              recovery_node.is_recovery = true;
+              PS_VLOG(1) << "replace dead node " << node.DebugString()
+                         << " by node " << recovery_node.DebugString();
+              nodes.control.node[i] = recovery_node;
+              recovery_nodes.control.node.push_back(recovery_node);
+              break;
             }
           }
         }
+      }
 
-        // update my id
-        for (size_t i = 0; i < ctrl.node.size(); ++i) {
-          const auto& node = ctrl.node[i];
-          if (my_node_.hostname == node.hostname &&
-              my_node_.port == node.port) {
-            my_node_ = node;
-            std::string rank = std::to_string(Postoffice::IDtoRank(node.id));
+      // update my id
+      for (size_t i = 0; i < ctrl.node.size(); ++i) {
+        const auto& node = ctrl.node[i];
+        if (my_node_.hostname == node.hostname &&
+            my_node_.port == node.port) {
+          my_node_ = node;
+          std::string rank = std::to_string(Postoffice::IDtoRank(node.id));
 #ifdef _MSC_VER
-            _putenv_s("DMLC_RANK", rank.c_str());
+          _putenv_s("DMLC_RANK", rank.c_str());
 #else
-            setenv("DMLC_RANK", rank.c_str(), true);
+          setenv("DMLC_RANK", rank.c_str(), true);
 #endif
-          }
         }
+      }
 
-        if (is_scheduler_) {
-          time_t t = time(NULL);
-          if (nodes.control.node.size() == num_nodes) {
-            // sort the nodes according their ip and port,
-            std::sort(nodes.control.node.begin(), nodes.control.node.end(),
-                      [](const Node& a, const Node& b) {
-                        return (a.hostname.compare(b.hostname) | (a.port < b.port)) > 0;
-                      });
-            // assign node rank
-            for (auto& node : nodes.control.node) {
-              CHECK_EQ(node.id, Node::kEmpty);
-              int id = node.role == Node::SERVER ?
-                       Postoffice::ServerRankToID(num_servers_) :
-                       Postoffice::WorkerRankToID(num_workers_);
-              PS_VLOG(1) << "assign rank=" << id << " to node " << node.DebugString();
-              node.id = id;
-              Connect(node);
-              if (node.role == Node::SERVER) ++num_servers_;
-              if (node.role == Node::WORKER) ++num_workers_;
-              Postoffice::Get()->UpdateHeartbeat(node.id, t);
-            }
-            nodes.control.node.push_back(my_node_);
-            nodes.control.cmd = Control::ADD_NODE;
-            Message back; back.meta = nodes;
-            for (int r : Postoffice::Get()->GetNodeIDs(
-                     kWorkerGroup + kServerGroup)) {
-              back.meta.recver = r;
-              back.meta.timestamp = timestamp_++;
-              Send(back);
-            }
-            PS_VLOG(1) << "the scheduler is connected to "
-                    << num_workers_ << " workers and " << num_servers_ << " servers";
-            ready_ = true;
-          } else if (recovery_nodes.control.node.size() > 0) {
-            // send back the recovery node
-            CHECK_EQ(recovery_nodes.control.node.size(), 1);
-            Connect(recovery_nodes.control.node[0]);
-            Postoffice::Get()->UpdateHeartbeat(recovery_nodes.control.node[0].id, t);
-            Message back;
-            for (int r : Postoffice::Get()->GetNodeIDs(
-                     kWorkerGroup + kServerGroup)) {
-              if (r != recovery_nodes.control.node[0].id
-                    && dead_set.find(r) != dead_set.end()) {
-                // do not try to send anything to dead node
-                continue;
-              }
-              // only send recovery_node to nodes already exist
-              // but send all nodes to the recovery_node
-              back.meta = (r == recovery_nodes.control.node[0].id) ? nodes : recovery_nodes;
-              back.meta.recver = r;
-              back.meta.timestamp = timestamp_++;
-              Send(back);
-            }
+      if (is_scheduler_) {
+        time_t t = time(NULL);
+        if (nodes.control.node.size() == num_nodes) {
+          auto connect_begin = std::chrono::steady_clock::now();
+          std::vector<int> connect;
+          // sort the nodes according their ip and port,
+          std::sort(nodes.control.node.begin(), nodes.control.node.end(),
+                    [](const Node& a, const Node& b) {
+                      return (a.hostname.compare(b.hostname) | (a.port < b.port)) > 0;
+                    });
+          // assign node rank
+          for (auto& node : nodes.control.node) {
+            CHECK_EQ(node.id, Node::kEmpty);
+            int id = node.role == Node::SERVER ?
+                     Postoffice::ServerRankToID(num_servers_) :
+                     Postoffice::WorkerRankToID(num_workers_);
+            PS_VLOG(1) << "assign rank=" << id << " to node " << node.DebugString();
+            node.id = id;
+            if (AddPeer(node)) connect.push_back(id);
+            if (node.role == Node::SERVER) ++num_servers_;
+            if (node.role == Node::WORKER) ++num_workers_;
+            Postoffice::Get()->UpdateHeartbeat(node.id, t);
           }
-        } else {
-          for (const auto& node : ctrl.node) {
-            Connect(node);
-            if (!node.is_recovery && node.role == Node::SERVER) ++num_servers_;
-            if (!node.is_recovery && node.role == Node::WORKER) ++num_workers_;
+          if (!lazy_connect_) Preconnect(connect);
+          auto send_begin = std::chrono::steady_clock::now();
+          startup_connect_ms_ += ElapsedMs(connect_begin, send_begin);
+          nodes.control.node.push_back(my_node_);
+          nodes.control.cmd = Control::ADD_NODE;
+          // with a fanout, only the first nodes get the list from me, and
+          // pass it on, see ForwardNodes
+          size_t num_recvers = num_nodes;
+          if (bootstrap_fanout_ > 0) {
+            num_recvers = std::min(num_recvers, static_cast<size_t>(bootstrap_fanout_));
           }
-          PS_VLOG(1) << my_node_.ShortDebugString() << " is connected to others";
-          ready_ = true;
-        }
-      } else if (ctrl.cmd == Control::BARRIER) {
-        if (msg.meta.request) {
-          if (barrier_count_.empty()) {
-            barrier_count_.resize(8, 0);
+          Message back; back.meta = nodes;
+          for (size_t i = 0; i < num_recvers; ++i) {
+            back.meta.recver = nodes.control.node[i].id;
+            back.meta.timestamp = timestamp_++;
+            Send(back);
           }
-          int group = ctrl.barrier_group;
-          ++barrier_count_[group];
-          PS_VLOG(1) << "Barrier count for " << group << " : " << barrier_count_[group];
-          if (barrier_count_[group] ==
-              static_cast<int>(Postoffice::Get()->GetNodeIDs(group).size())) {
-            barrier_count_[group] = 0;
-            Message res;
-            res.meta.request = false;
-            res.meta.control.cmd = Control::BARRIER;
-            for (int r : Postoffice::Get()->GetNodeIDs(group)) {
-              res.meta.recver = r;
-              res.meta.timestamp = timestamp_++;
-              CHECK_GT(Send(res), 0);
+          PS_VLOG(1) << "the scheduler is connected to "
+                  << num_workers_ << " workers and " << num_servers_ << " servers"
+                  << ", and sent the node list to " << num_recvers << " of them in "
+                  << ElapsedMs(send_begin, std::chrono::steady_clock::now()) << " ms";
+          ready_ = true;
+        } else if (recovery_nodes.control.node.size() > 0) {
+          // send back the recovery node
+          CHECK_EQ(recovery_nodes.control.node.size(), 1);
+          AddPeer(recovery_nodes.control.node[0]);
+          Postoffice::Get()->UpdateHeartbeat(recovery_nodes.control.node[0].id, t);
+          Message back;
+          for (int r : Postoffice::Get()->GetNodeIDs(
+                   kWorkerGroup + kServerGroup)) {
+            if (r != recovery_nodes.control.node[0].id
+                  && dead_set.find(r) != dead_set.end()) {
+              // do not try to send anything to dead node
+              continue;
             }
+            // only send recovery_node to nodes already exist
+            // but send all nodes to the recovery_node
+            back.meta = (r == recovery_nodes.control.node[0].id) ? nodes : recovery_nodes;
+            back.meta.recver = r;
+            back.meta.timestamp = timestamp_++;
+            Send(back);
           }
-        } else {
-          Postoffice::Get()->Manage(msg);
         }
-      } else if (ctrl.cmd == Control::HEARTBEAT) {
-        time_t t = time(NULL);
-        for (auto &node : ctrl.node) {
-          Postoffice::Get()->UpdateHeartbeat(node.id, t);
-          if (is_scheduler_) {
-            Message heartbeat_ack;
-            heartbeat_ack.meta.recver = node.id;
-            heartbeat_ack.meta.control.cmd = Control::HEARTBEAT;
-            heartbeat_ack.meta.control.node.push_back(my_node_);
-            heartbeat_ack.meta.timestamp = timestamp_++;
-            // send back heartbeat
-            Send(heartbeat_ack);
+      } else {
+        auto connect_begin = std::chrono::steady_clock::now();
+        std::vector<int> connect;
+        bool recovery = false;
+        for (const auto& node : ctrl.node) {
+          if (AddPeer(node)) connect.push_back(node.id);
+          if (!node.is_recovery && node.role == Node::SERVER) ++num_servers_;
+          if (!node.is_recovery && node.role == Node::WORKER) ++num_workers_;
+          recovery |= node.is_recovery;
+        }
+        // only the node list of the first bootstrap is spread by the tree
+        if (bootstrap_fanout_ > 0 && !recovery && ctrl.node.size() == num_nodes + 1) {
+          ForwardNodes(msg);
+        }
+        if (!lazy_connect_) Preconnect(connect);
+        startup_connect_ms_ += ElapsedMs(connect_begin, std::chrono::steady_clock::now());
+        PS_VLOG(1) << my_node_.ShortDebugString() << " is connected to others";
+        ready_ = true;
+      }
+    } else if (ctrl.cmd == Control::BARRIER) {
+      if (msg.meta.request) {
+        if (barrier_count_.empty()) {
+          barrier_count_.resize(8, 0);
+        }
+        int group = ctrl.barrier_group;
+        ++barrier_count_[group];
+        PS_VLOG(1) << "Barrier count for " << group << " : " << barrier_count_[group];
+        if (barrier_count_[group] ==
+            static_cast<int>(Postoffice::Get()->GetNodeIDs(group).size())) {
+          barrier_count_[group] = 0;
+          Message res;
+          res.meta.request = false;
+          res.meta.control.cmd = Control::BARRIER;
+          for (int r : Postoffice::Get()->GetNodeIDs(group)) {
+            res.meta.recver = r;
+            res.meta.timestamp = timestamp_++;
+            CHECK_GT(Send(res), 0);
           }
         }
+      } else {
+        Postoffice::Get()->Manage(msg);
+      }
+    } else if (ctrl.cmd == Control::HEARTBEAT) {
+      time_t t = time(NULL);
+      for (auto &node : ctrl.node) {
+        Postoffice::Get()->UpdateHeartbeat(node.id, t);
+        if (is_scheduler_) {
+          Message heartbeat_ack;
+          heartbeat_ack.meta.recver = node.id;
+          heartbeat_ack.meta.control.cmd = Control::HEARTBEAT;
+          heartbeat_ack.meta.control.node.push_back(my_node_);
+          heartbeat_ack.meta.timestamp = timestamp_++;
+          // send back heartbeat
+          Send(heartbeat_ack);
+        }
       }
-    } else {
-      CHECK_NE(msg.meta.sender, Meta::kEmpty);
-      CHECK_NE(msg.meta.recver, Meta::kEmpty);
-      CHECK_NE(msg.meta.customer_id, Meta::kEmpty);
-      int id = msg.meta.customer_id;
-      auto* obj = Postoffice::Get()->GetCustomer(id, 5);
-      CHECK(obj) << "timeout (5 sec) to wait App " << id << " ready";
-      obj->Accept(msg);
     }
   }
 }
 
+void Van::ReceivingShard(int shard) {
+  while (true) {
+    Message msg;
+    int recv_bytes = RecvShardMsg(shard, &msg);
+    if (recv_bytes == -1) break;
+    if (Drop(msg)) continue;
+    recv_bytes_ += recv_bytes;
+    if (Postoffice::Get()->verbose() >= 2) {
+      PS_VLOG(2) << msg.DebugString();
+    }
+    if (resender_ && resender_->AddIncomming(msg)) continue;
+    if (!msg.meta.control.empty()) {
+      // the senders route all control messages to shard 0
+      LOG(WARNING) << "drop a control message received by shard " << shard
+                   << ": " << msg.DebugString();
+      continue;
+    }
+    Dispatch(msg);
+  }
+}
+
+bool Van::Drop(const Message& msg) {
+  if (!ready_ || drop_rate_ <= 0) return false;
+  unsigned seed = time(NULL) + my_node_.id;
+  if (rand_r(&seed) % 100 >= drop_rate_) return false;
+  LOG(WARNING) << "Drop message " << msg.DebugString();
+  return true;
+}
+
+void Van::Dispatch(const Message& msg) {
+  CHECK_NE(msg.meta.sender, Meta::kEmpty);
+  CHECK_NE(msg.meta.recver, Meta::kEmpty);
+  CHECK_NE(msg.meta.customer_id, Meta::kEmpty);
+  int id = msg.meta.customer_id;
+  auto* obj = Postoffice::Get()->GetCustomer(id, 5);
+  CHECK(obj) << "timeout (5 sec) to wait App " << id << " ready";
+  obj->Accept(msg);
+}
+
+/**
+ * \brief the fixed-size header of a data message meta, in host byte order
+ *
+ * it starts with a zero byte, which never begins a serialized protobuf, so
+ * that \ref Van::UnpackMeta can tell the two formats apart
+ */
+struct RawMeta {
+  /** \brief {0, 'M'} */
+  char tag[2];
+  /** \brief bit-or of the kRaw* flags */
+  uint8_t flags;
+  uint8_t num_data_type;
+  int32_t head;
+  int32_t customer_id;
+  int32_t timestamp;
+  int32_t iteration;
+  int32_t seq;
+  uint8_t data_type[4];
+};
+const int Van::kRawMetaSize;
+static const uint8_t kRawRequest = 1;
+static const uint8_t kRawPush = 2;
+static const uint8_t kRawSimpleApp = 4;
+/** \brief Meta::reliability is stored in the two flags from this bit */
+static const int kRawReliabilityShift = 3;
+static const uint8_t kRawBestEffortResponse = 32;
+
+bool Van::PackRawMeta(const Meta& meta, char* meta_buf, int* buf_size) {
+  static_assert(sizeof(RawMeta) == kRawMetaSize, "unexpected RawMeta size");
+  RawMeta raw;
+  if (!meta.control.empty() || meta.body.size() ||
+      meta.data_type.size() > sizeof(raw.data_type)) {
+    return false;
+  }
+  raw.tag[0] = 0;
+  raw.tag[1] = 'M';
+  raw.flags = (meta.request ? kRawRequest : 0) | (meta.push ? kRawPush : 0) |
+              (meta.simple_app ? kRawSimpleApp : 0) |
+              (meta.reliability << kRawReliabilityShift) |
+              (meta.best_effort_response ? kRawBestEffortResponse : 0);
+  raw.num_data_type = meta.data_type.size();
+  raw.head = meta.head;
+  raw.customer_id = meta.customer_id;
+  raw.timestamp = meta.timestamp;
+  raw.iteration = meta.iteration;
+  raw.seq = meta.seq;
+  memset(raw.data_type, 0, sizeof(raw.data_type));
+  for (size_t i = 0; i < meta.data_type.size(); ++i) {
+    raw.data_type[i] = meta.data_type[i];
+  }
+  memcpy(meta_buf, &raw, sizeof(raw));
+  *buf_size = sizeof(raw);
+  return true;
+}
+
 void Van::PackMeta(const Meta& meta, char** meta_buf, int* buf_size) {
+  char raw[kRawMetaSize];
+  if (PackRawMeta(meta, raw, buf_size)) {
+    *meta_buf = new char[*buf_size];
+    memcpy(*meta_buf, raw, *buf_size);
+    return;
+  }
   // convert into protobuf
   PBMeta pb;
   pb.set_head(meta.head);
@@ -352,7 +608,7 @@ void Van::PackMeta(const Meta& meta, char** meta_buf, int* buf_size) {
     ctrl->set_cmd(meta.control.cmd);
     if (meta.control.cmd == Control::BARRIER) {
       ctrl->set_barrier_group(meta.control.barrier_group);
-    } else if (meta.control.cmd == Control::ACK) {
+    } else if (meta.control.cmd == Control::ACK || meta.control.cmd == Control::NACK) {
       ctrl->set_msg_sig(meta.control.msg_sig);
     }
     for (const auto& n : meta.control.node) {
@@ -365,6 +621,9 @@ void Van::PackMeta(const Meta& meta, char** meta_buf, int* buf_size) {
     }
   }
   pb.set_iteration(meta.iteration);
+  pb.set_reliability(meta.reliability);
+  if (meta.seq != Meta::kEmpty) pb.set_seq(meta.seq);
+  if (meta.best_effort_response) pb.set_best_effort_response(true);
 
   // to string
   *buf_size = pb.ByteSize();
@@ -374,6 +633,31 @@ void Van::PackMeta(const Meta& meta, char** meta_buf, int* buf_size) {
 }
 
 void Van::UnpackMeta(const char* meta_buf, int buf_size, Meta* meta) {
+  if (buf_size >= 2 && meta_buf[0] == 0 && meta_buf[1] == 'M') {
+    CHECK_EQ(buf_size, kRawMetaSize) << "corrupted meta";
+    RawMeta raw;
+    memcpy(&raw, meta_buf, sizeof(raw));
+    CHECK_LE(raw.num_data_type, sizeof(raw.data_type)) << "corrupted meta";
+    meta->head = raw.head;
+    meta->customer_id = raw.customer_id;
+    meta->timestamp = raw.timestamp;
+    meta->iteration = raw.iteration;
+    meta->request = raw.flags & kRawRequest;
+    meta->push = raw.flags & kRawPush;
+    meta->simple_app = raw.flags & kRawSimpleApp;
+    meta->reliability = static_cast<Meta::Reliability>(
+        (raw.flags >> kRawReliabilityShift) & 3);
+    meta->best_effort_response = raw.flags & kRawBestEffortResponse;
+    meta->seq = raw.seq;
+    meta->body.clear();
+    meta->data_type.resize(raw.num_data_type);
+    for (int i = 0; i < raw.num_data_type; ++i) {
+      meta->data_type[i] = static_cast<DataType>(raw.data_type[i]);
+    }
+    meta->control.cmd = Control::EMPTY;
+    meta->fake = false;
+    return;
+  }
   // to protobuf
   PBMeta pb;
   CHECK(pb.ParseFromArray(meta_buf, buf_size))
@@ -410,101 +694,132 @@ void Van::UnpackMeta(const char* meta_buf, int buf_size, Meta* meta) {
     meta->control.cmd = Control::EMPTY;
   }
   meta->iteration = pb.iteration();
+  meta->reliability = static_cast<Meta::Reliability>(pb.reliability());
+  meta->seq = pb.has_seq() ? pb.seq() : Meta::kEmpty;
+  meta->best_effort_response = pb.best_effort_response();
 
   // as long as the message is unpacked from a buffer, it is not fake
   meta->fake = false;
 }
 
-void Van::PackMetaData(const Message& msg, int sender_id, uint8_t** data_buf, int* buf_size) {
-  // convert into protobuf
-  PBMetaData pb;
-  pb.set_head(msg.meta.head);
-  pb.set_sender_id(sender_id);
-  if (msg.meta.customer_id != Meta::kEmpty) pb.set_customer_id(msg.meta.customer_id);
-  if (msg.meta.timestamp != Meta::kEmpty) pb.set_timestamp(msg.meta.timestamp);
-  if (msg.meta.body.size()) pb.set_body(msg.meta.body);
-  pb.set_push(msg.meta.push);
-  pb.set_request(msg.meta.request);
-  pb.set_simple_app(msg.meta.simple_app);
-  for (auto d : msg.meta.data_type) pb.add_data_type(d);
-  if (!msg.meta.control.empty()) {
-    auto ctrl = pb.mutable_control();
-    ctrl->set_cmd(msg.meta.control.cmd);
-    if (msg.meta.control.cmd == Control::BARRIER) {
-      ctrl->set_barrier_group(msg.meta.control.barrier_group);
-    } else if (msg.meta.control.cmd == Control::ACK) {
-      ctrl->set_msg_sig(msg.meta.control.msg_sig);
-    }
-    for (const auto& n : msg.meta.control.node) {
-      auto p = ctrl->add_node();
-      p->set_id(n.id);
-      p->set_role(n.role);
-      p->set_port(n.port);
-      p->set_hostname(n.hostname);
-      p->set_is_recovery(n.is_recovery);
-    }
-  }
-  // data
-  for (auto d : msg.data) {
-    SArray<char>* data = new SArray<char>(d);
-    int data_size = data->size();
-    pb.add_data(data->data(), data_size);
+/**
+ * \brief the header of a message packed by \ref Van::PackMetaData
+ *
+ * it is followed by num_data uint64_t data sizes, the packed meta, and the
+ * data. the meta and every data are padded to 8 bytes, so that the data keep
+ * their alignment when they are referenced in place by the receiver
+ */
+struct MetaDataHeader {
+  /** \brief {0, 'D'} */
+  char tag[2];
+  uint16_t num_data;
+  int32_t sender;
+  int32_t meta_size;
+  int32_t reserved;
+};
+
+static inline size_t Align8(size_t n) {
+  return (n + 7) & ~static_cast<size_t>(7);
+}
+
+size_t Van::PackMetaDataHead(const Message& msg, int sender_id, std::string* head) {
+  int meta_size;
+  char raw_meta[kRawMetaSize];
+  char* meta_buf = raw_meta;
+  bool raw = PackRawMeta(msg.meta, raw_meta, &meta_size);
+  if (!raw) PackMeta(msg.meta, &meta_buf, &meta_size);
+
+  MetaDataHeader h;
+  h.tag[0] = 0;
+  h.tag[1] = 'D';
+  h.num_data = msg.data.size();
+  CHECK_EQ(h.num_data, msg.data.size()) << "too many data";
+  h.sender = sender_id;
+  h.meta_size = meta_size;
+  h.reserved = 0;
+  size_t head_size = sizeof(h) + msg.data.size() * sizeof(uint64_t) + Align8(meta_size);
+  head->assign(head_size, 0);
+  char* p = &(*head)[0];
+  memcpy(p, &h, sizeof(h));
+  p += sizeof(h);
+  for (const auto& d : msg.data) {
+    uint64_t data_size = d.size();
+    memcpy(p, &data_size, sizeof(data_size));
+    p += sizeof(data_size);
   }
+  memcpy(p, meta_buf, meta_size);
+  if (!raw) delete [] meta_buf;
 
-  // to string
-  *buf_size = pb.ByteSize();
-  *data_buf = new uint8_t[*buf_size+1];
-  CHECK(pb.SerializeToArray(*data_buf, *buf_size))
-      << "failed to serialize protbuf";
+  size_t size = head_size;
+  for (const auto& d : msg.data) size += Align8(d.size());
+  return size;
 }
 
-void Van::UnpackMetaData(const uint8_t* data_buf, int buf_size, Message* msg) {
-  // to protobuf
-  PBMetaData pb;
-  CHECK(pb.ParseFromArray(data_buf, buf_size))
-      << "failed to parse string into protobuf";
+void Van::PackMetaData(const Message& msg, int sender_id, uint8_t** data_buf, int* buf_size) {
+  std::string head;
+  size_t size = PackMetaDataHead(msg, sender_id, &head);
+  // the data are copied only once, straight into the send buffer
+  *buf_size = size;
+  CHECK_EQ(static_cast<size_t>(*buf_size), size) << "message too large";
+  *data_buf = new uint8_t[size];
+  uint8_t* p = *data_buf;
+  memcpy(p, head.data(), head.size());
+  p += head.size();
+  for (const auto& d : msg.data) {
+    memcpy(p, d.data(), d.size());
+    memset(p + d.size(), 0, Align8(d.size()) - d.size());
+    p += Align8(d.size());
+  }
+}
 
-  // to meta
-  msg->meta.head = pb.head();
-  msg->meta.sender = pb.sender_id();
-  msg->meta.customer_id = pb.has_customer_id() ? pb.customer_id() : Meta::kEmpty;
-  msg->meta.timestamp = pb.has_timestamp() ? pb.timestamp() : Meta::kEmpty;
-  msg->meta.request = pb.request();
-  msg->meta.push = pb.push();
-  msg->meta.simple_app = pb.simple_app();
-  msg->meta.body = pb.body();
-  msg->meta.data_type.resize(pb.data_type_size());
-  for (int i = 0; i < pb.data_type_size(); ++i) {
-    msg->meta.data_type[i] = static_cast<DataType>(pb.data_type(i));
+void Van::UnpackMetaData(const SArray<char>& buf, Message* msg) {
+  MetaDataHeader head;
+  CHECK_GE(buf.size(), sizeof(head)) << "corrupted message";
+  memcpy(&head, buf.data(), sizeof(head));
+  CHECK(head.tag[0] == 0 && head.tag[1] == 'D') << "corrupted message";
+  size_t pos = sizeof(head);
+  std::vector<uint64_t> data_size(head.num_data);
+  CHECK_LE(pos + data_size.size() * sizeof(uint64_t), buf.size())
+      << "corrupted message";
+  if (head.num_data) {
+    memcpy(data_size.data(), buf.data() + pos, data_size.size() * sizeof(uint64_t));
   }
-  if (pb.has_control()) {
-    const auto& ctrl = pb.control();
-    msg->meta.control.cmd = static_cast<Control::Command>(ctrl.cmd());
-    msg->meta.control.barrier_group = ctrl.barrier_group();
-    msg->meta.control.msg_sig = ctrl.msg_sig();
-    for (int i = 0; i < ctrl.node_size(); ++i) {
-      const auto& p = ctrl.node(i);
-      Node n;
-      n.role = static_cast<Node::Role>(p.role());
-      n.port = p.port();
-      n.hostname = p.hostname();
-      n.id = p.has_id() ? p.id() : Node::kEmpty;
-      n.is_recovery = p.is_recovery();
-      msg->meta.control.node.push_back(n);
-    }
-  } else {
-    msg->meta.control.cmd = Control::EMPTY;
+  pos += data_size.size() * sizeof(uint64_t);
+  CHECK_LE(pos + head.meta_size, buf.size()) << "corrupted message";
+  UnpackMeta(buf.data() + pos, head.meta_size, &msg->meta);
+  msg->meta.sender = head.sender;
+  pos += Align8(head.meta_size);
+  // zero-copy, the data reference the received buffer
+  msg->data.clear();
+  for (uint64_t size : data_size) {
+    CHECK_LE(pos + size, buf.size()) << "corrupted message";
+    msg->data.push_back(buf.segment(pos, pos + size));
+    pos += Align8(size);
   }
-  // data
-  // // debug
-  // LG << "pb.data_size(): " << pb.data_size();
-  for (int i = 0; i < pb.data_size(); ++i) {
-    // TODO: zero-copy
-    // TODO: flatbuffers
-    SArray<char> data;
-    data.CopyFrom(pb.data(i).c_str(), pb.data(i).size());
-    msg->data.push_back(data);
+}
+
+bool Van::UnpackPartialMetaData(const SArray<char>& buf,
+                                const std::function<bool(size_t, size_t)>& received,
+                                Message* msg) {
+  MetaDataHeader head;
+  if (buf.size() < sizeof(head) || !received(0, sizeof(head))) return false;
+  memcpy(&head, buf.data(), sizeof(head));
+  size_t pos = sizeof(head) + head.num_data * sizeof(uint64_t);
+  if (head.num_data == 0 || pos + head.meta_size > buf.size() ||
+      !received(0, pos + head.meta_size)) {
+    return false;
   }
+  uint64_t key_size;
+  memcpy(&key_size, buf.data() + sizeof(head), sizeof(key_size));
+  UnpackMeta(buf.data() + pos, head.meta_size, &msg->meta);
+  if (!msg->meta.control.empty() || msg->meta.simple_app) return false;
+  pos += Align8(head.meta_size);
+  if (pos + key_size > buf.size() || !received(pos, pos + key_size)) return false;
+  msg->meta.sender = head.sender;
+  msg->meta.fake = true;
+  msg->data.clear();
+  msg->data.push_back(buf.segment(pos, pos + key_size));
+  return true;
 }
 
 void Van::Heartbeat() {
@@ -8,7 +8,18 @@
 #include <stdlib.h>
 #include <thread>
 #include <string>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <sstream>
 #include "ps/internal/van.h"
+#include "ps/internal/postoffice.h"
+#include "./fragment.h"
+#include "./pacer.h"
 // #include "./meta_generated.h"
 #if _MSC_VER
 #define rand_r(x) rand()
@@ -34,49 +45,117 @@ inline void FreeData(void *data, void *hint) {
 
 /**
  * \brief ZMQ based implementation
+ *
+ * If environment variable PS_BATCH_SIZE is set to a positive number of bytes,
+ * small data messages to the same node are coalesced into a single batch frame
+ * of at most that size. A batch is flushed when it is full, when a message
+ * that cannot be batched is sent to the same node, or when its oldest message
+ * has waited PS_BATCH_TIMEOUT microseconds (default 100).
+ *
+ * If PS_ZMQ_STREAMS is larger than 1, that many connections are opened to
+ * every other node, and a message with at least PS_STRIPE_SIZE bytes of data
+ * is striped across them. The stripes go to different receive shards, if
+ * there are more than one, and each is received straight into its place in
+ * the reassembled message. So a striped message may arrive after the messages
+ * sent after it.
+ *
+ * If PS_RECV_SHARDS is larger than 1, that many ROUTER sockets are bound to
+ * the ports from the port of the node on, each received by its own thread.
+ * Control messages always go to the first one, and the data messages of a
+ * node go to the one picked by its id.
  */
 class ZMQVan : public Van {
  public:
   ZMQVan() { }
   virtual ~ZMQVan() { }
+  friend class HybridVan;
 
  protected:
   void Start() override {
-    // start zmq
-    context_ = zmq_ctx_new();
-    CHECK(context_ != NULL) << "create 0mq context failed";
-    zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
-    // zmq_ctx_set(context_, ZMQ_IO_THREADS, 4);
+    StartTransport();
     Van::Start();
   }
 
   void Stop() override {
     PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
+    stop_shards_ = true;
     Van::Stop();
+    StopTransport();
+  }
+
+  /** \brief create the context and start batching, no socket is opened */
+  void StartTransport() {
+    // start zmq
+    context_ = zmq_ctx_new();
+    CHECK(context_ != NULL) << "create 0mq context failed";
+    zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
+    num_streams_ = std::max(1, GetEnv("PS_ZMQ_STREAMS", 1));
+    stripe_size_ = GetEnv("PS_STRIPE_SIZE", 1 << 20);
+    num_recv_shards_ = std::max(1, GetEnv("PS_RECV_SHARDS", 1));
+    // a single io thread would serialize the streams again
+    if (num_streams_ > 1) zmq_ctx_set(context_, ZMQ_IO_THREADS, num_streams_);
+    batch_size_ = GetEnv("PS_BATCH_SIZE", 0);
+    batch_timeout_ = GetEnv("PS_BATCH_TIMEOUT", 100);
+    if (batch_size_ > 0) {
+      flusher_thread_ = std::unique_ptr<std::thread>(
+          new std::thread(&ZMQVan::Flushing, this));
+    }
+  }
+
+  /** \brief flush the pending batches, close all sockets and the context */
+  void StopTransport() {
+    // a lazy connect may still add a lane from another thread
+    std::vector<std::pair<int, std::shared_ptr<SendLane>>> lanes;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      lanes.assign(senders_.begin(), senders_.end());
+    }
+    if (flusher_thread_) {
+      stop_flusher_ = true;
+      flusher_thread_->join();
+      for (auto& it : lanes) {
+        std::lock_guard<std::mutex> lk(it.second->mu);
+        if (it.second->socket) FlushBatch(it.first, it.second.get());
+      }
+      PS_VLOG(1) << my_node_.ShortDebugString() << " " << BatchStats();
+    }
     // close sockets
     int linger = 0;
-    int rc = zmq_setsockopt(receiver_, ZMQ_LINGER, &linger, sizeof(linger));
-    CHECK(rc == 0 || errno == ETERM);
-    CHECK_EQ(zmq_close(receiver_), 0);
-    for (auto& it : senders_) {
-      int rc = zmq_setsockopt(it.second, ZMQ_LINGER, &linger, sizeof(linger));
+    for (auto& s : shards_) {
+      int rc = zmq_setsockopt(s->socket, ZMQ_LINGER, &linger, sizeof(linger));
+      CHECK(rc == 0 || errno == ETERM);
+      CHECK_EQ(zmq_close(s->socket), 0);
+    }
+    shards_.clear();
+    for (auto& it : lanes) {
+      std::lock_guard<std::mutex> lk(it.second->mu);
+      int rc = zmq_setsockopt(it.second->socket, ZMQ_LINGER, &linger, sizeof(linger));
       CHECK(rc == 0 || errno == ETERM);
-      CHECK_EQ(zmq_close(it.second), 0);
+      CHECK_EQ(zmq_close(it.second->socket), 0);
+      it.second->socket = nullptr;
+      if (it.second->data_socket) {
+        rc = zmq_setsockopt(it.second->data_socket, ZMQ_LINGER, &linger, sizeof(linger));
+        CHECK(rc == 0 || errno == ETERM);
+        CHECK_EQ(zmq_close(it.second->data_socket), 0);
+        it.second->data_socket = nullptr;
+      }
+      for (void* stripe : it.second->stripes) {
+        rc = zmq_setsockopt(stripe, ZMQ_LINGER, &linger, sizeof(linger));
+        CHECK(rc == 0 || errno == ETERM);
+        CHECK_EQ(zmq_close(stripe), 0);
+      }
+      it.second->stripes.clear();
     }
     zmq_ctx_destroy(context_);
   }
 
   int Bind(const Node& node, int max_retry) override {
-    receiver_ = zmq_socket(context_, ZMQ_ROUTER);
-    CHECK(receiver_ != NULL)
-        << "create receiver socket failed: " << zmq_strerror(errno);
     int local = GetEnv("DMLC_LOCAL", 0);
     std::string addr = local ? "ipc:///tmp/" : "tcp://*:";
     int port = node.port;
     unsigned seed = static_cast<unsigned>(time(NULL)+port);
     for (int i = 0; i < max_retry+1; ++i) {
-      auto address = addr + std::to_string(port);
-      if (zmq_bind(receiver_, address.c_str()) == 0) break;
+      if (BindShards(addr, port)) break;
       if (i == max_retry) {
         port = -1;
       } else {
@@ -91,55 +170,343 @@ class ZMQVan : public Van {
     CHECK_NE(node.port, node.kEmpty);
     CHECK(node.hostname.size());
     int id = node.id;
-    auto it = senders_.find(id);
-    if (it != senders_.end()) {
-      zmq_close(it->second);
+    {
+      // close the old lane, waiting for any in-flight send on it
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = senders_.find(id);
+      if (it != senders_.end()) {
+        std::lock_guard<std::mutex> lane_lk(it->second->mu);
+        zmq_close(it->second->socket);
+        it->second->socket = nullptr;
+        if (it->second->data_socket) zmq_close(it->second->data_socket);
+        it->second->data_socket = nullptr;
+        for (void* stripe : it->second->stripes) zmq_close(stripe);
+        it->second->stripes.clear();
+        senders_.erase(it);
+      }
+    }
+    std::shared_ptr<SendLane> lane(new SendLane());
+    lane->socket = ConnectSocket(node, node.port, "");
+    // my data go to the shard of the node picked by my rank. not by my id,
+    // which is odd for all workers and even for all servers
+    int data_port = node.port;
+    int shard = my_node_.id == Node::kEmpty ? 0 :
+                Postoffice::IDtoRank(my_node_.id) % num_recv_shards_;
+    if (shard) {
+      data_port += shard;
+      lane->data_socket = ConnectSocket(node, data_port, "");
+    }
+    // the stripes need distinct identities, which are only known after
+    // registration. no need to stripe messages to myself. stripe i goes to
+    // the i-th shard after mine, so the stripes are received in parallel
+    if (num_streams_ > 1 && my_node_.id != Node::kEmpty && node.id != my_node_.id) {
+      for (int i = 1; i < num_streams_; ++i) {
+        int port = node.port + (shard + i) % num_recv_shards_;
+        lane->stripes.push_back(ConnectSocket(node, port, "_" + std::to_string(i)));
+      }
+    }
+    std::lock_guard<std::mutex> lk(mu_);
+    senders_[id] = lane;
+  }
+
+  int SendMsg(const Message& msg) override {
+    // find the lane. the van-wide lock only covers the lookup, the send itself
+    // is serialized per destination socket
+    int id = msg.meta.recver;
+    CHECK_NE(id, Meta::kEmpty);
+    std::shared_ptr<SendLane> lane;
+    {
+      std::lock_guard<std::mutex> lk(mu_);
+      auto it = senders_.find(id);
+      if (it == senders_.end()) {
+        LOG(WARNING) << "there is no socket to node " << id;
+        return -1;
+      }
+      lane = it->second;
+    }
+    std::lock_guard<std::mutex> lk(lane->mu);
+    if (lane->socket == nullptr) {
+      LOG(WARNING) << "the socket to node " << id << " has been closed";
+      return -1;
+    }
+    if (Batchable(msg)) return AppendBatch(id, lane.get(), msg);
+    // keep the order with the messages already batched for this node
+    if (lane->batch_num && FlushBatch(id, lane.get()) == -1) return -1;
+    if (!msg.meta.control.empty()) return SendFrames(id, lane->socket, msg);
+    if (!lane->stripes.empty() && DataSize(msg) >= static_cast<size_t>(stripe_size_)) {
+      return SendStripes(id, lane.get(), msg);
     }
-    // worker doesn't need to connect to the other workers. same for server
-    if ((node.role == my_node_.role) &&
-        (node.id != my_node_.id)) {
-      return;
+    return SendFrames(id, DataSocket(lane.get()), msg);
+  }
+
+  int RecvMsg(Message* msg) override {
+    return RecvShardMsg(0, msg);
+  }
+
+  int NumRecvShards() override { return num_recv_shards_; }
+
+  int RecvShardMsg(int shard, Message* msg) override {
+    RecvShard* s = shards_[shard].get();
+    if (!s->unbatched.empty()) {
+      *msg = std::move(s->unbatched.front());
+      s->unbatched.pop_front();
+      return 0;
     }
+    msg->data.clear();
+    size_t recv_bytes = 0;
+    for (int i = 0; ; ++i) {
+      zmq_msg_t* zmsg = new zmq_msg_t;
+      CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
+      while (true) {
+        if (zmq_msg_recv(zmsg, s->socket, 0) != -1) break;
+        if (errno == EINTR) continue;
+        // only the shards other than 0 time out
+        if (errno == EAGAIN && i == 0) {
+          if (!stop_shards_) continue;
+          zmq_msg_close(zmsg);
+          delete zmsg;
+          return -1;
+        }
+        LOG(WARNING) << "failed to receive message. errno: "
+                     << errno << " " << zmq_strerror(errno);
+        return -1;
+      }
+      char* buf = CHECK_NOTNULL((char *)zmq_msg_data(zmsg));
+      size_t size = zmq_msg_size(zmsg);
+      recv_bytes += size;
+
+      if (i == 0) {
+        // identify
+        msg->meta.sender = GetNodeID(buf, size);
+        msg->meta.recver = my_node_.id;
+        CHECK(zmq_msg_more(zmsg));
+        zmq_msg_close(zmsg);
+        delete zmsg;
+      } else if (i == 1 && IsStripe(buf, size)) {
+        bool done = RecvStripe(s, buf, size, msg->meta.sender, msg, &recv_bytes);
+        zmq_msg_close(zmsg);
+        delete zmsg;
+        if (done) break;
+        // wait for the other stripes, the next frame starts a new message
+        msg->data.clear();
+        i = -1;
+      } else if (i == 1 && IsBatch(buf, size)) {
+        // a batch always comes as a single frame
+        CHECK(!zmq_msg_more(zmsg));
+        SArray<char> batch;
+        batch.reset(buf, size, [zmsg](char* buf) {
+            zmq_msg_close(zmsg);
+            delete zmsg;
+          });
+        Unbatch(batch, msg->meta.sender, msg->meta.recver, &s->unbatched);
+        CHECK(!s->unbatched.empty());
+        *msg = std::move(s->unbatched.front());
+        s->unbatched.pop_front();
+        break;
+      } else if (i == 1) {
+        // task
+        UnpackMeta(buf, size, &(msg->meta));
+        zmq_msg_close(zmsg);
+        bool more = zmq_msg_more(zmsg);
+        delete zmsg;
+        if (!more) break;
+      } else {
+        // zero-copy
+        SArray<char> data;
+        data.reset(buf, size, [zmsg, size](char* buf) {
+            zmq_msg_close(zmsg);
+            delete zmsg;
+          });
+        msg->data.push_back(data);
+        if (!zmq_msg_more(zmsg)) { break; }
+      }
+    }
+    return recv_bytes;
+  }
+
+ private:
+  /**
+   * \brief the send path to one node
+   *
+   * zmq sockets are not thread-safe, so every socket has its own lock. senders
+   * to different nodes never wait on each other, and a peer that blocks on a
+   * full HWM only stalls the threads sending to that peer.
+   */
+  struct SendLane {
+    void* socket = nullptr;
+    std::mutex mu;
+    /** \brief the pending batch frame, see \ref AppendBatch */
+    SArray<char> batch;
+    /** \brief number of messages in the pending batch */
+    int batch_num = 0;
+    /** \brief when the first message of the pending batch was added */
+    std::chrono::steady_clock::time_point batch_start;
+    /** \brief the other connections to the node, see \ref SendStripes */
+    std::vector<void*> stripes;
+    /** \brief the id of the next striped message to the node */
+    uint32_t stripe_id = 0;
+    /**
+     * \brief connected to the shard of the node receiving my data messages,
+     * nullptr if it is the shard receiving socket
+     */
+    void* data_socket = nullptr;
+  };
+
+  /**
+   * \brief the leading bytes of a batch frame.
+   *
+   * a frame holding a serialized meta never starts with a zero byte, so
+   * the two leading bytes are enough to tell a batch from a meta frame
+   */
+  struct BatchHeader {
+    char tag[2];
+    uint16_t reserved;
+    uint32_t num;
+  };
+  /**
+   * \brief the header of a message inside a batch frame. it is followed by
+   * num_data uint64_t data sizes, the meta, and then the data. the meta and
+   * every data are padded to 8 bytes, so that the unbatched data are aligned.
+   */
+  struct BatchRecord {
+    uint32_t meta_size;
+    uint32_t num_data;
+  };
+
+  /**
+   * \brief the first frame of a stripe. it is followed by num_data uint64_t
+   * data sizes if index is 0, and by num_pieces uint64_t positions of the
+   * pieces in the reassembled message, where every data is padded to 8 bytes.
+   * the next frames are the meta if index is 0, and then the pieces
+   */
+  struct StripeHeader {
+    char tag[2];
+    uint16_t num_stripes;
+    uint16_t index;
+    uint16_t num_data;
+    uint32_t num_pieces;
+    uint32_t msg_id;
+    uint64_t total;
+  };
+
+  /**
+   * \brief a striped message being reassembled. its stripes may be received
+   * by different shards, each writing its own part of buf
+   */
+  struct Striped {
+    SArray<char> buf;
+    Meta meta;
+    std::vector<uint64_t> data_size;
+    /** \brief guarded by striped_mu_ */
+    int num_got = 0;
+  };
+
+  /** \brief a ROUTER socket bound to my port plus its index */
+  struct RecvShard {
+    void* socket = nullptr;
+    /** \brief messages of a received batch not yet returned */
+    std::deque<Message> unbatched;
+  };
+
+  static size_t Align8(size_t n) { return (n + 7) & ~static_cast<size_t>(7); }
+
+  static void* DataSocket(SendLane* lane) {
+    return lane->data_socket ? lane->data_socket : lane->socket;
+  }
+
+  static size_t DataSize(const Message& msg) {
+    size_t size = 0;
+    for (const auto& d : msg.data) size += d.size();
+    return size;
+  }
+
+  static bool IsStripe(const char* buf, size_t size) {
+    return size >= sizeof(StripeHeader) && buf[0] == 0 && buf[1] == 'S';
+  }
+
+  static bool IsBatch(const char* buf, size_t size) {
+    return size >= sizeof(BatchHeader) && buf[0] == 0 && buf[1] == 'B';
+  }
+
+  /**
+   * \brief bind num_recv_shards_ ROUTER sockets to port, port+1, ...
+   * \return false if any of the ports is taken
+   */
+  bool BindShards(const std::string& addr, int port) {
+    for (auto& s : shards_) zmq_close(s->socket);
+    shards_.clear();
+    for (int i = 0; i < num_recv_shards_; ++i) {
+      std::unique_ptr<RecvShard> s(new RecvShard());
+      s->socket = zmq_socket(context_, ZMQ_ROUTER);
+      CHECK(s->socket != NULL)
+          << "create receiver socket failed: " << zmq_strerror(errno);
+      if (i > 0) {
+        // wake up periodically to check whether the van is stopped
+        int timeout = 100;
+        zmq_setsockopt(s->socket, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+      }
+      void* socket = s->socket;
+      shards_.push_back(std::move(s));
+      auto address = addr + std::to_string(port + i);
+      if (zmq_bind(socket, address.c_str()) != 0) return false;
+    }
+    return true;
+  }
+
+  /**
+   * \brief create a DEALER socket connected to the port of node
+   * \param suffix appended to the identity of the socket
+   */
+  void* ConnectSocket(const Node& node, int port, const std::string& suffix) {
     void *sender = zmq_socket(context_, ZMQ_DEALER);
     CHECK(sender != NULL)
         << zmq_strerror(errno)
         << ". it often can be solved by \"sudo ulimit -n 65536\""
         << " or edit /etc/security/limits.conf";
     if (my_node_.id != Node::kEmpty) {
-      std::string my_id = "ps" + std::to_string(my_node_.id);
+      std::string my_id = "ps" + std::to_string(my_node_.id) + suffix;
       zmq_setsockopt(sender, ZMQ_IDENTITY, my_id.data(), my_id.size());
     }
     // connect
-    std::string addr = "tcp://" + node.hostname + ":" + std::to_string(node.port);
+    std::string addr = "tcp://" + node.hostname + ":" + std::to_string(port);
     if (GetEnv("DMLC_LOCAL", 0)) {
-      addr = "ipc:///tmp/" + std::to_string(node.port);
+      addr = "ipc:///tmp/" + std::to_string(port);
     }
     if (zmq_connect(sender, addr.c_str()) != 0) {
       LOG(FATAL) <<  "connect to " + addr + " failed: " + zmq_strerror(errno);
     }
-    senders_[id] = sender;
+    return sender;
   }
 
-  int SendMsg(const Message& msg) override {
-    std::lock_guard<std::mutex> lk(mu_);
-    // find the socket
-    int id = msg.meta.recver;
-    CHECK_NE(id, Meta::kEmpty);
-    auto it = senders_.find(id);
-    if (it == senders_.end()) {
-      LOG(WARNING) << "there is no socket to node " << id;
-      return -1;
-    }
-    void *socket = it->second;
+  /** \brief whether to put msg into a batch instead of sending it directly */
+  bool Batchable(const Message& msg) {
+    if (batch_size_ <= 0 || !msg.meta.control.empty()) return false;
+    size_t data_size = 0;
+    for (const auto& d : msg.data) data_size += d.size();
+    return data_size * 2 <= static_cast<size_t>(batch_size_);
+  }
 
-    // send meta
-    int meta_size; char* meta_buf;
-    PackMeta(msg.meta, &meta_buf, &meta_size);
+  /**
+   * \brief send msg as an ordinary multi-frame zmq message. lane lock held
+   * \return the number of bytes sent, -1 if failed
+   */
+  int SendFrames(int id, void* socket, const Message& msg) {
+    // send meta. a raw meta is small enough to be stored inside the
+    // zmq_msg_t, so no allocation is needed for data messages
+    int meta_size;
+    char raw_meta[kRawMetaSize];
+    zmq_msg_t meta_msg;
+    if (PackRawMeta(msg.meta, raw_meta, &meta_size)) {
+      zmq_msg_init_size(&meta_msg, meta_size);
+      memcpy(zmq_msg_data(&meta_msg), raw_meta, meta_size);
+    } else {
+      char* meta_buf;
+      PackMeta(msg.meta, &meta_buf, &meta_size);
+      zmq_msg_init_data(&meta_msg, meta_buf, meta_size, FreeData, NULL);
+    }
     int tag = ZMQ_SNDMORE;
     int n = msg.data.size();
     if (n == 0) tag = 0;
-    zmq_msg_t meta_msg;
-    zmq_msg_init_data(&meta_msg, meta_buf, meta_size, FreeData, NULL);
     while (true) {
       if (zmq_msg_send(&meta_msg, socket, tag) == meta_size) break;
       if (errno == EINTR) continue;
@@ -171,52 +538,335 @@ class ZMQVan : public Van {
     return send_bytes;
   }
 
-  int RecvMsg(Message* msg) override {
+  /**
+   * \brief send a frame, retrying if interrupted
+   * \return false if failed
+   */
+  bool SendFrame(int id, void* socket, zmq_msg_t* frame, size_t size, int tag) {
+    while (true) {
+      if (zmq_msg_send(frame, socket, tag) == static_cast<int>(size)) break;
+      if (errno == EINTR) continue;
+      LOG(WARNING) << "failed to send message to node [" << id
+                   << "] errno: " << errno << " " << zmq_strerror(errno);
+      zmq_msg_close(frame);
+      return false;
+    }
+    zmq_msg_close(frame);
+    return true;
+  }
+
+  /**
+   * \brief split the data of msg into equal stripes, one per connection of
+   * the lane. the pieces of data are sent without copying. lane lock held
+   * \return the number of bytes sent, -1 if failed
+   */
+  int SendStripes(int id, SendLane* lane, const Message& msg) {
+    // the data as laid out in the reassembled message
+    std::vector<size_t> offset(msg.data.size());
+    size_t total = 0;
+    for (size_t i = 0; i < msg.data.size(); ++i) {
+      offset[i] = total;
+      total += Align8(msg.data[i].size());
+    }
+    size_t num_streams = lane->stripes.size() + 1;
+    size_t stripe = Align8((total + num_streams - 1) / num_streams);
+    size_t num_stripes = (total + stripe - 1) / stripe;
+    StripeHeader head;
+    head.tag[0] = 0;
+    head.tag[1] = 'S';
+    head.num_stripes = num_stripes;
+    head.msg_id = lane->stripe_id++;
+    head.total = total;
+    int send_bytes = 0;
+    for (size_t k = 0; k < num_stripes; ++k) {
+      void* socket = k == 0 ? DataSocket(lane) : lane->stripes[k - 1];
+      size_t begin = k * stripe, end = std::min(total, begin + stripe);
+      // the parts of the data within [begin, end)
+      std::vector<SArray<char>> pieces;
+      std::vector<uint64_t> pos;
+      for (size_t i = 0; i < msg.data.size(); ++i) {
+        size_t lo = std::max(begin, offset[i]);
+        size_t hi = std::min(end, offset[i] + msg.data[i].size());
+        if (lo >= hi) continue;
+        pieces.push_back(msg.data[i].segment(lo - offset[i], hi - offset[i]));
+        pos.push_back(lo);
+      }
+      head.index = k;
+      head.num_data = k == 0 ? msg.data.size() : 0;
+      head.num_pieces = pieces.size();
+      size_t head_size = sizeof(head) + (head.num_data + pos.size()) * sizeof(uint64_t);
+      zmq_msg_t head_msg;
+      zmq_msg_init_size(&head_msg, head_size);
+      char* p = static_cast<char*>(zmq_msg_data(&head_msg));
+      memcpy(p, &head, sizeof(head));
+      p += sizeof(head);
+      for (size_t i = 0; i < head.num_data; ++i) {
+        uint64_t data_size = msg.data[i].size();
+        memcpy(p, &data_size, sizeof(data_size));
+        p += sizeof(data_size);
+      }
+      if (pos.size()) memcpy(p, pos.data(), pos.size() * sizeof(uint64_t));
+      int tag = k == 0 || pieces.size() ? ZMQ_SNDMORE : 0;
+      if (!SendFrame(id, socket, &head_msg, head_size, tag)) return -1;
+      send_bytes += head_size;
+      if (k == 0) {
+        int meta_size;
+        char* meta_buf;
+        PackMeta(msg.meta, &meta_buf, &meta_size);
+        zmq_msg_t meta_msg;
+        zmq_msg_init_data(&meta_msg, meta_buf, meta_size, FreeData, NULL);
+        tag = pieces.size() ? ZMQ_SNDMORE : 0;
+        if (!SendFrame(id, socket, &meta_msg, meta_size, tag)) return -1;
+        send_bytes += meta_size;
+      }
+      for (size_t j = 0; j < pieces.size(); ++j) {
+        SArray<char>* data = new SArray<char>(pieces[j]);
+        size_t data_size = data->size();
+        zmq_msg_t data_msg;
+        zmq_msg_init_data(&data_msg, data->data(), data_size, FreeData, data);
+        tag = j + 1 < pieces.size() ? ZMQ_SNDMORE : 0;
+        if (!SendFrame(id, socket, &data_msg, data_size, tag)) return -1;
+        send_bytes += data_size;
+      }
+    }
+    return send_bytes;
+  }
+
+  /**
+   * \brief receive the rest frames of a stripe, whose first frame is buf.
+   * the pieces are received straight into the reassembled message
+   * \param msg the reassembled message if all stripes are received
+   * \return true if all stripes are received
+   */
+  bool RecvStripe(RecvShard* shard, const char* buf, size_t size, int sender,
+                  Message* msg, size_t* recv_bytes) {
+    StripeHeader head;
+    memcpy(&head, buf, sizeof(head));
+    size_t num = head.num_data + head.num_pieces;
+    CHECK_EQ(size, sizeof(head) + num * sizeof(uint64_t)) << "corrupted stripe";
+    std::vector<uint64_t> sizes(num);
+    if (num) memcpy(sizes.data(), buf + sizeof(head), num * sizeof(uint64_t));
+    uint64_t key = (static_cast<uint64_t>(sender) << 32) | head.msg_id;
+    std::shared_ptr<Striped> s;
+    {
+      std::lock_guard<std::mutex> lk(striped_mu_);
+      auto& ptr = striped_[key];
+      if (!ptr) {
+        ptr = std::make_shared<Striped>();
+        ptr->buf.resize(head.total);
+      }
+      s = ptr;
+    }
+    if (head.index == 0) {
+      zmq_msg_t frame;
+      zmq_msg_init(&frame);
+      while (zmq_msg_recv(&frame, shard->socket, 0) == -1) {
+        CHECK_EQ(errno, EINTR) << "failed to receive stripe: " << zmq_strerror(errno);
+      }
+      *recv_bytes += zmq_msg_size(&frame);
+      UnpackMeta(static_cast<const char*>(zmq_msg_data(&frame)),
+                 zmq_msg_size(&frame), &s->meta);
+      s->data_size.assign(sizes.begin(), sizes.begin() + head.num_data);
+      zmq_msg_close(&frame);
+    }
+    for (size_t j = 0; j < head.num_pieces; ++j) {
+      uint64_t pos = sizes[head.num_data + j];
+      CHECK_LE(pos, s->buf.size()) << "corrupted stripe";
+      size_t cap = s->buf.size() - pos;
+      int data_size;
+      while ((data_size = zmq_recv(shard->socket, s->buf.data() + pos, cap, 0)) == -1) {
+        CHECK_EQ(errno, EINTR) << "failed to receive stripe: " << zmq_strerror(errno);
+      }
+      CHECK_LE(static_cast<size_t>(data_size), cap) << "corrupted stripe";
+      *recv_bytes += data_size;
+    }
+    {
+      // the lock also makes the other stripes' writes visible
+      std::lock_guard<std::mutex> lk(striped_mu_);
+      if (++s->num_got < head.num_stripes) return false;
+      striped_.erase(key);
+    }
+    msg->meta = s->meta;
+    msg->meta.sender = sender;
+    msg->meta.recver = my_node_.id;
     msg->data.clear();
-    size_t recv_bytes = 0;
-    for (int i = 0; ; ++i) {
-      zmq_msg_t* zmsg = new zmq_msg_t;
-      CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
-      while (true) {
-        if (zmq_msg_recv(zmsg, receiver_, 0) != -1) break;
-        if (errno == EINTR) continue;
-        LOG(WARNING) << "failed to receive message. errno: "
-                     << errno << " " << zmq_strerror(errno);
+    size_t pos = 0;
+    for (uint64_t data_size : s->data_size) {
+      msg->data.push_back(s->buf.segment(pos, pos + data_size));
+      pos += Align8(data_size);
+    }
+    return true;
+  }
+
+  /**
+   * \brief append msg to the pending batch of the lane. lane lock held
+   * \return the number of bytes the message takes in the batch, -1 if failed
+   */
+  int AppendBatch(int id, SendLane* lane, const Message& msg) {
+    int meta_size;
+    char raw_meta[kRawMetaSize];
+    char* meta_buf = raw_meta;
+    bool raw = PackRawMeta(msg.meta, raw_meta, &meta_size);
+    if (!raw) PackMeta(msg.meta, &meta_buf, &meta_size);
+    size_t rec_size = sizeof(BatchRecord) + msg.data.size() * sizeof(uint64_t)
+                      + Align8(meta_size);
+    for (const auto& d : msg.data) rec_size += Align8(d.size());
+    if (lane->batch_num &&
+        lane->batch.size() + rec_size > static_cast<size_t>(batch_size_)) {
+      if (FlushBatch(id, lane) == -1) {
+        if (!raw) delete [] meta_buf;
         return -1;
       }
-      char* buf = CHECK_NOTNULL((char *)zmq_msg_data(zmsg));
-      size_t size = zmq_msg_size(zmsg);
-      recv_bytes += size;
+    }
+    if (lane->batch_num == 0) {
+      lane->batch = SArray<char>();
+      lane->batch.reserve(std::max(static_cast<size_t>(batch_size_),
+                                   sizeof(BatchHeader) + rec_size));
+      lane->batch.resize(sizeof(BatchHeader), 0);
+      lane->batch_start = std::chrono::steady_clock::now();
+    }
+    size_t pos = lane->batch.size();
+    lane->batch.resize(pos + rec_size, 0);
+    char* p = lane->batch.data() + pos;
+    BatchRecord rec;
+    rec.meta_size = meta_size;
+    rec.num_data = msg.data.size();
+    memcpy(p, &rec, sizeof(rec));
+    p += sizeof(rec);
+    for (const auto& d : msg.data) {
+      uint64_t data_size = d.size();
+      memcpy(p, &data_size, sizeof(data_size));
+      p += sizeof(data_size);
+    }
+    memcpy(p, meta_buf, meta_size);
+    p += Align8(meta_size);
+    if (!raw) delete [] meta_buf;
+    for (const auto& d : msg.data) {
+      memcpy(p, d.data(), d.size());
+      p += Align8(d.size());
+    }
+    ++lane->batch_num;
+    return rec_size;
+  }
 
-      if (i == 0) {
-        // identify
-        msg->meta.sender = GetNodeID(buf, size);
-        msg->meta.recver = my_node_.id;
-        CHECK(zmq_msg_more(zmsg));
-        zmq_msg_close(zmsg);
-        delete zmsg;
-      } else if (i == 1) {
-        // task
-        UnpackMeta(buf, size, &(msg->meta));
-        zmq_msg_close(zmsg);
-        bool more = zmq_msg_more(zmsg);
-        delete zmsg;
-        if (!more) break;
-      } else {
-        // zero-copy
-        SArray<char> data;
-        data.reset(buf, size, [zmsg, size](char* buf) {
-            zmq_msg_close(zmsg);
-            delete zmsg;
-          });
-        msg->data.push_back(data);
-        if (!zmq_msg_more(zmsg)) { break; }
+  /**
+   * \brief send the pending batch of the lane. lane lock held
+   * \return the number of bytes sent, -1 if failed
+   */
+  int FlushBatch(int id, SendLane* lane) {
+    int num = lane->batch_num;
+    if (num == 0) return 0;
+    lane->batch_num = 0;
+    BatchHeader head;
+    head.tag[0] = 0;
+    head.tag[1] = 'B';
+    head.reserved = 0;
+    head.num = num;
+    memcpy(lane->batch.data(), &head, sizeof(head));
+    SArray<char>* batch = new SArray<char>(lane->batch);
+    lane->batch = SArray<char>();
+    int size = batch->size();
+    zmq_msg_t batch_msg;
+    zmq_msg_init_data(&batch_msg, batch->data(), size, FreeData, batch);
+    while (true) {
+      if (zmq_msg_send(&batch_msg, DataSocket(lane), 0) == size) break;
+      if (errno == EINTR) continue;
+      LOG(WARNING) << "failed to send a batch of " << num << " messages to node ["
+                   << id << "] errno: " << errno << " " << zmq_strerror(errno);
+      zmq_msg_close(&batch_msg);
+      return -1;
+    }
+    zmq_msg_close(&batch_msg);
+    ++num_batches_;
+    num_batched_msgs_ += num;
+    num_batched_bytes_ += size;
+    int bucket = 0;
+    while ((num >> (bucket + 1)) && bucket + 1 < kNumBatchBuckets) ++bucket;
+    ++batch_hist_[bucket];
+    return size;
+  }
+
+  /**
+   * \brief split a received batch frame into messages, which are appended to
+   * out. the data of the messages share the memory of the frame
+   */
+  void Unbatch(const SArray<char>& batch, int sender, int recver,
+               std::deque<Message>* out) {
+    BatchHeader head;
+    memcpy(&head, batch.data(), sizeof(head));
+    size_t pos = sizeof(head);
+    for (uint32_t i = 0; i < head.num; ++i) {
+      CHECK_LE(pos + sizeof(BatchRecord), batch.size()) << "corrupted batch";
+      BatchRecord rec;
+      memcpy(&rec, batch.data() + pos, sizeof(rec));
+      pos += sizeof(rec);
+      std::vector<uint64_t> data_size(rec.num_data);
+      if (rec.num_data) {
+        CHECK_LE(pos + rec.num_data * sizeof(uint64_t), batch.size())
+            << "corrupted batch";
+        memcpy(data_size.data(), batch.data() + pos,
+               rec.num_data * sizeof(uint64_t));
+        pos += rec.num_data * sizeof(uint64_t);
+      }
+      CHECK_LE(pos + rec.meta_size, batch.size()) << "corrupted batch";
+      Message msg;
+      UnpackMeta(batch.data() + pos, rec.meta_size, &msg.meta);
+      msg.meta.sender = sender;
+      msg.meta.recver = recver;
+      pos += Align8(rec.meta_size);
+      for (uint64_t size : data_size) {
+        CHECK_LE(pos + size, batch.size()) << "corrupted batch";
+        msg.data.push_back(batch.segment(pos, pos + size));
+        pos += Align8(size);
       }
+      out->push_back(std::move(msg));
     }
-    return recv_bytes;
   }
 
- private:
+  /** \brief thread function flushing batches that waited too long */
+  void Flushing() {
+    auto timeout = std::chrono::microseconds(batch_timeout_);
+    auto wakeup = std::chrono::steady_clock::now() + timeout;
+    while (!stop_flusher_) {
+      std::this_thread::sleep_until(wakeup);
+      std::vector<std::pair<int, std::shared_ptr<SendLane>>> lanes;
+      {
+        std::lock_guard<std::mutex> lk(mu_);
+        lanes.assign(senders_.begin(), senders_.end());
+      }
+      // a batch started later is found by the next check at the latest
+      auto now = std::chrono::steady_clock::now();
+      wakeup = now + timeout;
+      for (auto& it : lanes) {
+        std::lock_guard<std::mutex> lk(it.second->mu);
+        if (!it.second->batch_num || !it.second->socket) continue;
+        auto deadline = it.second->batch_start + timeout;
+        if (deadline <= now) {
+          FlushBatch(it.first, it.second.get());
+        } else {
+          // sleep until the earliest deadline among the others
+          wakeup = std::min(wakeup, deadline);
+        }
+      }
+    }
+  }
+
+  /** \brief a summary of the achieved batch sizes */
+  std::string BatchStats() {
+    std::stringstream ss;
+    size_t num = num_batches_;
+    ss << "sent " << num_batched_msgs_ << " messages in " << num << " batches";
+    if (num) {
+      ss << ", avg " << static_cast<double>(num_batched_msgs_) / num
+         << " messages and " << num_batched_bytes_ / num << " bytes per batch";
+    }
+    ss << ". batch size histogram:";
+    for (int i = 0; i < kNumBatchBuckets; ++i) {
+      ss << " [" << (1 << i) << ", " << (1 << (i + 1)) << "): " << batch_hist_[i];
+    }
+    return ss.str();
+  }
+
   /**
    * return the node id given the received identity
    * \return -1 if not find
@@ -232,18 +882,45 @@ class ZMQVan : public Van {
           break;
         }
       }
-      if (i == size) return id;
+      // the stripes of a node have a suffix, see \ref ConnectSocket
+      if (i == size || buf[i] == '_') return id;
     }
     return Meta::kEmpty;
   }
 
   void *context_ = nullptr;
   /**
-   * \brief node_id to the socket for sending data to this node
+   * \brief node_id to the lane for sending data to this node
    */
-  std::unordered_map<int, void*> senders_;
+  std::unordered_map<int, std::shared_ptr<SendLane>> senders_;
+  /** \brief protects senders_ */
   std::mutex mu_;
-  void *receiver_ = nullptr;
+  std::vector<std::unique_ptr<RecvShard>> shards_;
+  /** \brief the number of sockets bound to my ports */
+  int num_recv_shards_ = 1;
+  std::atomic<bool> stop_shards_{false};
+  /** \brief sender and message id to the striped messages being received */
+  std::unordered_map<uint64_t, std::shared_ptr<Striped>> striped_;
+  /** \brief protects striped_ */
+  std::mutex striped_mu_;
+
+  /** \brief the max size of a batch in bytes, 0 means no batching */
+  int batch_size_ = 0;
+  /** \brief the max time in microsecond a message waits in a batch */
+  int batch_timeout_ = 100;
+  std::unique_ptr<std::thread> flusher_thread_;
+  std::atomic<bool> stop_flusher_{false};
+  /** \brief the number of connections to every other node */
+  int num_streams_ = 1;
+  /** \brief the min data size in bytes of a striped message */
+  int stripe_size_ = 1 << 20;
+  /** \brief batch counters, the histogram bucket i counts batches of
+   * [2^i, 2^(i+1)) messages */
+  static const int kNumBatchBuckets = 8;
+  std::atomic<size_t> num_batches_{0};
+  std::atomic<size_t> num_batched_msgs_{0};
+  std::atomic<size_t> num_batched_bytes_{0};
+  std::atomic<size_t> batch_hist_[kNumBatchBuckets] = {};
 }; // ZMQVan
 
 // TODO: udp must use join and set group
@@ -251,39 +928,83 @@ class ZMQUDPVan : public Van {
 public:
   ZMQUDPVan() { }
  virtual ~ZMQUDPVan() { }
+ friend class HybridVan;
 
 protected:
  void Start() override {
+   StartTransport();
+   Van::Start();
+ }
+
+ void Stop() override {
+   PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
+   Van::Stop();
+   StopTransport();
+ }
+
+ /** \brief create the context and the reassembler, no socket is opened */
+ void StartTransport() {
    // start zmq
    context_ = zmq_ctx_new();
    CHECK(context_ != NULL) << "create 0mq context failed";
    zmq_ctx_set(context_, ZMQ_MAX_SOCKETS, 65536);
    // TODO: join?
    // zmq_ctx_set(context_, ZMQ_IO_THREADS, 4);
-   Van::Start();
+   mtu_ = GetEnv("PS_UDP_MTU", kDefaultMTU);
+   CHECK(mtu_ <= kMaxMTU) << "PS_UDP_MTU is larger than the max zmq datagram";
+   reassembly_timeout_ = GetEnv("PS_UDP_REASSEMBLY_TIMEOUT", 200);
+   // Mbit/s to bytes per second
+   max_rate_ = GetEnv("PS_UDP_MAX_RATE", 10000) * 125000.0;
+   min_rate_ = GetEnv("PS_UDP_MIN_RATE", 10) * 125000.0;
+   report_interval_ = GetEnv("PS_UDP_REPORT_INTERVAL", 50);
+   // with PS_RESEND=1, the resender recovers all lost messages
+   bool partial = GetEnv("PS_RESEND", 0) != 1;
+   using namespace std::placeholders;
+   reassembler_ = std::unique_ptr<Reassembler>(new Reassembler(
+       reassembly_timeout_, partial,
+       std::bind(&ZMQUDPVan::UnpackMetaData, this, _1, _2),
+       std::bind(&ZMQUDPVan::UnpackPartialMetaData, this, _1, _2, _3)));
  }
 
- void Stop() override {
-   PS_VLOG(1) << my_node_.ShortDebugString() << " is stopping";
-   Van::Stop();
+ /** \brief close all sockets and the context */
+ void StopTransport() {
+   PS_VLOG(1) << my_node_.ShortDebugString() << " timed out "
+              << reassembler_->num_expired() << " incomplete messages, lost "
+              << reassembler_->num_lost_keys() << " keys";
    // close sockets
    int linger = 0;
    int rc = zmq_setsockopt(receiver_, ZMQ_LINGER, &linger, sizeof(linger));
    CHECK(rc == 0 || errno == ETERM);
    CHECK_EQ(zmq_close(receiver_), 0);
-   for (auto& it : senders_) {
-     int rc = zmq_setsockopt(it.second, ZMQ_LINGER, &linger, sizeof(linger));
+   std::vector<std::pair<int, std::shared_ptr<SendLane>>> lanes;
+   {
+     std::lock_guard<std::mutex> lk(mu_);
+     lanes.assign(senders_.begin(), senders_.end());
+   }
+   for (auto& it : lanes) {
+     std::lock_guard<std::mutex> lk(it.second->mu);
+     if (it.second->pacer) {
+       PS_VLOG(1) << my_node_.ShortDebugString() << " to node " << it.first
+                  << ": " << it.second->pacer->DebugString();
+     }
+     int rc = zmq_setsockopt(it.second->socket, ZMQ_LINGER, &linger, sizeof(linger));
      CHECK(rc == 0 || errno == ETERM);
-     CHECK_EQ(zmq_close(it.second), 0);
+     CHECK_EQ(zmq_close(it.second->socket), 0);
+     it.second->socket = nullptr;
    }
    zmq_ctx_destroy(context_);
  }
 
  int Bind(const Node& node, int max_retry) override {
+    // a hybrid van binds again on another port if its tcp one is taken
+    if (receiver_) zmq_close(receiver_);
     // for UDP, only dish is supported
     receiver_ = zmq_socket(context_, ZMQ_DISH);
     CHECK(receiver_ != NULL)
         << "create dish socket failed: " << zmq_strerror(errno);
+    // wake up periodically to time out incomplete messages
+    int timeout = std::max(1, reassembly_timeout_ / 2);
+    zmq_setsockopt(receiver_, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
     std::string addr = "udp://*:";
     int port = node.port;
     unsigned seed = static_cast<unsigned>(time(NULL)+port);
@@ -305,14 +1026,16 @@ protected:
    CHECK_NE(node.port, node.kEmpty);
    CHECK(node.hostname.size());
    int id = node.id;
-   auto it = senders_.find(id);
-   if (it != senders_.end()) {
-     zmq_close(it->second);
-   }
-   // worker doesn't need to connect to the other workers. same for server
-   if ((node.role == my_node_.role) &&
-       (node.id != my_node_.id)) {
-     return;
+   {
+     // close the old lane, waiting for any in-flight send on it
+     std::lock_guard<std::mutex> lk(mu_);
+     auto it = senders_.find(id);
+     if (it != senders_.end()) {
+       std::lock_guard<std::mutex> lane_lk(it->second->mu);
+       zmq_close(it->second->socket);
+       it->second->socket = nullptr;
+       senders_.erase(it);
+     }
    }
    // for UDP, only radio is supported
    void *sender = zmq_socket(context_, ZMQ_RADIO);
@@ -320,12 +1043,6 @@ protected:
        << zmq_strerror(errno)
        << ". it often can be solved by \"sudo ulimit -n 65536\""
        << " or edit /etc/security/limits.conf";
-   if (my_node_.id != Node::kEmpty) {
-    //  std::string my_id = "ps" + std::to_string(my_node_.id);
-    //  zmq_setsockopt(sender, ZMQ_IDENTITY, my_id.data(), my_id.size());
-    int zmq_rate = 4000;
-    zmq_setsockopt(sender, ZMQ_RATE, &zmq_rate, sizeof(int));
-   }
    // connect
    std::string addr = "udp://" + node.hostname + ":" + std::to_string(node.port);
    // TODO: need checking
@@ -335,20 +1052,30 @@ protected:
    if (zmq_connect(sender, addr.c_str()) != 0) {
      LOG(FATAL) <<  "connect to " + addr + " failed: " + zmq_strerror(errno);
    }
-   senders_[id] = sender;
+   std::shared_ptr<SendLane> lane(new SendLane());
+   lane->socket = sender;
+   if (max_rate_ > 0) {
+     lane->pacer = std::unique_ptr<Pacer>(
+         new Pacer(max_rate_, min_rate_, 16.0 * mtu_, report_interval_));
+   }
+   std::lock_guard<std::mutex> lk(mu_);
+   senders_[id] = lane;
  }
 
  int SendMsg(const Message& msg) override {
-   std::lock_guard<std::mutex> lk(mu_);
-   // find the socket
+   // find the lane
    int id = msg.meta.recver;
    CHECK_NE(id, Meta::kEmpty);
-   auto it = senders_.find(id);
-   if (it == senders_.end()) {
+   auto lane = GetLane(id);
+   if (!lane) {
      LOG(WARNING) << "there is no socket to node " << id;
      return -1;
    }
-   void *socket = it->second;
+   std::lock_guard<std::mutex> lk(lane->mu);
+   if (lane->socket == nullptr) {
+     LOG(WARNING) << "the socket to node " << id << " has been closed";
+     return -1;
+   }
 
   //  // debug
   //  int buf_size_fb; uint8_t* data_buf_fb;
@@ -356,80 +1083,217 @@ protected:
   //  Message msg_tmp;
   //  UnpackMetaDataFB(data_buf_fb, buf_size_fb, &msg_tmp);
 
-   // send meta
-   int buf_size; uint8_t* data_buf;
-
-   PackMetaData(msg, my_node_.id, &data_buf, &buf_size);
-  // flatbuffers::FlatBufferBuilder* flatbuf_builder = new flatbuffers::FlatBufferBuilder();
-  // PackMetaDataFB(flatbuf_builder, msg, my_node_.id, &data_buf, &buf_size);
-  // LG << "pack size: " << buf_size;
-
-  // debug
-  // int buf_size_fb; uint8_t* data_buf_fb;
-  // PackTestMsg(8, "abc", &data_buf_fb, &buf_size_fb);
-  // flatbuffers::FlatBufferBuilder* flatbuf_builder = new flatbuffers::FlatBufferBuilder();
-  // PackTestMsg(flatbuf_builder, 8, "abc", &data_buf, &buf_size);
-  // LG << "buf_size: " << buf_size;
-
-   int tag = 0;
-   zmq_msg_t metadata_msg;
-   zmq_msg_init_data(&metadata_msg, data_buf, buf_size, FreeData, NULL);
-  //  zmq_msg_init_data(&metadata_msg, data_buf, buf_size, FreeDataFB, static_cast<void*>(flatbuf_builder));
-   while (true) {
-     if (zmq_msg_set_group(&metadata_msg, ZMQ_GROUP_NAME) != 0) {
-      LOG(WARNING) << "failed to send message to node [" << id
-      << "] errno: " << errno << " " << zmq_strerror(errno);
-      return -1;
+   // split the message into datagrams, each byte is copied once
+   std::string head;
+   size_t size = PackMetaDataHead(msg, my_node_.id, &head);
+   if (size + sizeof(FragmentHeader) > static_cast<size_t>(mtu_) &&
+       KVFragmenter::IsKV(msg)) {
+     // runs of key-value pairs, so a lost datagram only loses its own keys
+     KVFragmenter frags(my_node_.id, lane->msg_id++, msg, head.size(), mtu_);
+     for (size_t i = 0; i < frags.num_frags(); ++i) {
+       Message run = frags.msg(i);
+       size_t run_size = PackMetaDataHead(run, my_node_.id, &head);
+       zmq_msg_t datagram;
+       zmq_msg_init_size(&datagram, sizeof(KVFragmentHeader) + run_size);
+       frags.Write(i, run, head, static_cast<char*>(zmq_msg_data(&datagram)));
+       if (!SendDatagram(lane.get(), id, &datagram)) return -1;
      }
-     if (zmq_msg_send(&metadata_msg, socket, tag) == buf_size) break;
-     if (errno == EINTR) continue;
-     LOG(WARNING) << "failed to send message to node [" << id
-                  << "] errno: " << errno << " " << zmq_strerror(errno);
-     return -1;
+     return size;
    }
-   zmq_msg_close(&metadata_msg);
-
-   return buf_size;
+   Fragmenter frags(my_node_.id, lane->msg_id++, head, msg.data, size, mtu_);
+   for (size_t i = 0; i < frags.num_frags(); ++i) {
+     zmq_msg_t datagram;
+     zmq_msg_init_size(&datagram, frags.size(i));
+     frags.Write(i, static_cast<char*>(zmq_msg_data(&datagram)));
+     if (!SendDatagram(lane.get(), id, &datagram)) return -1;
+   }
+   return size;
  }
 
  int RecvMsg(Message* msg) override {
    msg->data.clear();
-   size_t recv_bytes = 0;
-   zmq_msg_t* zmsg = new zmq_msg_t;
-   CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
+   // the rest parts of the datagram added last
+   if (reassembler_->PopReady(msg)) {
+     msg->meta.recver = my_node_.id;
+     return 0;
+   }
    while (true) {
-     if (zmq_msg_recv(zmsg, receiver_, 0) != -1 && strcmp(zmq_msg_group(zmsg), ZMQ_GROUP_NAME) == 0) break;
+     zmq_msg_t* zmsg = new zmq_msg_t;
+     CHECK(zmq_msg_init(zmsg) == 0) << zmq_strerror(errno);
+     if (zmq_msg_recv(zmsg, receiver_, 0) == -1) {
+       zmq_msg_close(zmsg);
+       delete zmsg;
+       if (errno == EINTR) continue;
+       if (errno == EAGAIN) {
+         Report();
+         if (PopExpired(msg)) return 0;
+         continue;
+       }
+       // the context is shut down
+       if (errno == ETERM) return -1;
+       LOG(WARNING) << "failed to receive message. errno: "
+                    << errno << " " << zmq_strerror(errno);
+       return -1;
+     }
+     if (strcmp(zmq_msg_group(zmsg), ZMQ_GROUP_NAME) != 0) {
+       zmq_msg_close(zmsg);
+       delete zmsg;
+       continue;
+     }
+     char* buf = CHECK_NOTNULL((char *)zmq_msg_data(zmsg));
+     size_t recv_bytes = zmq_msg_size(zmsg);
+
+     // zero-copy, the datagram is released when the last data referencing it is
+     SArray<char> datagram;
+     datagram.reset(buf, recv_bytes, [zmsg](char* buf) {
+         zmq_msg_close(zmsg);
+         delete zmsg;
+       });
+     if (recv_bytes >= 2 && buf[0] == 0 && buf[1] == 'R') {
+       OnReport(datagram);
+       continue;
+     }
+     bool done = reassembler_->Add(datagram, msg);
+     Report();
+     if (!done) {
+       if (PopExpired(msg)) return 0;
+       continue;
+     }
+     msg->meta.recver = my_node_.id;
+     return recv_bytes;
+   }
+ }
+
+private:
+ /**
+  * \brief the send path to one node, see \ref ZMQVan::SendLane
+  */
+ struct SendLane {
+   void* socket = nullptr;
+   std::mutex mu;
+   /** \brief the id of the next message sent to this node */
+   uint32_t msg_id = 0;
+   /** \brief nullptr if PS_UDP_MAX_RATE is 0 */
+   std::unique_ptr<Pacer> pacer;
+ };
+
+ std::shared_ptr<SendLane> GetLane(int id) {
+   std::lock_guard<std::mutex> lk(mu_);
+   auto it = senders_.find(id);
+   return it == senders_.end() ? nullptr : it->second;
+ }
+
+ /**
+  * \brief set the group and send a datagram, which is then closed. lane lock
+  * held
+  */
+ bool SendDatagram(SendLane* lane, int id, zmq_msg_t* datagram) {
+   if (lane->pacer) lane->pacer->Wait(zmq_msg_size(datagram));
+   while (true) {
+     if (zmq_msg_set_group(datagram, ZMQ_GROUP_NAME) != 0) break;
+     if (zmq_msg_send(datagram, lane->socket, 0) != -1) return true;
      if (errno == EINTR) continue;
-     LOG(WARNING) << "failed to receive message. errno: "
-                  << errno << " " << zmq_strerror(errno);
-     return -1;
+     break;
    }
-   uint8_t* buf = CHECK_NOTNULL((uint8_t *)zmq_msg_data(zmsg));
-   recv_bytes = zmq_msg_size(zmsg);
-  //  LG << "unpack size: " << recv_bytes;
+   LOG(WARNING) << "failed to send message to node [" << id
+                << "] errno: " << errno << " " << zmq_strerror(errno);
+   zmq_msg_close(datagram);
+   return false;
+ }
 
-   UnpackMetaData(buf, recv_bytes, msg);
-  // UnpackMetaDataFB(buf, recv_bytes, msg);
+ /**
+  * \brief report the datagrams received and lost from each sender to it,
+  * every report_interval_
+  */
+ void Report() {
+   if (max_rate_ <= 0) return;
+   auto now = std::chrono::steady_clock::now();
+   if (now - last_report_ < std::chrono::milliseconds(report_interval_)) return;
+   last_report_ = now;
+   std::unordered_map<int, Reassembler::Loss> loss;
+   reassembler_->PopLoss(&loss);
+   for (const auto& it : loss) {
+     auto lane = GetLane(it.first);
+     if (!lane) continue;
+     LossReport report;
+     report.tag[0] = 0;
+     report.tag[1] = 'R';
+     report.reserved = 0;
+     report.sender = my_node_.id;
+     report.received = it.second.received;
+     report.lost = it.second.lost;
+     zmq_msg_t datagram;
+     zmq_msg_init_size(&datagram, sizeof(report));
+     memcpy(zmq_msg_data(&datagram), &report, sizeof(report));
+     std::lock_guard<std::mutex> lk(lane->mu);
+     if (lane->socket == nullptr) {
+       zmq_msg_close(&datagram);
+       continue;
+     }
+     // reports are never paced
+     zmq_msg_set_group(&datagram, ZMQ_GROUP_NAME);
+     if (zmq_msg_send(&datagram, lane->socket, 0) == -1) zmq_msg_close(&datagram);
+   }
+ }
 
-  // // debug
-  // UnpackTestMsg(buf, recv_bytes);
+ /** \brief adjust the rate to the reporter */
+ void OnReport(const SArray<char>& datagram) {
+   LossReport report;
+   CHECK_GE(datagram.size(), sizeof(report)) << "corrupted datagram";
+   memcpy(&report, datagram.data(), sizeof(report));
+   auto lane = GetLane(report.sender);
+   if (lane && lane->pacer) lane->pacer->OnReport(report.received, report.lost);
+ }
 
-   zmq_msg_close(zmsg);
-   delete zmsg;
-   msg->meta.recver = my_node_.id;
-   return recv_bytes;
+ /**
+  * \brief time out incomplete messages. returns true if what is received of
+  * one of them is delivered to the application
+  */
+ bool PopExpired(Message* msg) {
+   auto now = std::chrono::steady_clock::now();
+   if (now - last_expire_ < std::chrono::milliseconds(reassembly_timeout_ / 2)) {
+     return false;
+   }
+   last_expire_ = now;
+   while (reassembler_->PopExpired(msg)) {
+     // the resender recovers the whole message
+     if (msg->meta.reliability == Meta::RELIABLE ||
+         msg->meta.reliability == Meta::NACK) {
+       continue;
+     }
+     PS_VLOG(1) << "lost a part of the message from node " << msg->meta.sender
+                << ", received: " << msg->DebugString();
+     msg->meta.recver = my_node_.id;
+     return true;
+   }
+   return false;
  }
 
-private:
+ /** \brief the default max datagram size */
+ static const int kDefaultMTU = 8000;
+ /** \brief the max datagram size of zmq, minus the group */
+ static const int kMaxMTU = 8192 - 16;
 
  void *context_ = nullptr;
  /**
-  * \brief node_id to the socket for sending data to this node
+  * \brief node_id to the lane for sending data to this node
   */
- std::unordered_map<int, void*> senders_;
+ std::unordered_map<int, std::shared_ptr<SendLane>> senders_;
+ /** \brief protects senders_ */
  std::mutex mu_;
  // as dish
  void *receiver_ = nullptr;
+ /** \brief the max size of a datagram */
+ int mtu_ = kDefaultMTU;
+ /** \brief the pacing rates in bytes per second, 0 disables pacing */
+ double max_rate_ = 0, min_rate_ = 0;
+ /** \brief the interval in millisecond between two loss reports */
+ int report_interval_ = 50;
+ std::chrono::steady_clock::time_point last_report_;
+ /** \brief timeout in millisecond of an incomplete message */
+ int reassembly_timeout_ = 200;
+ std::unique_ptr<Reassembler> reassembler_;
+ std::chrono::steady_clock::time_point last_expire_;
 
 //  void PackMetaDataFB(flatbuffers::FlatBufferBuilder* flatbuf_builder, const Message& msg, int sender_id, uint8_t** data_buf, int* buf_size) {
 //   // convert into flatbuf
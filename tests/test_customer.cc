@@ -0,0 +1,91 @@
+#include <atomic>
+#include <thread>
+#include "ps/ps.h"
+using namespace ps;
+
+std::atomic<int> num_handled{0};
+
+// a response of the request timestamp from a server
+void Respond(Customer* c, int timestamp) {
+  Message msg;
+  msg.meta.request = false;
+  msg.meta.customer_id = c->id();
+  msg.meta.timestamp = timestamp;
+  c->Accept(msg);
+}
+
+// finish the request timestamp through the receive thread
+void Finish(Customer* c, int timestamp) {
+  int num = NumServers() - c->NumResponse(timestamp);
+  for (int i = 0; i < num; ++i) Respond(c, timestamp);
+  c->WaitRequest(timestamp);
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  Customer c(1, [](const Message& msg) { ++num_handled; });
+
+  // the slots of finished requests are reused
+  int first = c.NewRequest(kServerGroup);
+  Finish(&c, first);
+  CHECK_EQ(c.NumResponse(first), NumServers());
+  int last = first;
+  for (int i = 0; i < 5000; ++i) {
+    last = c.NewRequest(kServerGroup);
+    Finish(&c, last);
+  }
+  CHECK_EQ(last, first + 5000);
+
+  // a late response to a recycled request is dropped
+  CHECK_EQ(c.NumResponse(first), 0);
+  int handled = num_handled;
+  Respond(&c, first);
+  Finish(&c, c.NewRequest(kServerGroup));
+  CHECK_EQ(num_handled, handled + NumServers());
+
+  // a request never finished does not hold the others back
+  int stuck = c.NewRequest(kServerGroup);
+  for (int i = 0; i < 5000; ++i) {
+    int ts = c.NewRequest(kServerGroup);
+    CHECK_NE(ts, stuck);
+    Finish(&c, ts);
+  }
+  CHECK_EQ(c.NumResponse(stuck), 0);
+
+  // many outstanding requests grow the ring, and all of them are kept
+  std::vector<int> ts;
+  for (int i = 0; i < 3000; ++i) ts.push_back(c.NewRequest(kServerGroup));
+  for (int i = 0; i < 3000; i += 2) Finish(&c, ts[i]);
+  for (int i = 0; i < 3000; i += 2) CHECK_EQ(c.NumResponse(ts[i]), NumServers());
+
+  // WaitAny returns the finished one
+  std::thread t([&c, &ts]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+      for (int i = 0; i < NumServers(); ++i) Respond(&c, ts[7]);
+    });
+  CHECK_EQ(c.WaitAny({ts[3], ts[7], ts[9]}), ts[7]);
+  t.join();
+  CHECK_EQ(c.WaitAny({ts[1], ts[6]}), ts[6]);
+
+  // WaitAll returns after all are finished
+  std::vector<int> rest;
+  for (int i = 1; i < 3000; i += 2) if (i != 7) rest.push_back(ts[i]);
+  std::thread u([&c, &rest]() {
+      for (int r : rest) {
+        for (int i = 0; i < NumServers(); ++i) Respond(&c, r);
+      }
+    });
+  c.WaitAll(rest);
+  for (int r : rest) CHECK_EQ(c.NumResponse(r), NumServers());
+  u.join();
+
+  Finish(&c, stuck);
+  LL << "done";
+}
+
+int main(int argc, char *argv[]) {
+  Start();
+  RunWorker();
+  Finalize();
+  return 0;
+}
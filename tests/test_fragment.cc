@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <thread>
+#include "ps/ps.h"
+#include "fragment.h"
+using namespace ps;
+
+const int kSender = 9;
+
+// a van only used to pack and unpack messages
+class PackVan : public Van {
+ public:
+  void Connect(const Node& node) override { }
+  int Bind(const Node& node, int max_retry) override { return 0; }
+  int RecvMsg(Message* msg) override { return -1; }
+  int SendMsg(const Message& msg) override { return -1; }
+
+  Reassembler* NewReassembler(int timeout, bool partial) {
+    using namespace std::placeholders;
+    return new Reassembler(
+        timeout, partial, std::bind(&PackVan::UnpackMetaData, this, _1, _2),
+        std::bind(&PackVan::UnpackPartialMetaData, this, _1, _2, _3));
+  }
+
+  // the datagrams of msg, split as a raw van does
+  std::vector<SArray<char>> Split(const Message& msg, uint32_t msg_id,
+                                  size_t mtu, bool kv) {
+    std::vector<SArray<char>> dgs;
+    std::string head;
+    size_t size = PackMetaDataHead(msg, kSender, &head);
+    if (kv) {
+      CHECK(KVFragmenter::IsKV(msg));
+      KVFragmenter frags(kSender, msg_id, msg, head.size(), mtu);
+      for (size_t i = 0; i < frags.num_frags(); ++i) {
+        Message run = frags.msg(i);
+        size_t run_size = PackMetaDataHead(run, kSender, &head);
+        SArray<char> dg(sizeof(KVFragmentHeader) + run_size);
+        frags.Write(i, run, head, dg.data());
+        CHECK_LE(dg.size(), mtu);
+        dgs.push_back(dg);
+      }
+    } else {
+      Fragmenter frags(kSender, msg_id, head, msg.data, size, mtu);
+      for (size_t i = 0; i < frags.num_frags(); ++i) {
+        SArray<char> dg(frags.size(i));
+        frags.Write(i, dg.data());
+        CHECK_LE(dg.size(), mtu);
+        dgs.push_back(dg);
+      }
+    }
+    return dgs;
+  }
+};
+
+Message NewMessage(bool with_lens) {
+  Message msg;
+  msg.meta.head = 3;
+  msg.meta.timestamp = 11;
+  msg.meta.request = true;
+  msg.meta.push = true;
+  int num = 1000;
+  SArray<Key> keys(num);
+  SArray<int> lens(num, 2);
+  // a value larger than most mtus, so it is split by offset
+  lens[num / 2] = 600;
+  int num_vals = with_lens ? 2 * (num - 1) + 600 : 2 * num;
+  SArray<float> vals(num_vals);
+  for (int i = 0; i < num; ++i) keys[i] = i * 3;
+  for (int i = 0; i < num_vals; ++i) vals[i] = i * .5;
+  msg.AddData(keys);
+  msg.AddData(vals);
+  if (with_lens) msg.AddData(lens);
+  return msg;
+}
+
+void CheckEqual(const Message& a, const Message& b) {
+  CHECK_EQ(a.meta.head, b.meta.head);
+  CHECK_EQ(a.meta.timestamp, b.meta.timestamp);
+  CHECK_EQ(a.data.size(), b.data.size());
+  for (size_t i = 0; i < a.data.size(); ++i) {
+    CHECK_EQ(a.data[i].size(), b.data[i].size());
+    CHECK_EQ(memcmp(a.data[i].data(), b.data[i].data(), a.data[i].size()), 0);
+  }
+}
+
+// the key-value pairs in msg are the ones sent
+void CheckKV(const Message& sent, const Message& msg) {
+  SArray<Key> all_keys(sent.data[0]), keys(msg.data[0]);
+  SArray<float> all_vals(sent.data[1]), vals(msg.data[1]);
+  bool has_lens = sent.data.size() == 3;
+  SArray<int> all_lens, lens;
+  if (has_lens) {
+    all_lens = sent.data[2];
+    lens = msg.data[2];
+    CHECK_EQ(lens.size(), keys.size());
+  }
+  size_t k = 0, pos = 0, all_pos = 0;
+  for (size_t i = 0; i < keys.size(); ++i) {
+    for (; all_keys[k] != keys[i]; ++k) all_pos += has_lens ? all_lens[k] : 2;
+    int len = has_lens ? all_lens[k] : 2;
+    if (has_lens) CHECK_EQ(lens[i], len);
+    for (int j = 0; j < len; ++j) CHECK_EQ(vals[pos + j], all_vals[all_pos + j]);
+    pos += len;
+  }
+  CHECK_EQ(pos, vals.size());
+}
+
+// add the datagrams, and return the messages and parts delivered
+std::vector<Message> AddAll(Reassembler* r, const std::vector<SArray<char>>& dgs) {
+  std::vector<Message> msgs;
+  Message msg;
+  for (const auto& dg : dgs) {
+    if (!r->Add(dg, &msg)) continue;
+    do msgs.push_back(msg); while (r->PopReady(&msg));
+  }
+  return msgs;
+}
+
+// the key-value pairs of the parts of a message, ordered by key
+Message Merge(std::vector<Message> parts) {
+  std::sort(parts.begin(), parts.end(), [](const Message& a, const Message& b) {
+      return SArray<Key>(a.data[0])[0] < SArray<Key>(b.data[0])[0];
+    });
+  Message msg;
+  msg.meta = parts[0].meta;
+  msg.data.resize(parts[0].data.size());
+  for (const auto& p : parts) {
+    for (size_t i = 0; i < p.data.size(); ++i) msg.data[i].append(p.data[i]);
+  }
+  return msg;
+}
+
+// msgs is sent, delivered whole or in parts of which only the last one
+// completes it
+void CheckComplete(const Message& sent, const std::vector<Message>& msgs, bool stream) {
+  CHECK(!msgs.empty());
+  if (!stream) CHECK_EQ(msgs.size(), 1);
+  for (size_t i = 0; i < msgs.size(); ++i) {
+    CHECK_EQ(msgs[i].meta.part, i + 1 < msgs.size());
+  }
+  CheckEqual(sent, stream ? Merge(msgs) : msgs[0]);
+}
+
+void Test(PackVan* van, bool kv, bool with_lens, size_t mtu) {
+  Message sent = NewMessage(with_lens);
+  std::mt19937 rng(mtu);
+  uint32_t msg_id = 0;
+
+  // reordered
+  std::unique_ptr<Reassembler> r(van->NewReassembler(20, true));
+  auto dgs = van->Split(sent, msg_id++, mtu, kv);
+  std::shuffle(dgs.begin(), dgs.end(), rng);
+  bool stream = kv && dgs.size() > 1;
+  CheckComplete(sent, AddAll(r.get(), dgs), stream);
+  if (dgs.size() == 1) return;
+
+  // a RELIABLE message is only delivered whole
+  Message reliable = sent;
+  reliable.meta.reliability = Meta::RELIABLE;
+  dgs = van->Split(reliable, msg_id++, mtu, kv);
+  std::shuffle(dgs.begin(), dgs.end(), rng);
+  CheckComplete(sent, AddAll(r.get(), dgs), false);
+
+  // duplicated
+  dgs = van->Split(sent, msg_id++, mtu, kv);
+  auto msgs = AddAll(r.get(), {dgs[0]});
+  auto rest = AddAll(r.get(), dgs);
+  msgs.insert(msgs.end(), rest.begin(), rest.end());
+  CheckComplete(sent, msgs, stream);
+
+  // lost, then expired
+  dgs = van->Split(sent, msg_id++, mtu, kv);
+  size_t lost = dgs.size() / 2;
+  msgs.clear();
+  for (size_t i = 0; i < dgs.size(); ++i) {
+    if (i == lost) continue;
+    rest = AddAll(r.get(), {dgs[i]});
+    msgs.insert(msgs.end(), rest.begin(), rest.end());
+  }
+  for (const auto& m : msgs) CHECK(m.meta.part);
+  Message msg;
+  CHECK(!r->PopExpired(&msg));
+  std::this_thread::sleep_for(std::chrono::milliseconds(40));
+  bool partial = r->PopExpired(&msg);
+  CHECK(!r->PopExpired(&msg));
+  CHECK_EQ(r->num_expired(), 1);
+  if (kv) {
+    // the pairs of the other runs are delivered as they arrive, the expired
+    // message only completes it
+    CHECK(partial);
+    CHECK(!msg.meta.part);
+    CHECK_EQ(msg.meta.timestamp, sent.meta.timestamp);
+    CHECK(msg.data.empty());
+    CHECK_GT(r->num_lost_keys(), 0);
+    if (msgs.size()) {
+      Message received = Merge(msgs);
+      CHECK_EQ(received.data.size(), sent.data.size());
+      CHECK_LT(received.data[0].size(), sent.data[0].size());
+      CheckKV(sent, received);
+    }
+  } else if (partial) {
+    CHECK(msgs.empty());
+    // only the keys
+    CHECK(msg.meta.fake);
+    CHECK_EQ(msg.data.size(), 1);
+    CHECK_EQ(msg.data[0].size(), sent.data[0].size());
+    CHECK_EQ(memcmp(msg.data[0].data(), sent.data[0].data(), msg.data[0].size()), 0);
+  }
+
+  // a late datagram of the expired message is dropped
+  CHECK(!r->Add(dgs[lost], &msg));
+
+  // the losses are reported per sender
+  std::unordered_map<int, Reassembler::Loss> loss;
+  r->PopLoss(&loss);
+  CHECK_EQ(loss[kSender].lost, 1);
+  r->PopLoss(&loss);
+  CHECK(loss.empty());
+
+  // a message arriving after a later one is not lost, even if it is behind
+  // a report
+  auto late = van->Split(sent, msg_id++, mtu, kv);
+  dgs = van->Split(sent, msg_id++, mtu, kv);
+  CheckComplete(sent, AddAll(r.get(), dgs), stream);
+  r->PopLoss(&loss);
+  CHECK_EQ(loss[kSender].lost, 0);
+  CheckComplete(sent, AddAll(r.get(), late), stream);
+  r->PopLoss(&loss);
+  CHECK_EQ(loss[kSender].lost, 0);
+  CHECK_EQ(loss[kSender].received, late.size());
+
+  // a whole missing message is counted as one lost datagram once it is
+  // still missing at the next report
+  van->Split(sent, msg_id++, mtu, kv);
+  dgs = van->Split(sent, msg_id++, mtu, kv);
+  CheckComplete(sent, AddAll(r.get(), dgs), stream);
+  r->PopLoss(&loss);
+  CHECK_EQ(loss[kSender].lost, 0);
+  CHECK_EQ(loss[kSender].received, dgs.size());
+  r->PopLoss(&loss);
+  CHECK_EQ(loss[kSender].lost, 1);
+}
+
+int main(int argc, char *argv[]) {
+  PackVan van;
+  for (size_t mtu : {256, 1400, 9000, 1 << 20}) {
+    Test(&van, false, false, mtu);
+    Test(&van, false, true, mtu);
+    Test(&van, true, false, mtu);
+    Test(&van, true, true, mtu);
+  }
+  LL << "done";
+  return 0;
+}
@@ -0,0 +1,66 @@
+#include "ps/ps.h"
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) return;
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0);
+
+  // init
+  int num = 10000;
+  int num_layers = 10;
+  std::vector<std::vector<Key>> keys(num_layers);
+  std::vector<std::vector<float>> vals(num_layers);
+
+  int rank = MyRank();
+  srand(rank + 7);
+  for (int l = 0; l < num_layers; ++l) {
+    for (int i = 0; i < num / num_layers; ++i) {
+      keys[l].push_back(kMaxKey / num * (l * num / num_layers + i) + rank);
+      vals[l].push_back(rand() % 1000);
+    }
+  }
+
+  // push all layers, then pull each layer once its pushes are finished
+  int repeat = 5;
+  std::vector<std::vector<float>> rets(num_layers);
+  std::vector<Future> pulls;
+  for (int l = 0; l < num_layers; ++l) {
+    std::vector<Future> pushes;
+    for (int i = 0; i < repeat; ++i) {
+      pushes.push_back(kv.PushAsync(keys[l], vals[l]));
+    }
+    pulls.push_back(Future::WhenAll(pushes).Then([&kv, &keys, &rets, l]() {
+          return kv.PullAsync(keys[l], &rets[l]);
+        }));
+  }
+  Future::WhenAll(pulls).Wait();
+
+  float res = 0;
+  for (int l = 0; l < num_layers; ++l) {
+    CHECK_EQ(rets[l].size(), vals[l].size());
+    for (size_t i = 0; i < vals[l].size(); ++i) {
+      res += fabs(rets[l][i] - vals[l][i] * repeat);
+    }
+  }
+  CHECK_LT(res / repeat, 1e-5);
+  LL << "error: " << res / repeat;
+}
+
+int main(int argc, char *argv[]) {
+  // setup server nodes
+  StartServer();
+  // start system
+  Start();
+  // run worker nodes
+  RunWorker();
+  // stop system
+  Finalize();
+  return 0;
+}
@@ -0,0 +1,77 @@
+#include <chrono>
+#include <thread>
+#include "ps/ps.h"
+#include "ps/internal/mpsc_queue.h"
+using namespace ps;
+
+// every producer's values are popped once and in order
+void TestProducers(size_t capacity, int num_producers, int num) {
+  MPSCQueue<int> q(capacity);
+  std::vector<std::thread> producers;
+  for (int p = 0; p < num_producers; ++p) {
+    producers.emplace_back([&q, p, num_producers, num]() {
+        for (int i = 0; i < num; ++i) q.Push(i * num_producers + p);
+      });
+  }
+  std::vector<int> next(num_producers, 0);
+  std::vector<int> values;
+  size_t total = static_cast<size_t>(num_producers) * num;
+  while (values.size() < total) {
+    size_t before = values.size();
+    CHECK_EQ(q.PopAll(&values), values.size() - before);
+    CHECK_LE(values.size(), total);
+  }
+  for (int v : values) {
+    int p = v % num_producers;
+    CHECK_EQ(v / num_producers, next[p]++);
+  }
+  for (auto& t : producers) t.join();
+  int v;
+  CHECK(!q.TryPop(&v));
+}
+
+// the consumer parks when it is empty, and is woken up by a push
+void TestPark() {
+  MPSCQueue<int> q(16);
+  for (int i = 0; i < 100; ++i) {
+    std::thread t([&q, i]() {
+        if (i % 2) std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        q.Push(i);
+      });
+    int v;
+    q.WaitAndPop(&v);
+    CHECK_EQ(v, i);
+    t.join();
+  }
+  // woken up by a priority push as well
+  std::thread t([&q]() {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      q.PushPriority(-1);
+    });
+  std::vector<int> values;
+  CHECK_EQ(q.PopAll(&values), 1);
+  CHECK_EQ(values[0], -1);
+  t.join();
+}
+
+// priority values go before the others, the latest first
+void TestPriority() {
+  MPSCQueue<std::string> q(4);
+  q.Push("a");
+  q.Push("b");
+  q.PushPriority("x");
+  q.PushPriority("y");
+  std::vector<std::string> values;
+  CHECK_EQ(q.PopAll(&values), 4);
+  CHECK(values == std::vector<std::string>({"y", "x", "a", "b"}));
+}
+
+int main(int argc, char *argv[]) {
+  // a small ring, so the producers block while it is full
+  TestProducers(8, 4, 100000);
+  TestProducers(4096, 8, 100000);
+  TestPark();
+  TestPriority();
+  LL << "done";
+  return 0;
+}
@@ -0,0 +1,57 @@
+#include "ps/ps.h"
+using namespace ps;
+
+void StartServer() {
+  if (!IsServer()) return;
+  auto server = new KVServer<float>(0);
+  server->set_request_handle(KVServerDefaultHandle<float>());
+  RegisterExitCallback([server](){ delete server; });
+}
+
+void RunWorker() {
+  if (!IsWorker()) return;
+  KVWorker<float> kv(0);
+  Van* van = Postoffice::Get()->van();
+  auto servers = Postoffice::Get()->GetNodeIDs(kServerGroup);
+  auto workers = Postoffice::Get()->GetNodeIDs(kWorkerGroup);
+  int my_id = van->my_node().id;
+  CHECK(van->IsConnected(kScheduler));
+  CHECK(van->IsConnected(my_id));
+
+  // nothing is sent to the servers yet, so they are connected only if
+  // PS_LAZY_CONNECT is 0
+  bool lazy = GetEnv("PS_LAZY_CONNECT", 1);
+  for (int id : servers) CHECK_EQ(van->IsConnected(id), !lazy);
+
+  // unknown nodes are skipped, connected ones are kept
+  van->Preconnect({});
+  van->Preconnect({-1, 100000});
+  van->Preconnect(servers);
+  for (int id : servers) CHECK(van->IsConnected(id));
+  van->Preconnect(servers);
+  for (int id : servers) CHECK(van->IsConnected(id));
+
+  // the other workers are not connected by talking to the servers
+  std::vector<Key> keys;
+  for (size_t i = 0; i < servers.size(); ++i) {
+    keys.push_back(kMaxKey / servers.size() * i + MyRank());
+  }
+  std::vector<float> vals(keys.size(), 1), rets;
+  kv.Wait(kv.Push(keys, vals));
+  kv.Wait(kv.Pull(keys, &rets));
+  CHECK_EQ(rets.size(), keys.size());
+  for (int id : workers) CHECK_EQ(van->IsConnected(id), id == my_id);
+  LL << "done";
+}
+
+int main(int argc, char *argv[]) {
+  // setup server nodes
+  StartServer();
+  // start system
+  Start();
+  // run worker nodes
+  RunWorker();
+  // stop system
+  Finalize();
+  return 0;
+}